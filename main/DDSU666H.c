@@ -2,6 +2,15 @@
  *	DDSU666H 
  *  (c) Fernando R (iambobot.com)
  * 	1.0.0 - June 2025 - created
+ * 	1.1.0 - responses decoded against their request, active power stream
+ *			shadow register image, values decoded on demand
+ *			multi-slave passive sniffer
+ *			opportunistic queries in the idle windows of the inverter polling
+ *			image behind a seqlock, readers never hold the RX task up
+ *			measurement store: capture time, updates and staleness of every field
+ *			active power and its time passed to the power callback
+ *			sample hook: every decoded value (DDSU666H_data_hook)
+ *			opportunistic query state under a lock, exception responses stop the queries
  *
  ** ************************************************************************************************
 **/
@@ -10,12 +19,18 @@
 #include <string.h>			// memset
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "esp_log.h"		// ESP_LOGW
+#include "esp_timer.h"		// esp_timer_get_time()
 
 #include "config.h"
 #include "modbus.h"
+#include "modbus_uart.h"
+#include "modbus_master.h"		// modbus_master_query_type
+#include "seqlock.h"
+#include "measurement.h"
 #include "DDSU666H.h"
 
 
@@ -135,7 +150,8 @@ DDSU666H response	0B 03 40
 
 ---------------------------------------------------------------------------------------------------
 **/
-static const int RX_BUF_SIZE = 128;
+void DDSU666H_rxdata_process(uint8_t* data, int len);
+static modbus_uart_type DDSU666H_uart;
 void DDSU666H_uart_init(void) 
 {
 	// DDSU666-H
@@ -145,17 +161,8 @@ void DDSU666H_uart_init(void)
 	// payload data bits, one CRC bit, and one stop bit (11 bits in total). 
 	
 	// UART 2
-    uart_config_t uart_config_2 = {
-        .baud_rate = 9600,
-        .data_bits = UART_DATA_8_BITS,
-        .parity    = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_DEFAULT,
-    };
-    ESP_ERROR_CHECK(uart_driver_install(UART_NUM_2, RX_BUF_SIZE * 2, 0, 0, NULL, 0));
-    ESP_ERROR_CHECK(uart_param_config(UART_NUM_2, &uart_config_2));
-    ESP_ERROR_CHECK(uart_set_pin(UART_NUM_2, GPIO_NUM_17, GPIO_NUM_16, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+	// TX GPIO 17, RX GPIO 16
+	modbus_uart_init(&DDSU666H_uart, UART_NUM_2, 9600, GPIO_NUM_17, GPIO_NUM_16, DDSU666H_rxdata_process);
 } // DDSU666H_uart_init()
 
 
@@ -168,137 +175,406 @@ void DDSU666H_uart_init(void)
 
 ---------------------------------------------------------------------------------------------------
 **/
-DDSU666H_data_type DDSU666H_data;
-uint16_t  DDSU666H_reg_request;
+static void (*DDSU666H_power_callback) (float power, int64_t time)= 0;
 
-int DDSU666H_rxdata_process( uint8_t* data, int rxBytes, int ix0)
+// Shadow register image: every register of the blocks read by the inverter, as received
+// 0x2006 has its own block, the inverter polls it every 250 ms and the block reads every few seconds
+static modbus_image_block_type DDSU666H_image_block[]= {
+	MODBUS_IMAGE_BLOCK(0x2000, 6),
+	MODBUS_IMAGE_BLOCK(0x2006, 2),		// active power
+	MODBUS_IMAGE_BLOCK(0x2008, 26),		// .. 0x2021
+	MODBUS_IMAGE_BLOCK(0x4000, 32),		// .. 0x401F
+	MODBUS_IMAGE_BLOCK(DDSU666H_EXTRA_START, DDSU666H_EXTRA_COUNT),		// opportunistic queries
+};
+static uint8_t DDSU666H_image_storage[2 * (6 + 2 + 26 + 32 + DDSU666H_EXTRA_COUNT)];
+static modbus_image_type DDSU666H_image;
+// Written by the RX task, read by the consumers with a consistent snapshot (seqlock.c)
+static seqlock_type DDSU666H_image_lock;
+
+// Every slave and function code on the bus, the inverter is the only master
+// modbus_sniffer_frame() matches each response to its request, DDSU666H_transaction() keeps the DDSU666-H ones
+static modbus_sniffer_type DDSU666H_sniffer;
+
+// Register map, sorted by register address
+// Register offset is 2 bytes although values are 4 bytes (float) in the response
+static const modbus_register_map_type DDSU666H_map[]= {
+	// 0x2000
+	MODBUS_REGISTER(DDSU666H_REG_VOLTAGE,				MODBUS_FLOAT32, 1.0, 	DDSU666H_data_type, Voltage),
+	MODBUS_REGISTER(DDSU666H_REG_CURRENT,				MODBUS_FLOAT32, 1.0, 	DDSU666H_data_type, Current),
+	MODBUS_REGISTER(DDSU666H_REG_ACTIVE_POWER,			MODBUS_FLOAT32, 1000.0, DDSU666H_data_type, ActivePower),
+	MODBUS_REGISTER(DDSU666H_REG_REACTIVE_POWER,		MODBUS_FLOAT32, 1000.0, DDSU666H_data_type, ReactivePower),
+	MODBUS_REGISTER(DDSU666H_REG_APPARENT_POWER,		MODBUS_FLOAT32, 1000.0, DDSU666H_data_type, ApparentPower),
+	MODBUS_REGISTER(DDSU666H_REG_POWER_FACTOR,			MODBUS_FLOAT32, 1000.0, DDSU666H_data_type, PowerFactor),
+	MODBUS_REGISTER(DDSU666H_REG_FRECUENCY,				MODBUS_FLOAT32, 1.0, 	DDSU666H_data_type, Frecuency),
+	// 0x4000
+	MODBUS_REGISTER(DDSU666H_REG_ACTIVE_IN_ELECTRICITY,	MODBUS_FLOAT32, 1.0, 	DDSU666H_data_type, ActiveInElectricity),
+	MODBUS_REGISTER(DDSU666H_REG_NEGATIVE_ACTIVE_ENERGY,MODBUS_FLOAT32, 1.0, 	DDSU666H_data_type, NegativeActiveEnergy),
+	MODBUS_REGISTER(DDSU666H_REG_POSITIVE_ACTIVE_ENERGY,MODBUS_FLOAT32, 1.0, 	DDSU666H_data_type, PositiveActiveEnergy),
+};
+
+// Decoded values with their capture time, read with DDSU666H_data_get()
+static DDSU666H_data_type DDSU666H_data;
+static measurement_field_type DDSU666H_fields[]= {
+	MEASUREMENT_FIELD(DDSU666H_data_type, Voltage,				DDSU666H_STALE_BLOCK_SEC * 1000),
+	MEASUREMENT_FIELD(DDSU666H_data_type, Current,				DDSU666H_STALE_BLOCK_SEC * 1000),
+	MEASUREMENT_FIELD(DDSU666H_data_type, ActivePower,			DDSU666H_STALE_POWER_MS),
+	MEASUREMENT_FIELD(DDSU666H_data_type, ReactivePower,		DDSU666H_STALE_BLOCK_SEC * 1000),
+	MEASUREMENT_FIELD(DDSU666H_data_type, ApparentPower,		DDSU666H_STALE_BLOCK_SEC * 1000),
+	MEASUREMENT_FIELD(DDSU666H_data_type, PowerFactor,			DDSU666H_STALE_BLOCK_SEC * 1000),
+	MEASUREMENT_FIELD(DDSU666H_data_type, Frecuency,			DDSU666H_STALE_BLOCK_SEC * 1000),
+	MEASUREMENT_FIELD(DDSU666H_data_type, ActiveInElectricity,	DDSU666H_STALE_ENERGY_SEC * 1000),
+	MEASUREMENT_FIELD(DDSU666H_data_type, NegativeActiveEnergy,	DDSU666H_STALE_ENERGY_SEC * 1000),
+	MEASUREMENT_FIELD(DDSU666H_data_type, PositiveActiveEnergy,	DDSU666H_STALE_ENERGY_SEC * 1000),
+};
+static measurement_store_type DDSU666H_store;
+
+// Request and response seen on the bus (RX task)
+static void DDSU666H_transaction(const modbus_sniffer_transaction_type *t, void *arg)
 {
-	int ix= ix0;
-	for(; ix<rxBytes && data[ix]!=DDSU666H_MODBUS_ADDRESS; ix++);
-	if(ix<rxBytes)
+	if(t->slave != DDSU666H_MODBUS_ADDRESS) return;
+	if(t->exception)
 	{
-		if(rxBytes - ix >= 8)
+		if(_VERBOSE_) fprintf(stdout, "\nDDSU666H %02X %04X exception %02X", t->function, t->start, t->exception);
+		return;
+	}
+	// read values and written values are both the register contents
+	if(t->function != DDSU666H_FC_READREGISTER && t->function != DDSU666H_FC_WRITESINGLEREGISTER && t->function != DDSU666H_FC_WRITEMULTIPLEREGISTERS) return;
+	// raw copy for the register consumers (DDSU666H_registers_read)
+	seqlock_write_begin(&DDSU666H_image_lock);
+	int n= modbus_image_store(&DDSU666H_image, t->start, t->data, t->count, t->response_time);
+	seqlock_write_end(&DDSU666H_image_lock);
+	// decoded values, stamped with the end of the response
+	measurement_samples_type samples= {.n= 0};
+	seqlock_write_begin(&DDSU666H_store.lock);
+	measurement_store_decode(&DDSU666H_store, DDSU666H_map, MODBUS_REGISTER_MAP_SIZE(DDSU666H_map), t->start, t->data, t->count, t->response_time, &samples);
+	seqlock_write_end(&DDSU666H_store.lock);
+	measurement_store_samples(&DDSU666H_store, &samples);
+	if(_VERBOSE_ && t->start != DDSU666H_REG_ACTIVE_POWER) fprintf(stdout, "\nregister %04X %d registers", t->start, n);
+	// active power stream (0x2006 polls and block reads)
+	if(DDSU666H_power_callback && t->start <= DDSU666H_REG_ACTIVE_POWER && t->start + t->count >= DDSU666H_REG_ACTIVE_POWER + 2)
+		DDSU666H_power_callback(record2float((uint8_t *) t->data + 2 * (DDSU666H_REG_ACTIVE_POWER - t->start)) * 1000.0f, t->response_time);
+} // DDSU666H_transaction
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   OPPORTUNISTIC QUERIES
+
+---------------------------------------------------------------------------------------------------
+The inverter polls the DDSU666-H all the time (0x2006 every 250-300 ms) and a collision on the bus
+makes it misbehave, so by default nothing is sent on UART2. With DDSU666H_OPPORTUNISTIC_QUERY:
+- the RX path learns the polling cadence: the idle gap between a response and the next request of
+  the inverter (last DDSU666H_OQ_GAPS gaps) and the DDSU666-H turnaround (decaying maximum)
+- right after a response of the DDSU666-H, if the shortest gap learned leaves room for our read 
+  (request + turnaround + response + DDSU666H_OQ_MARGIN_MS), the TX task sends it straight away
+- the response goes through the sniffer into the register image like the inverter's ones
+- any other frame or a CRC error before our response, or no response at all, is a collision: no 
+  more queries for DDSU666H_OQ_BACKOFF_SEC, doubled on every collision
+- an exception response: the meter does not have the range, no more queries at all
+The RX task (frames, CRC errors) and the TX task (send, timeout) both end a query: the state, the
+next query time and the backoff change under DDSU666H_oq_lock, so a query ends only once. The RX 
+task learns the cadence under the lock as well and the TX task works out the window from a 
+snapshot taken under it, the two tasks may run on different cores.
+**/
+#define DDSU666H_OQ_GAPS			64
+#define DDSU666H_CHAR_US			1042		// 9600 baud, 10 bits
+#define DDSU666H_T35_US				(35 * DDSU666H_CHAR_US / 10)
+
+#define DDSU666H_OQ_IDLE			0
+#define DDSU666H_OQ_SENT			1			// request on the bus
+#define DDSU666H_OQ_PENDING			2			// request known to the sniffer, waiting for the response
+
+typedef struct DDSU666H_oq_s
+{
+	// cadence
+	int64_t last_frame_end;
+	bool last_was_response;
+	int32_t gap_us[DDSU666H_OQ_GAPS];
+	uint32_t gaps;
+	int32_t turnaround_max_us;
+	// own query
+	volatile uint8_t state;
+	uint8_t request[8];
+	int64_t sent_time;
+	int64_t next_time;					// no query before
+	uint32_t backoff_sec;
+	uint32_t sent;
+	uint32_t ok;
+	uint32_t collisions;
+	uint32_t exceptions;				// the meter refused the range, queries stopped
+	uint32_t no_window;					// skipped, the idle window was too short
+} DDSU666H_oq_type;
+
+static DDSU666H_oq_type DDSU666H_oq;
+static portMUX_TYPE DDSU666H_oq_lock= portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t DDSU666H_TX_handle;
+
+// Our query is lost (RX or TX task), unless it has already ended
+static void DDSU666H_oq_collision(const char *reason)
+{
+	uint32_t backoff_sec= 0;
+	taskENTER_CRITICAL(&DDSU666H_oq_lock);
+	if(DDSU666H_oq.state != DDSU666H_OQ_IDLE)
+	{
+		backoff_sec= DDSU666H_oq.backoff_sec;
+		DDSU666H_oq.state= DDSU666H_OQ_IDLE;
+		DDSU666H_oq.collisions ++;
+		DDSU666H_oq.next_time= esp_timer_get_time() + 1000000LL * backoff_sec;
+		DDSU666H_oq.backoff_sec= backoff_sec * 2 > 86400 ? 86400 : backoff_sec * 2;
+	}
+	taskEXIT_CRITICAL(&DDSU666H_oq_lock);
+	if(backoff_sec) ESP_LOGW("DDSU666H", "opportunistic query %s, back off %lu s", reason, backoff_sec);
+} // DDSU666H_oq_collision
+
+// Every frame on the bus (RX task)
+static void DDSU666H_oq_frame(const uint8_t *data, int len, int64_t now)
+{
+	DDSU666H_oq_type *oq= &DDSU666H_oq;
+	int64_t start= now - len * DDSU666H_CHAR_US;
+	bool response= !(len == 8 && data[1] == DDSU666H_FC_READREGISTER);
+	bool ours= data[0] == DDSU666H_MODBUS_ADDRESS && data[1] == DDSU666H_FC_READREGISTER && len == 5 + 2 * DDSU666H_EXTRA_COUNT;
+	bool exception= data[0] == DDSU666H_MODBUS_ADDRESS && data[1] == (DDSU666H_FC_READREGISTER | 0x80) && len == 5;
+	bool due= false;
+	taskENTER_CRITICAL(&DDSU666H_oq_lock);
+	bool sent= oq->state == DDSU666H_OQ_SENT;
+	if(sent) oq->state= DDSU666H_OQ_PENDING;
+	bool pending= oq->state == DDSU666H_OQ_PENDING;
+	if(pending && ours)
+	{
+		oq->state= DDSU666H_OQ_IDLE;
+		oq->ok ++;
+		oq->backoff_sec= DDSU666H_OQ_BACKOFF_SEC;
+		oq->next_time= now + 1000000LL * DDSU666H_OQ_PERIOD_SEC;
+	}
+	else if(pending && exception)
+	{
+		// retrying would get the same answer
+		oq->state= DDSU666H_OQ_IDLE;
+		oq->exceptions ++;
+		oq->next_time= INT64_MAX;
+	}
+	if(pending)
+	{
+		// the gap after our own transaction says nothing about the inverter
+		oq->last_frame_end= now;
+		oq->last_was_response= false;
+	}
+	else
+	{
+		// learn the cadence
+		if(oq->last_frame_end)
 		{
-			// Function Code
-			if(data[ix + 1]== 0x03)
-			{
-				uint16_t reg= ENDIAN(*(uint16_t*)(data + ix + 2));
-				// is a request
-				// sent by the INVENTER
-				// do nothing
-				if((reg>=0x2000 && reg<=0x20FF) || (reg>=0x4000 && reg<=0x400F))
-				{
-					DDSU666H_reg_request= reg;
-					uint16_t ErrorCheck= data[ix + 7]<<8 | data[ix + 6];
-					uint16_t crc= CRC16( &data[ix], 8 - 2);
-					if(ErrorCheck == crc)
-					{
-						if(_VERBOSE_ && reg != 0x2006) fprintf(stdout, "\nRequest register= %04X bytes= %04X", reg, ENDIAN(*(uint16_t *)(data+ix+4)));
-					}
-					return ix + 8;
-				}
-				// is a response
-				// sent by the DDSU666H in response to the INVERTER's request
-				// then do record data into DDSU666H data structure
-				else
-				{
-					uint8_t bytecount= *(data + ix + 2);
-					if(ix + 3 + bytecount + 2 <=rxBytes)
-					{
-						uint16_t ErrorCheck= data[ix + 3 + bytecount + 1]<<8 | data[ix + 3 + bytecount];
-						uint16_t crc= CRC16( &data[ix], 3 + bytecount);
-						if(ErrorCheck == crc)
-						{
-							if(_VERBOSE_ &&  DDSU666H_reg_request != 0x2006) fprintf(stdout, "\nResponse= %d bytes %d %04X %04X %d", bytecount, bytecount/4, ErrorCheck, crc, rxBytes - (ix + 3 + bytecount + 2) );
-							
-							float value, v=0, a=0;
-							for(int i=0; i<(bytecount/4) && i<32; i++)
-							{
-								value= record2float( ix + data + 3 + 4*i);
-								if( DDSU666H_reg_request == 0x2000)
-								{
-									uint16_t reg= 0x2000 + 2 * i;
-									switch(reg)
-									{
-										case DDSU666H_REG_VOLTAGE: 			DDSU666H_data.Voltage= v= value; break;
-										case DDSU666H_REG_CURRENT: 			DDSU666H_data.Current= a= value; break;
-										case DDSU666H_REG_ACTIVE_POWER: 	DDSU666H_data.ActivePower= value * 1000.0; break;
-										case DDSU666H_REG_REACTIVE_POWER: 	DDSU666H_data.ReactivePower= value * 1000.0; break;
-										case DDSU666H_REG_APPARENT_POWER: 	DDSU666H_data.ApparentPower= value * 1000.0; break;
-										case DDSU666H_REG_POWER_FACTOR: 	DDSU666H_data.PowerFactor= value * 1000.0; break;
-										case DDSU666H_REG_FRECUENCY: 		DDSU666H_data.Frecuency= value;	break;
-									}
-									if(_VERBOSE_) fprintf(stdout, "\n0x%4X= %3.2f", reg, value); 
-								}
-								else if( DDSU666H_reg_request == 0x4000) 
-								{
-									uint16_t reg= 0x4000 + 2 * i;
-									switch(reg)
-									{
-										case DDSU666H_REG_ACTIVE_IN_ELECTRICITY: DDSU666H_data.ActiveInElectricity= value; break;
-										case DDSU666H_REG_NEGATIVE_ACTIVE_ENERGY: DDSU666H_data.NegativeActiveEnergy= value; break;
-										case DDSU666H_REG_POSITIVE_ACTIVE_ENERGY: DDSU666H_data.PositiveActiveEnergy= value; break;
-									}
-									if(_VERBOSE_) fprintf(stdout, "\n0x%4X= %3.2f", reg, value);
-								}
-							}
-//							if(_VERBOSE_ &&  DDSU666H_reg_request != 0x2006) fprintf(stdout, "\nRegister %04X",  DDSU666H_reg_request);
-							return (ix + 3 + bytecount + 2);
-						}
-					}				
-				}
-			}
+			int32_t gap= (int32_t) (start - oq->last_frame_end);
+			if(!response && oq->last_was_response) 
+				oq->gap_us[oq->gaps ++ % DDSU666H_OQ_GAPS]= gap;
+			else if(response && !oq->last_was_response) 
+				oq->turnaround_max_us= gap > oq->turnaround_max_us ? gap : oq->turnaround_max_us - oq->turnaround_max_us / 64;
 		}
+		oq->last_frame_end= now;
+		oq->last_was_response= response;
+		// the bus is idle from now until the next inverter request
+		due= response && data[0] == DDSU666H_MODBUS_ADDRESS && now >= oq->next_time;
 	}
-	return 0;
+	taskEXIT_CRITICAL(&DDSU666H_oq_lock);
+	if(sent) modbus_sniffer_request_sent(&DDSU666H_sniffer, oq->request, sizeof(oq->request), oq->sent_time);
+	if(pending)
+	{
+		if(exception) ESP_LOGW("DDSU666H", "opportunistic query %04X exception %02X, queries stopped", DDSU666H_EXTRA_START, data[2]);
+		else if(!ours) DDSU666H_oq_collision("collision");
+	}
+	else if(due && DDSU666H_TX_handle) xTaskNotifyGive(DDSU666H_TX_handle);
+} // DDSU666H_oq_frame
+
+// Shortest idle gap learned (us), -1 not enough samples yet
+// Call under DDSU666H_oq_lock
+static int32_t DDSU666H_oq_gap_min(void)
+{
+	if(DDSU666H_oq.gaps < DDSU666H_OQ_MIN_SAMPLES) return -1;
+	int n= DDSU666H_oq.gaps < DDSU666H_OQ_GAPS ? DDSU666H_oq.gaps : DDSU666H_OQ_GAPS;
+	int32_t gap= DDSU666H_oq.gap_us[0];
+	for(int i=1; i<n; i++) if(DDSU666H_oq.gap_us[i] < gap) gap= DDSU666H_oq.gap_us[i];
+	return gap;
+} // DDSU666H_oq_gap_min
+
+void DDSU666H_TX_task(void *arg)
+{
+	DDSU666H_oq_type *oq= &DDSU666H_oq;
+	// request, turnaround, response and the silences in between
+	while (1) 
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		int64_t now= esp_timer_get_time();
+		// cadence snapshot
+		taskENTER_CRITICAL(&DDSU666H_oq_lock);
+		bool due= oq->state == DDSU666H_OQ_IDLE && now >= oq->next_time;
+		int32_t gap= DDSU666H_oq_gap_min();
+		int32_t turnaround_max_us= oq->turnaround_max_us;
+		int64_t last_frame_end= oq->last_frame_end;
+		taskEXIT_CRITICAL(&DDSU666H_oq_lock);
+		if(!due || gap < 0) continue;
+		int32_t needed= (8 + 5 + 2 * DDSU666H_EXTRA_COUNT) * DDSU666H_CHAR_US + 2 * DDSU666H_T35_US + turnaround_max_us;
+		int32_t window= gap - (int32_t) (now - last_frame_end) - 1000 * DDSU666H_OQ_MARGIN_MS;
+		if(needed > window)
+		{
+			taskENTER_CRITICAL(&DDSU666H_oq_lock);
+			oq->no_window ++;
+			oq->next_time= now + 1000000LL * DDSU666H_OQ_PERIOD_SEC;
+			taskEXIT_CRITICAL(&DDSU666H_oq_lock);
+			continue;
+		}
+		modbus_master_query_type query= {
+			.Slave_Adress= DDSU666H_MODBUS_ADDRESS,
+			.Function_code= DDSU666H_FC_READREGISTER,
+			.Start_Address= ENDIAN(DDSU666H_EXTRA_START),
+			.Number_of_Points= ENDIAN(DDSU666H_EXTRA_COUNT),
+			.Error_Check= 0
+		};
+		query.Error_Check= CRC16((uint8_t *) &query, sizeof(query) - 2);
+		memcpy(oq->request, &query, sizeof(oq->request));
+		taskENTER_CRITICAL(&DDSU666H_oq_lock);
+		oq->sent_time= now;
+		oq->state= DDSU666H_OQ_SENT;
+		oq->sent ++;
+		taskEXIT_CRITICAL(&DDSU666H_oq_lock);
+		uart_write_bytes(UART_NUM_2, (char *) oq->request, sizeof(oq->request));
+		// no response in time, unless the RX task has ended the query meanwhile
+		vTaskDelay((needed / 1000 + DDSU666H_OQ_MARGIN_MS) / portTICK_PERIOD_MS + 1);
+		DDSU666H_oq_collision("timeout");
+	}
+} // DDSU666H_TX_task
+
+void DDSU666H_oq_printf(void)
+{
+	taskENTER_CRITICAL(&DDSU666H_oq_lock);
+	int32_t gap= DDSU666H_oq_gap_min();
+	uint32_t gaps= DDSU666H_oq.gaps;
+	int32_t turnaround_max_us= DDSU666H_oq.turnaround_max_us;
+	taskEXIT_CRITICAL(&DDSU666H_oq_lock);
+	fprintf(stdout, "\n   opportunistic query %s: gap min %ld us (%lu gaps) turnaround max %ld us", 
+		DDSU666H_OPPORTUNISTIC_QUERY ? "on" : "off", gap, gaps, turnaround_max_us);
+	fprintf(stdout, "\n   sent %lu ok %lu collisions %lu exceptions %lu%s no window %lu", DDSU666H_oq.sent, DDSU666H_oq.ok, DDSU666H_oq.collisions, 
+		DDSU666H_oq.exceptions, DDSU666H_oq.exceptions ? " (stopped)" : "", DDSU666H_oq.no_window);
+} // DDSU666H_oq_printf
+
+// Complete, CRC-checked frame from the frame assembler
+void DDSU666H_rxdata_process(uint8_t* data, int len)
+{
+	int64_t now= esp_timer_get_time();
+	DDSU666H_oq_frame(data, len, now);
+	modbus_sniffer_frame(&DDSU666H_sniffer, data, len, now);
 } // DDSU666H_rxdata_process
 
+// Latest values, fields never received are 0
+void DDSU666H_data_get(DDSU666H_data_type *data)
+{
+	measurement_store_get(&DDSU666H_store, data, 0);
+} // DDSU666H_data_get
+
+// Latest values and their capture times (snapshot may be 0)
+void DDSU666H_data_snapshot(DDSU666H_data_type *data, measurement_snapshot_type *snapshot)
+{
+	measurement_store_get(&DDSU666H_store, data, snapshot);
+} // DDSU666H_data_snapshot
+
+// Every decoded value with its capture time (us), called by the task that decodes
+void DDSU666H_data_hook(void (*sample) (void *arg, size_t offset, float value, int64_t time), void *arg)
+{
+	measurement_store_hook(&DDSU666H_store, sample, arg);
+} // DDSU666H_data_hook
+
+void DDSU666H_measurements_printf(void)
+{
+	measurement_store_printf(&DDSU666H_store);
+} // DDSU666H_measurements_printf
+
+// Raw registers in wire order, for consumers that forward them as they are
+// time		update time (us) of the oldest block involved
+// return	0 ok, -1 not available
+int DDSU666H_registers_read(uint16_t start, uint16_t count, uint8_t *dst, int64_t *time)
+{
+	uint32_t sequence;
+	int r;
+	do
+	{
+		sequence= seqlock_read_begin(&DDSU666H_image_lock);
+		r= modbus_image_read(&DDSU666H_image, start, count, dst, time);
+	} while(seqlock_read_retry(&DDSU666H_image_lock, sequence));
+	return r;
+} // DDSU666H_registers_read
+
+// Age of the value in register reg (ms), -1 never received
+int32_t DDSU666H_age_ms(uint16_t reg)
+{
+	uint32_t sequence;
+	int64_t time;
+	do
+	{
+		sequence= seqlock_read_begin(&DDSU666H_image_lock);
+		time= modbus_image_time(&DDSU666H_image, reg);
+	} while(seqlock_read_retry(&DDSU666H_image_lock, sequence));
+	return time ? (int32_t) ((esp_timer_get_time() - time) / 1000) : -1;
+} // DDSU666H_age_ms
+
+void DDSU666H_image_printf(void)
+{
+	for(int i=0; i<DDSU666H_image.n; i++)
+	{
+		modbus_image_block_type *b= &DDSU666H_image.block[i];
+		fprintf(stdout, "\n   %04X..%04X updates %6lu age %ld ms", b->start, b->start + b->count - 1, b->updates, 
+			b->time ? (int32_t) ((esp_timer_get_time() - b->time) / 1000) : -1);
+	}
+	fprintf(stdout, "\n   snapshot reads repeated %lu", DDSU666H_image_lock.retries);
+	modbus_sniffer_printf(&DDSU666H_sniffer);
+	DDSU666H_oq_printf();
+	fprintf(stdout, "\n");
+} // DDSU666H_image_printf
+
+// UART2 load and frame quality, summary for MQTT
+int DDSU666H_bus_json(char *buffer, size_t sz, int summary)
+{
+	return summary ? modbus_uart_summary_json(&DDSU666H_uart, buffer, sz) : modbus_uart_json(&DDSU666H_uart, buffer, sz);
+} // DDSU666H_bus_json
 
+void DDSU666H_bus_printf(void)
+{
+	modbus_uart_printf(&DDSU666H_uart);
+} // DDSU666H_bus_printf
 
 
 void DDSU666H_RX_task(void *arg)
 {
     static const char *RX_TASK_TAG = "RX_TASK";
     esp_log_level_set(RX_TASK_TAG, ESP_LOG_INFO);
-    uint8_t* data = (uint8_t*) malloc(RX_BUF_SIZE);
-	
-	// int64_t t0, t1;
-	// t1= esp_timer_get_time();
     while (1) 
 	{
-		// t0=t1;
-        int rxBytes = uart_read_bytes(UART_NUM_2, data, RX_BUF_SIZE, 200 / portTICK_PERIOD_MS);
-		// t1= esp_timer_get_time();
-        if (rxBytes > 0) 
-		{
-			// DUMP
-			// fprintf(stdout,"\nDDSU666H %lld ms %d bytes\n",  (t1 - t0) / 1000, rxBytes);
-			
-			// for(int i=0; i<	rxBytes; i++)	
-				// fprintf(stdout,"%02X ", data[i]);
-			// fprintf(stdout,"\n");
-			// fflush(stdout);
-			
-			int ix=0;
-			do {
-				ix= DDSU666H_rxdata_process( data, rxBytes, ix);
-			} while( ix != 0 && ix <rxBytes);
-        }
+		// wakes up on UART events, frames split across reads or glued together are reassembled 
+		// and delivered to DDSU666H_rxdata_process()
+		// bytes dropped while our own query is on the bus: collision
+		if(modbus_uart_receive(&DDSU666H_uart) < 0) DDSU666H_oq_collision("CRC error");
     }
-    free(data);
 } // DDSU666H_RX_task
 
 
-void DDSU666H_create(UBaseType_t uxPriority)
+// power_callback is called from the RX task with every active power sample (W) and the end of the
+// response (us), keep it short
+void DDSU666H_create(void (*power_callback) (float power, int64_t time), UBaseType_t uxPriority)
 {
 	//DDSU666H_data_init();
 	// Data init
-	memset(&DDSU666H_data, 0, sizeof(struct DDSU666H_data_s));
-	DDSU666H_reg_request= 0;
+	seqlock_init(&DDSU666H_image_lock);
+	measurement_store_init(&DDSU666H_store, "DDSU666H", &DDSU666H_data, sizeof(DDSU666H_data_type), DDSU666H_fields, MODBUS_REGISTER_MAP_SIZE(DDSU666H_fields));
+	modbus_image_init(&DDSU666H_image, DDSU666H_MODBUS_ADDRESS, DDSU666H_image_block, MODBUS_REGISTER_MAP_SIZE(DDSU666H_image_block), DDSU666H_image_storage);
+	modbus_sniffer_init(&DDSU666H_sniffer, DDSU666H_transaction, 0);
+	DDSU666H_power_callback= power_callback;
+	memset(&DDSU666H_oq, 0, sizeof(DDSU666H_oq));
+	DDSU666H_oq.backoff_sec= DDSU666H_OQ_BACKOFF_SEC;
 	// UART init
 	DDSU666H_uart_init();
 	// Task create
     xTaskCreate(DDSU666H_RX_task, "DSU666H_rx_task", 4*1024, NULL, uxPriority, NULL);
+#if DDSU666H_OPPORTUNISTIC_QUERY
+    xTaskCreate(DDSU666H_TX_task, "DSU666H_tx_task", 3*1024, NULL, uxPriority, &DDSU666H_TX_handle);
+#endif
 } // DDSU666H_create
 
 
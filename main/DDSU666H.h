@@ -48,6 +48,23 @@
 
 
 
+// ------------------------------------------------------------------------------------------------
+// Opportunistic queries
+// The inverter is the master of this bus. With DDSU666H_OPPORTUNISTIC_QUERY our own read requests 
+// are sent only in the idle windows learned from the inverter polling, see DDSU666H.c
+#define DDSU666H_OPPORTUNISTIC_QUERY		0		// 1: read DDSU666H_EXTRA_START.. in the idle windows
+#define DDSU666H_EXTRA_START				0x4020	// registers after the 0x4000 block read by the inverter
+#define DDSU666H_EXTRA_COUNT				0x20
+#define DDSU666H_OQ_PERIOD_SEC				60		// one extra read every x seconds at most
+#define DDSU666H_OQ_MARGIN_MS				40		// idle time left before the next inverter request
+#define DDSU666H_OQ_MIN_SAMPLES				64		// idle gaps learned before the first query
+#define DDSU666H_OQ_BACKOFF_SEC				300		// after a collision, doubled on each one up to 24 h
+
+// Staleness: a value not received for this long is not published as current
+#define DDSU666H_STALE_POWER_MS				2000	// active power, polled every 250-300 ms
+#define DDSU666H_STALE_BLOCK_SEC			15		// 0x2000 block, read every 1-5 s
+#define DDSU666H_STALE_ENERGY_SEC			30		// 0x4000 block, read every 1-10 s
+
 // ------------------------------------------------------------------------------------------------
 // Exposed interface
 typedef struct DDSU666H_data_s
@@ -66,9 +83,16 @@ typedef struct DDSU666H_data_s
 	float PositiveActiveEnergy;	
 } DDSU666H_data_type;
 
-extern DDSU666H_data_type DDSU666H_data;
-
-void DDSU666H_create(UBaseType_t uxPriority);
+void DDSU666H_data_get(DDSU666H_data_type *data);
+void DDSU666H_data_snapshot(DDSU666H_data_type *data, measurement_snapshot_type *snapshot);
+void DDSU666H_measurements_printf(void);
+void DDSU666H_data_hook(void (*sample) (void *arg, size_t offset, float value, int64_t time), void *arg);
+int DDSU666H_registers_read(uint16_t start, uint16_t count, uint8_t *dst, int64_t *time);
+int32_t DDSU666H_age_ms(uint16_t reg);
+void DDSU666H_image_printf(void);
+int DDSU666H_bus_json(char *buffer, size_t sz, int summary);
+void DDSU666H_bus_printf(void);
+void DDSU666H_create(void (*power_callback) (float power, int64_t time), UBaseType_t uxPriority);
 
 #endif
 // END OF FILE
\ No newline at end of file
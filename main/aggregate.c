@@ -0,0 +1,198 @@
+/** ************************************************************************************************
+ *	Windowed aggregates
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - tumbling 1 s, 1 min and 15 min windows
+ * 			windows with only a held sample closed too
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+Every decoded sample of a metric updates, for each window length, the window in progress:
+	n, min, max, sum		of the samples in the window
+	integral				time-weighted: each sample holds its value until the next sample (at 
+							most AGGREGATE_HOLD_MS), the held time is split at the window boundaries, 
+							so the energy of a power metric adds up across windows (J, /3600 Wh)
+	covered_ms				time covered by held samples, less than the window length when the 
+							meter was silent
+A window closes when a sample (or aggregate_advance() when the meter is silent) falls past its end,
+and becomes the last closed summary of its length, also when it only holds the previous sample 
+(n 0, no min, max nor mean, the integral still counts). Windows with nothing are skipped in one step,
+so the work per sample is bounded (AGGREGATE_HOLD_MS / shortest window + 2 steps), not related to 
+the gap between samples.
+Samples come from the meter tasks (measurement store hook), summaries are read by the publisher: 
+a seqlock keeps the summary consistent.
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>			// memset
+#include <float.h>			// FLT_MAX
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "seqlock.h"
+#include "aggregate.h"
+
+static const uint32_t aggregate_window_ms[AGGREGATE_WINDOWS]= AGGREGATE_WINDOW_MS;
+
+static void aggregate_open(aggregate_window_type *w, int64_t start_ms)
+{
+	w->start_ms= start_ms;
+	w->n= 0;
+	w->min= FLT_MAX;
+	w->max= -FLT_MAX;
+	w->sum= 0;
+	w->integral= 0;
+	w->covered_ms= 0;
+} // aggregate_open
+
+static void aggregate_close(aggregate_window_type *w)
+{
+	// nothing in it, neither a sample nor a held one
+	if(w->n == 0 && w->covered_ms == 0) return;
+	w->closed.start_ms= w->start_ms;
+	w->closed.length_ms= w->length_ms;
+	w->closed.n= w->n;
+	w->closed.min= w->min;
+	w->closed.max= w->max;
+	w->closed.mean= w->n ? w->sum / w->n : 0;
+	w->closed.integral= w->integral;
+	w->closed.covered_ms= w->covered_ms;
+	w->closed_n ++;
+} // aggregate_close
+
+// Previous sample held over [from, to), the part inside the window
+static void aggregate_hold(aggregate_window_type *w, int64_t from, int64_t to, float value)
+{
+	int64_t end= w->start_ms + w->length_ms;
+	if(from < w->start_ms) from= w->start_ms;
+	if(to > end) to= end;
+	if(to <= from) return;
+	w->integral += (double) value * (to - from) / 1000.0;
+	w->covered_ms += to - from;
+} // aggregate_hold
+
+void aggregate_init(aggregate_type *a, const char *name)
+{
+	memset(a, 0, sizeof(aggregate_type));
+	a->name= name;
+	for(int i=0; i<AGGREGATE_WINDOWS; i++)
+	{
+		a->window[i].length_ms= aggregate_window_ms[i];
+		a->window[i].start_ms= -1;
+	}
+	seqlock_init(&a->lock);
+} // aggregate_init
+
+// Move every window up to time t, then count the sample if there is one (writer side)
+static void aggregate_step(aggregate_type *a, int64_t t, bool sample, float value)
+{
+	// the previous sample is held over [held_ms, until)
+	int64_t until= a->last_ms + AGGREGATE_HOLD_MS;
+	if(until > t) until= t;
+	for(int i=0; i<AGGREGATE_WINDOWS; i++)
+	{
+		aggregate_window_type *w= &a->window[i];
+		if(w->start_ms < 0) 
+		{
+			if(!sample) continue;
+			aggregate_open(w, t - t % w->length_ms);
+		}
+		while(t >= w->start_ms + w->length_ms)
+		{
+			if(a->samples) aggregate_hold(w, a->held_ms, until, a->last_value);
+			aggregate_close(w);
+			int64_t next= w->start_ms + w->length_ms;
+			// nothing held in the windows before the one of t: straight to it
+			if(a->samples == 0 || until <= next) next= t - t % w->length_ms;
+			aggregate_open(w, next);
+		}
+		if(a->samples) aggregate_hold(w, a->held_ms, until, a->last_value);
+		if(sample)
+		{
+			w->n ++;
+			if(value < w->min) w->min= value;
+			if(value > w->max) w->max= value;
+			w->sum += value;
+		}
+	}
+	if(until > a->held_ms) a->held_ms= until;
+	if(sample)
+	{
+		a->last_ms= t;
+		a->held_ms= t;
+		a->last_value= value;
+		a->samples ++;
+	}
+} // aggregate_step
+
+// time_ms	capture time of the sample
+void aggregate_add(aggregate_type *a, int64_t time_ms, float value)
+{
+	seqlock_write_begin(&a->lock);
+	if(a->samples && time_ms < a->last_ms) a->rejected ++;
+	else aggregate_step(a, time_ms, true, value);
+	seqlock_write_end(&a->lock);
+} // aggregate_add
+
+// Close the windows of a silent metric: those that ended AGGREGATE_HOLD_MS before now_ms
+void aggregate_advance(aggregate_type *a, int64_t now_ms)
+{
+	int64_t t= now_ms - AGGREGATE_HOLD_MS;
+	seqlock_write_begin(&a->lock);
+	if(a->samples && t > a->last_ms) aggregate_step(a, t, false, 0);
+	seqlock_write_end(&a->lock);
+} // aggregate_advance
+
+// Last closed window of length index w
+// return	windows closed so far, a new value means a new summary
+uint32_t aggregate_closed(aggregate_type *a, int w, aggregate_summary_type *summary)
+{
+	uint32_t sequence, closed_n;
+	do
+	{
+		sequence= seqlock_read_begin(&a->lock);
+		memcpy(summary, &a->window[w].closed, sizeof(aggregate_summary_type));
+		closed_n= a->window[w].closed_n;
+	} while(seqlock_read_retry(&a->lock, sequence));
+	return closed_n;
+} // aggregate_closed
+
+// {"agg":"grid_ap","w":60,"t":<start ms>,"n":240,"min":-150.2,"max":2100.5,"avg":350.1,"int":21000.5,"cov":60000}
+// w window length (s), t start (uptime ms), int the time-weighted integral (value x s), cov the 
+// time covered by samples (ms). min, max and avg are null when n is 0.
+int aggregate_json(const char *name, const aggregate_summary_type *s, char *buffer, size_t sz)
+{
+	int len= snprintf(buffer, sz, "{\"agg\":\"%s\",\"w\":%lu,\"t\":%lld,\"n\":%lu,", 
+		name, (unsigned long) (s->length_ms / 1000), (long long) s->start_ms, (unsigned long) s->n);
+	if(len < sz)
+	{
+		if(s->n) len += snprintf(buffer + len, sz - len, "\"min\":%.2f,\"max\":%.2f,\"avg\":%.2f,", s->min, s->max, s->mean);
+		else len += snprintf(buffer + len, sz - len, "\"min\":null,\"max\":null,\"avg\":null,");
+	}
+	if(len < sz) len += snprintf(buffer + len, sz - len, "\"int\":%.1f,\"cov\":%lu}", s->integral, (unsigned long) s->covered_ms);
+	return len;
+} // aggregate_json
+
+void aggregate_printf(aggregate_type *a)
+{
+	fprintf(stdout, "\n   %-10s samples %7lu rejected %lu", a->name, (unsigned long) a->samples, (unsigned long) a->rejected);
+	for(int w=0; w<AGGREGATE_WINDOWS; w++)
+	{
+		aggregate_summary_type s;
+		uint32_t n= aggregate_closed(a, w, &s);
+		if(n == 0) continue;
+		if(s.n == 0)
+		{
+			fprintf(stdout, "\n      %4lu s  n     0  held sample only  integral %12.1f  covered %6lu ms  (%lu closed)", 
+				(unsigned long) (s.length_ms / 1000), s.integral, (unsigned long) s.covered_ms, (unsigned long) n);
+			continue;
+		}
+		fprintf(stdout, "\n      %4lu s  n %5lu  min %9.2f  max %9.2f  avg %9.2f  integral %12.1f  covered %6lu ms  (%lu closed)", 
+			(unsigned long) (s.length_ms / 1000), (unsigned long) s.n, s.min, s.max, s.mean, s.integral, 
+			(unsigned long) s.covered_ms, (unsigned long) n);
+	}
+} // aggregate_printf
+
+// END OF FILE
\ No newline at end of file
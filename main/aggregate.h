@@ -0,0 +1,56 @@
+#ifndef _AGGREGATE_H_
+#define _AGGREGATE_H_
+
+// Tumbling windows of 1 s, 1 min and 15 min, aligned to multiples of their length (uptime)
+#define AGGREGATE_WINDOWS		3
+#define AGGREGATE_WINDOW_MS		{ 1000, 60000, 900000 }
+#define AGGREGATE_HOLD_MS		5000		// a sample stands for the time after it, up to this long
+
+// Closed window
+typedef struct aggregate_summary_s
+{
+	int64_t start_ms;
+	uint32_t length_ms;
+	uint32_t n;					// samples, 0 when the window only holds the previous sample
+	float min;					// min, max and mean meaningless when n is 0
+	float max;
+	float mean;					// of the samples
+	float integral;				// value x s, each sample held until the next one (W -> J)
+	uint32_t covered_ms;		// time covered by the held samples
+} aggregate_summary_type;
+
+typedef struct aggregate_window_s
+{
+	uint32_t length_ms;
+	int64_t start_ms;			// -1 not open yet
+	uint32_t n;
+	float min;
+	float max;
+	double sum;
+	double integral;
+	uint32_t covered_ms;
+	aggregate_summary_type closed;	// the last closed window with samples or a held sample
+	uint32_t closed_n;				// windows closed with samples or a held sample
+} aggregate_window_type;
+
+typedef struct aggregate_s
+{
+	const char *name;
+	aggregate_window_type window[AGGREGATE_WINDOWS];
+	int64_t last_ms;			// previous sample
+	float last_value;
+	int64_t held_ms;			// the previous sample is integrated up to here
+	uint32_t samples;
+	uint32_t rejected;			// older than the previous sample
+	seqlock_type lock;
+} aggregate_type;
+
+void aggregate_init(aggregate_type *a, const char *name);
+void aggregate_add(aggregate_type *a, int64_t time_ms, float value);
+void aggregate_advance(aggregate_type *a, int64_t now_ms);
+uint32_t aggregate_closed(aggregate_type *a, int w, aggregate_summary_type *summary);
+int aggregate_json(const char *name, const aggregate_summary_type *summary, char *buffer, size_t sz);
+void aggregate_printf(aggregate_type *a);
+
+#endif
+// END OF FILE
\ No newline at end of file
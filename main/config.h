@@ -31,5 +31,8 @@
 // THIS DEVICE MQTT ID  
 #define DEVICE_MQTT_NAME		"modbus2mqtt"
 
+// Grid active power topic (DEVICE_MQTT_NAME/grid_power), minimum period in ms (4 Hz)
+#define	MQTT_GRID_POWER_MS		250
+
 #endif
 // END OF FILE
\ No newline at end of file
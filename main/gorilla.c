@@ -0,0 +1,236 @@
+/** ************************************************************************************************
+ *	Gorilla time series compression
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - delta-of-delta timestamps, XOR float values, ring of blocks
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+Streaming compression of (time, float) samples as in Facebook's Gorilla (VLDB 2015), adapted to 
+millisecond timestamps and float32 values:
+
+	timestamp	delta of delta D against the previous sample
+				'0'						D = 0
+				'10'   + 7 bits			D in [-63, 64]
+				'110'  + 9 bits			D in [-255, 256]
+				'1110' + 12 bits		D in [-2047, 2048]
+				'1111' + 32 bits		any other
+	value		X = value XOR previous value (float32 bits)
+				'0'						X = 0, same value
+				'10'   + meaningful bits	the non-zero bits of X fit in the window of the previous X
+				'11'   + 5 bits leading zeros + 5 bits length - 1 + meaningful bits, new window
+
+A polled meter gives regular timestamps (1 bit when the poll period holds) and values that repeat
+or change in the low bits of the mantissa.
+The stream is cut in blocks of GORILLA_BLOCK_BYTES: each block starts with a raw sample and can be
+decoded alone, the blocks are kept in a ring and the oldest one is dropped to make room. Append is 
+constant time (a block is started when the current one has no room for a worst case sample), a 
+range read decodes only the blocks that overlap it.
+No ESP-IDF dependency, it also builds on the host (modbus_bench.c). The caller serializes access.
+*********************************************************************************************** **/
+
+#include <stdint.h>
+#include <string.h>			// memset, memcpy
+
+#include "gorilla.h"
+
+static void gorilla_put(gorilla_block_type *b, uint32_t value, int nbits)
+{
+	while(nbits > 0)
+	{
+		int room= 8 - (b->bits & 7);
+		int take= nbits < room ? nbits : room;
+		uint32_t chunk= (value >> (nbits - take)) & ((1u << take) - 1);
+		b->data[b->bits >> 3] |= (uint8_t) (chunk << (room - take));
+		b->bits += take;
+		nbits -= take;
+	}
+} // gorilla_put
+
+static uint32_t gorilla_get(gorilla_reader_type *r, int nbits)
+{
+	uint32_t value= 0;
+	while(nbits > 0)
+	{
+		int room= 8 - (r->bit & 7);
+		int take= nbits < room ? nbits : room;
+		uint32_t chunk= (r->block->data[r->bit >> 3] >> (room - take)) & ((1u << take) - 1);
+		value= (value << take) | chunk;
+		r->bit += take;
+		nbits -= take;
+	}
+	return value;
+} // gorilla_get
+
+void gorilla_init(gorilla_type *g, gorilla_block_type *block, int size)
+{
+	memset(g, 0, sizeof(gorilla_type));
+	g->block= block;
+	g->size= size;
+} // gorilla_init
+
+static void gorilla_block_start(gorilla_type *g, int64_t time_ms, uint32_t value)
+{
+	if(g->n > 0) g->head= (g->head + 1) % g->size;
+	if(g->n == g->size) g->dropped += g->block[g->head].n;
+	else g->n ++;
+	gorilla_block_type *b= &g->block[g->head];
+	memset(b->data, 0, sizeof(b->data));
+	b->first_ms= time_ms;
+	b->last_ms= time_ms;
+	b->first_value= value;
+	b->n= 1;
+	b->bits= 0;
+	g->previous_delta= 0;
+	g->leading= 0xFF;				// no window yet
+} // gorilla_block_start
+
+// return	1 stored, 0 older than the previous sample
+int gorilla_append(gorilla_type *g, int64_t time_ms, float value)
+{
+	uint32_t v;
+	memcpy(&v, &value, sizeof(v));
+	if(g->n > 0 && time_ms < g->previous_ms)
+	{
+		g->rejected ++;
+		return 0;
+	}
+	gorilla_block_type *b= &g->block[g->head];
+	int64_t delta= time_ms - g->previous_ms;
+	int64_t dod= delta - g->previous_delta;
+	if(g->n == 0 || b->bits + GORILLA_SAMPLE_BITS_MAX > 8 * GORILLA_BLOCK_BYTES || b->n == UINT16_MAX || 
+		dod > INT32_MAX || dod < INT32_MIN)
+	{
+		gorilla_block_start(g, time_ms, v);
+	}
+	else
+	{
+		// timestamp
+		if(dod == 0) gorilla_put(b, 0, 1);
+		else if(dod >= -63 && dod <= 64)		{ gorilla_put(b, 0x2, 2); gorilla_put(b, (uint32_t) (dod + 63), 7); }
+		else if(dod >= -255 && dod <= 256)		{ gorilla_put(b, 0x6, 3); gorilla_put(b, (uint32_t) (dod + 255), 9); }
+		else if(dod >= -2047 && dod <= 2048)	{ gorilla_put(b, 0xE, 4); gorilla_put(b, (uint32_t) (dod + 2047), 12); }
+		else									{ gorilla_put(b, 0xF, 4); gorilla_put(b, (uint32_t) (int32_t) dod, 32); }
+		// value
+		uint32_t x= v ^ g->previous_value;
+		if(x == 0) gorilla_put(b, 0, 1);
+		else
+		{
+			int leading= __builtin_clz(x);
+			int trailing= __builtin_ctz(x);
+			if(g->leading != 0xFF && leading >= g->leading && trailing >= g->trailing)
+			{
+				gorilla_put(b, 0x2, 2);
+				gorilla_put(b, x >> g->trailing, 32 - g->leading - g->trailing);
+			}
+			else
+			{
+				int length= 32 - leading - trailing;
+				gorilla_put(b, 0x3, 2);
+				gorilla_put(b, leading, 5);
+				gorilla_put(b, length - 1, 5);
+				gorilla_put(b, x >> trailing, length);
+				g->leading= leading;
+				g->trailing= trailing;
+			}
+		}
+		b->n ++;
+		b->last_ms= time_ms;
+		g->previous_delta= delta;
+	}
+	g->previous_ms= time_ms;
+	g->previous_value= v;
+	g->samples ++;
+	return 1;
+} // gorilla_append
+
+void gorilla_reader_init(gorilla_reader_type *r, const gorilla_block_type *block)
+{
+	memset(r, 0, sizeof(gorilla_reader_type));
+	r->block= block;
+} // gorilla_reader_init
+
+// return	1 sample decoded, 0 end of the block
+int gorilla_reader_next(gorilla_reader_type *r, gorilla_sample_type *sample)
+{
+	if(r->i >= r->block->n) return 0;
+	if(r->i == 0)
+	{
+		r->time= r->block->first_ms;
+		r->value= r->block->first_value;
+		r->delta= 0;
+		r->leading= 0xFF;
+	}
+	else
+	{
+		int64_t dod;
+		if(gorilla_get(r, 1) == 0) dod= 0;
+		else if(gorilla_get(r, 1) == 0) dod= (int64_t) gorilla_get(r, 7) - 63;
+		else if(gorilla_get(r, 1) == 0) dod= (int64_t) gorilla_get(r, 9) - 255;
+		else if(gorilla_get(r, 1) == 0) dod= (int64_t) gorilla_get(r, 12) - 2047;
+		else dod= (int32_t) gorilla_get(r, 32);
+		r->delta += dod;
+		r->time += r->delta;
+		if(gorilla_get(r, 1))
+		{
+			if(gorilla_get(r, 1))
+			{
+				r->leading= gorilla_get(r, 5);
+				int length= gorilla_get(r, 5) + 1;
+				r->trailing= 32 - r->leading - length;
+			}
+			r->value ^= gorilla_get(r, 32 - r->leading - r->trailing) << r->trailing;
+		}
+	}
+	sample->time= r->time;
+	memcpy(&sample->value, &r->value, sizeof(float));
+	r->i ++;
+	return 1;
+} // gorilla_reader_next
+
+// k-th block held, 0 the oldest
+const gorilla_block_type *gorilla_block(const gorilla_type *g, int k)
+{
+	return &g->block[(g->head - g->n + 1 + k + g->size) % g->size];
+} // gorilla_block
+
+// Samples in (from_ms, to_ms], oldest first; only the blocks that overlap the range are decoded
+// return	number of samples
+int gorilla_read(const gorilla_type *g, int64_t from_ms, int64_t to_ms, gorilla_sample_type *sample, int max)
+{
+	int count= 0;
+	for(int k=0; k<g->n && count<max; k++)
+	{
+		const gorilla_block_type *b= gorilla_block(g, k);
+		if(b->last_ms <= from_ms) continue;
+		if(b->first_ms > to_ms) break;
+		gorilla_reader_type r;
+		gorilla_reader_init(&r, b);
+		while(count < max && gorilla_reader_next(&r, &sample[count]))
+		{
+			if(sample[count].time > to_ms) return count;
+			if(sample[count].time > from_ms) count ++;
+		}
+	}
+	return count;
+} // gorilla_read
+
+// Memory in use: block headers and the bits written
+uint32_t gorilla_bytes(const gorilla_type *g)
+{
+	uint32_t bytes= 0;
+	for(int k=0; k<g->n; k++) 
+		bytes += (sizeof(gorilla_block_type) - GORILLA_BLOCK_BYTES) + (gorilla_block(g, k)->bits + 7) / 8;
+	return bytes;
+} // gorilla_bytes
+
+// Samples held
+uint32_t gorilla_held(const gorilla_type *g)
+{
+	uint32_t n= 0;
+	for(int k=0; k<g->n; k++) n += gorilla_block(g, k)->n;
+	return n;
+} // gorilla_held
+
+// END OF FILE
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef _GORILLA_H_
+#define _GORILLA_H_
+
+// Compressed time series (Gorilla): delta-of-delta timestamps (ms) and XOR-encoded float32 values
+#define GORILLA_BLOCK_BYTES			1024		// bit stream of one block
+#define GORILLA_SAMPLE_BITS_MAX		(4 + 32 + 2 + 5 + 5 + 32)	// worst case sample
+
+// Independent block: the first sample is kept as it is, the others are encoded against the previous one
+typedef struct gorilla_block_s
+{
+	int64_t first_ms;
+	int64_t last_ms;
+	uint32_t first_value;		// float32 bits
+	uint16_t n;					// samples
+	uint16_t bits;				// bits written
+	uint8_t data[GORILLA_BLOCK_BYTES];
+} gorilla_block_type;
+
+// Ring of blocks, the oldest one is dropped when a new block is needed and the ring is full
+typedef struct gorilla_s
+{
+	gorilla_block_type *block;
+	int size;
+	int head;					// block being written
+	int n;						// blocks held
+	// encoder state
+	int64_t previous_ms;
+	int64_t previous_delta;
+	uint32_t previous_value;
+	uint8_t leading;			// XOR window of the previous value
+	uint8_t trailing;
+	uint32_t samples;
+	uint32_t dropped;			// samples in dropped blocks
+	uint32_t rejected;			// older than the previous sample
+} gorilla_type;
+
+typedef struct gorilla_sample_s
+{
+	int64_t time;				// ms
+	float value;
+} gorilla_sample_type;
+
+// Decoder of one block
+typedef struct gorilla_reader_s
+{
+	const gorilla_block_type *block;
+	uint32_t bit;
+	uint16_t i;					// next sample
+	int64_t time;
+	int64_t delta;
+	uint32_t value;
+	uint8_t leading;
+	uint8_t trailing;
+} gorilla_reader_type;
+
+void gorilla_init(gorilla_type *g, gorilla_block_type *block, int size);
+int gorilla_append(gorilla_type *g, int64_t time_ms, float value);
+void gorilla_reader_init(gorilla_reader_type *r, const gorilla_block_type *block);
+int gorilla_reader_next(gorilla_reader_type *r, gorilla_sample_type *sample);
+const gorilla_block_type *gorilla_block(const gorilla_type *g, int k);
+int gorilla_read(const gorilla_type *g, int64_t from_ms, int64_t to_ms, gorilla_sample_type *sample, int max);
+uint32_t gorilla_bytes(const gorilla_type *g);
+uint32_t gorilla_held(const gorilla_type *g);
+
+#endif
+// END OF FILE
\ No newline at end of file
@@ -6,6 +6,7 @@
  *			Network modules: WiFi, TCP and MQTT clietn
  *			WiFi recovery
  *			Rest API
+ *			History and windowed aggregates of the main metrics
  * 
  *
  ** ************************************************************************************************
@@ -38,6 +39,7 @@ esptool.py --port /dev/ttyUSB0 flash_id
 Monitor
 
 press Ctrl+a to print SW info
+press Ctrl+t to run the MODBUS benchmarks
 To exit IDF monitor use the shortcut Ctrl+]
 **/
 
@@ -48,10 +50,14 @@ mosquitto_sub -d -t 'modbus2mqtt/set'
 
 #include <stdio.h>
 #include <string.h>			// memset
+#include <math.h>			// roundf
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "driver/gpio.h"
+#include "driver/uart.h"
 #include "esp_log.h"
+#include "esp_timer.h"		// esp_timer_get_time()
 #include "esp_chip_info.h"
 #include "esp_flash.h"
 #include "esp_mac.h"
@@ -63,6 +69,15 @@ mosquitto_sub -d -t 'modbus2mqtt/set'
 #include "config.h"
 #include "cstr.h"
 #include "modbus.h"
+#include "modbus_bench.h"
+#include "modbus_capture.h"
+#include "modbus_slave.h"
+#include "modbus_tcp.h"
+#include "seqlock.h"
+#include "measurement.h"
+#include "timeseries.h"
+#include "gorilla.h"
+#include "aggregate.h"
 #include "mqtt.h"
 #include "mqtt_client.h"
 #include "network_wifi.h"
@@ -86,7 +101,15 @@ static const char *TAG = "modbus2MQTT";
 	"RestAPI"			3							RestAPI server
 	"SDM120CT_rx_task"	configMAX_PRIORITIES-1
 	"SDM120CT_tx_task"	configMAX_PRIORITIES-1
+	"SDM120CT_master"	configMAX_PRIORITIES-1
 	"DSU666H_rx_task"	configMAX_PRIORITIES-1
+	"DSU666H_tx_task"	configMAX_PRIORITIES-1		only with DDSU666H_OPPORTUNISTIC_QUERY
+	"report"			2							console dumps and MQTT publish of the SDM120CT data cycle
+	"grid_power"		2							grid active power MQTT stream
+	"history"			2							samples the measurement stores into the history
+	"aggregate"			2							closes the windows of silent metrics, publishes the summaries
+	"modbus_slave"		configMAX_PRIORITIES-1		only with MODBUS_SLAVE
+	"modbus_tcp"		3							Modbus TCP server, only with MODBUS_TCP
 
 	Priority - a lower numerical value indicates a lower priority, and a higher number indicates a higher priority
 	UART tasks have the highest priotity
@@ -94,12 +117,18 @@ static const char *TAG = "modbus2MQTT";
 	The idle task has priority zero (tskIDLE_PRIORITY).
 	
 	What this SW does
-	SDM120CT_tx_task - wake up every REQUEST_EVERY_SEC (30 secs) to send one by one the queries in SDM120CT_data_query_list
-	through UART_1
-	SDM120CT_rx_task - when last response is received then function SDM120CT_querylist_done() is called to generate a MQTT Publish with the data
-	from both SDM120CT and DDSU666-H
+	SDM120CT_tx_task - multi-rate scheduler: releases the reads of each refresh class (fast 1 s active power, normal 30 s,
+	slow 300 s energy counters) and queues the due read with the earliest deadline whenever the master is idle
+	SDM120CT_master - sends the queued queries one by one through UART_1, with response timeout and retries
+	SDM120CT_rx_task - hands the responses to SDM120CT_master. When the last read of the normal class completes SDM120CT_callback() wakes up 
+	report that generates a MQTT Publish with the data from both SDM120CT and DDSU666-H
 	Data in the MQTT publish is json format
 	DSU666H_rx_task - is the DSU666H sniffer that read the message exchanged between the inverter and the DSU666H
+	the passive sniffer matches every response of any slave to its request (03, 04, 06, 0x10 and exceptions)
+	grid_power - publishes the active power polled by the inverter every 250 ms to DEVICE_MQTT_NAME/grid_power (4 Hz max)
+	modbus_slave - virtual RTU slave on UART_0 answering other masters from the cached measurements
+	modbus_tcp - Modbus TCP server on port 502, same register image as modbus_slave
+	aggregate - 1 min and 15 min summaries of the main metrics to DEVICE_MQTT_NAME/aggregate
 
 *********************************************************************************************** **/
 /**
@@ -121,6 +150,10 @@ static const char *TAG = "modbus2MQTT";
 	TX			17		U2_TXD
 	RX			16		U2_RXD
 	
+	UART_NUM_0	virtual slave (MODBUS_SLAVE), console moved off UART_0
+	TX			MODBUS_SLAVE_TX_GPIO
+	RX			MODBUS_SLAVE_RX_GPIO
+	
 ---------------------------------------------------------------------------------------------------
 **/
 /**
@@ -173,8 +206,24 @@ void SystemInfo(void)
 } // SystemInfo()
 
 
+// Published fields and their JSON keys (MQTT and REST data_request)
+static const measurement_key_type DDSU666H_keys[]= {
+	MEASUREMENT_KEY("v",	DDSU666H_data_type, Voltage),
+	MEASUREMENT_KEY("c",	DDSU666H_data_type, Current),
+	MEASUREMENT_KEY("ap",	DDSU666H_data_type, ActivePower),
+	MEASUREMENT_KEY("rp",	DDSU666H_data_type, ReactivePower),
+};
+static const measurement_key_type SDM120CT_keys[]= {
+	MEASUREMENT_KEY("v",	SDM120CT_data_type, Voltage),
+	MEASUREMENT_KEY("c",	SDM120CT_data_type, Current),
+	MEASUREMENT_KEY("ap",	SDM120CT_data_type, ActivePower),
+	MEASUREMENT_KEY("rp",	SDM120CT_data_type, ReactivePower),
+};
+
 void DDSU666H_printf(void)
 {
+	DDSU666H_data_type DDSU666H_data;
+	DDSU666H_data_get(&DDSU666H_data);
 	fprintf(stdout, "\nGrid (DDSU666H)");
 	fprintf(stdout, "\nVoltage                %3.2f Volts", 		DDSU666H_data.Voltage);
 	fprintf(stdout, "\nCurrent                %3.2f Amperes", 		DDSU666H_data.Current);
@@ -187,11 +236,14 @@ void DDSU666H_printf(void)
 	fprintf(stdout, "\nActiveInElectricity    %3.2f", 				DDSU666H_data.ActiveInElectricity);
 	fprintf(stdout, "\nNegativeActiveEnergy   %3.2f kWh",			DDSU666H_data.NegativeActiveEnergy);
 	fprintf(stdout, "\nPositiveActiveEnergy   %3.2f kWh", 			DDSU666H_data.PositiveActiveEnergy);
-	fprintf(stdout, "\n");
+	DDSU666H_image_printf();
+	DDSU666H_measurements_printf();
 } // DDSU666H_printf
 
 void SDM120CT_printf(void)
 {
+	SDM120CT_data_type SDM120CT_data;
+	SDM120CT_data_get(&SDM120CT_data);
 	fprintf(stdout, "\nSolar (SDM120CT)");
 	fprintf(stdout, "\nVoltage                %3.2f Volts", SDM120CT_data.Voltage);
 	fprintf(stdout, "\nCurrent                %3.2f Amps",  SDM120CT_data.Current);
@@ -200,7 +252,9 @@ void SDM120CT_printf(void)
 	fprintf(stdout, "\nReactivePower          %3.2f Var",   SDM120CT_data.ReactivePower);
 	fprintf(stdout, "\nPowerFactor            %3.2f", 	    SDM120CT_data.PowerFactor*1000.0);
 	fprintf(stdout, "\nFrecuency              %3.2f Hz",    SDM120CT_data.Frecuency);
-	fprintf(stdout, "\n");
+	fprintf(stdout, "\nImportActiveEnergy     %3.2f kWh",   SDM120CT_data.ImportActiveEnergy);
+	fprintf(stdout, "\nExportActiveEnergy     %3.2f kWh",   SDM120CT_data.ExportActiveEnergy);
+	SDM120CT_measurements_printf();
 }
 
 void SDM120CT_info_printf(void)
@@ -294,8 +348,16 @@ int TCPCallback (int status, void *d)
 // is a json message with "type" and "key"
 // {"type":"....","key":"..."}'
 // type is
-// - data_request
+// - data_request (values with their quality and age, see measurement.c)
 // - device_info
+// - modbus_info (MODBUS master counters and slave response time)
+// - bus_stats (RS-485 load and frame quality per UART, see modbus_uart.c)
+// - slave_info (virtual slave requests and turnaround)
+// - modbus_tcp (Modbus TCP server clients and service time, MODBUS_TCP)
+// - capture (pcap of the RS-485 frames, streamed by the server, see modbus_capture.c)
+// - history (last HISTORY_REST_SEC of the main metrics, streamed, see timeseries.c)
+// - grid_history (grid active power at the polling rate, streamed, see gorilla.c)
+// - aggregates (last closed 1 s, 1 min and 15 min window of the main metrics, streamed, see aggregate.c)
 int RestAPICallback(char * type, char *response, size_t sz_response)
 {
 	if(strcmp(type, "data_request")==0)
@@ -310,14 +372,21 @@ int RestAPICallback(char * type, char *response, size_t sz_response)
 		len= strlen(response);
 		snprintf(&response[len], sz_response-len, "}");
 		 */
-		snprintf(response, sz_response, 
-			"{"
-			"\"DDSU666H\":{\"v\":\"%3.2f\",\"c\":\"%3.2f\",\"ap\":\"%3.2f\",\"rp\":\"%3.2f\"},"
-			"\"SDM120CT\":{\"v\":\"%3.2f\",\"c\":\"%3.2f\",\"ap\":\"%3.2f\",\"rp\":\"%3.2f\"}"
-			"}",
-			DDSU666H_data.Voltage, DDSU666H_data.Current, DDSU666H_data.ActivePower, DDSU666H_data.ReactivePower,
-			SDM120CT_data.Voltage, SDM120CT_data.Current, SDM120CT_data.ActivePower, SDM120CT_data.ReactivePower
-		); 
+		// stale values are null, see measurement_json()
+		DDSU666H_data_type DDSU666H_data;
+		SDM120CT_data_type SDM120CT_data;
+		measurement_snapshot_type snapshot;
+		snprintf(response, sz_response, "{\"DDSU666H\":");
+		int len= strlen(response);
+		DDSU666H_data_snapshot(&DDSU666H_data, &snapshot);
+		measurement_json(&response[len], sz_response-len, &DDSU666H_data, &snapshot, DDSU666H_keys, MODBUS_REGISTER_MAP_SIZE(DDSU666H_keys));
+		len= strlen(response);
+		snprintf(&response[len], sz_response-len, ",\"SDM120CT\":");
+		len= strlen(response);
+		SDM120CT_data_snapshot(&SDM120CT_data, &snapshot);
+		measurement_json(&response[len], sz_response-len, &SDM120CT_data, &snapshot, SDM120CT_keys, MODBUS_REGISTER_MAP_SIZE(SDM120CT_keys));
+		len= strlen(response);
+		snprintf(&response[len], sz_response-len, "}");
 	}
 	else if(strcmp(type, "device_info")==0)
 	{
@@ -329,6 +398,32 @@ int RestAPICallback(char * type, char *response, size_t sz_response)
 			Network_status.TCP_lost
 			);
 	}
+	else if(strcmp(type, "modbus_info")==0)
+	{
+		snprintf(response, sz_response, "{\"SDM120CT\":");
+		int len= strlen(response);
+		len += SDM120CT_modbus_json(&response[len], sz_response-len);
+		if(len < sz_response) snprintf(&response[len], sz_response-len, "}");
+	}
+	else if(strcmp(type, "slave_info")==0)
+	{
+		modbus_slave_json(response, sz_response);
+	}
+#if MODBUS_TCP
+	else if(strcmp(type, "modbus_tcp")==0)
+	{
+		modbus_tcp_json(response, sz_response);
+	}
+#endif
+	else if(strcmp(type, "bus_stats")==0)
+	{
+		snprintf(response, sz_response, "{\"SDM120CT\":");
+		int len= strlen(response);
+		len += SDM120CT_bus_json(&response[len], sz_response-len, 0);
+		if(len < sz_response) len += snprintf(&response[len], sz_response-len, ",\"DDSU666H\":");
+		if(len < sz_response) len += DDSU666H_bus_json(&response[len], sz_response-len, 0);
+		if(len < sz_response) snprintf(&response[len], sz_response-len, "}");
+	}
 	else
 	{
 		snprintf(response, sz_response, "{\"type\":\"%s\",\"result\":\"%s\"}", type, "error");
@@ -338,6 +433,186 @@ int RestAPICallback(char * type, char *response, size_t sz_response)
 
 
 
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   HISTORY
+
+---------------------------------------------------------------------------------------------------
+Recent history of the main metrics in RAM (timeseries.c), so it survives a broker or WiFi outage:
+history_task samples the measurement stores and appends every new value with its capture time.
+	REST	"history" streams the last HISTORY_REST_SEC of every metric
+			"grid_history" the grid active power at the polling rate (history_grid, compressed)
+	MQTT	DEVICE_MQTT_NAME/history carries the samples not published yet, a backlog after an 
+			outage drains over the next publish cycles (HISTORY_MQTT_CHUNKS messages per metric)
+RAM: 6 bytes per record, 24.5 KB for the table below, and HISTORY_GRID_BLOCKS KB for history_grid.
+---------------------------------------------------------------------------------------------------
+**/
+#define HISTORY_TICK_MS			250			// sampling period, the grid active power comes every 250-300 ms
+#define HISTORY_REST_SEC		600
+#define HISTORY_MQTT_CHUNKS		8
+#define HISTORY_MQTT_SIZE		220			// a chunk and the topic within PUBLISH_VARIABLE_SIZE (mqtt.h)
+#define HISTORY_GRID			0			// source store
+#define HISTORY_SOLAR			1
+
+TIMESERIES_STORAGE(grid_ap, 1800);			// 30 min at 1 s
+TIMESERIES_STORAGE(solar_ap, 1800);			// 30 min at 1 s
+TIMESERIES_STORAGE(grid_v, 360);			// 1 h at 10 s
+TIMESERIES_STORAGE(solar_v, 120);			// 1 h at 30 s
+
+typedef struct history_metric_s
+{
+	timeseries_type ts;
+	int source;						// HISTORY_GRID or HISTORY_SOLAR
+	size_t offset;					// field of the data structure
+	uint32_t sequence;				// field updates at the last sample
+	int64_t published_ms;			// newest sample sent over MQTT
+} history_metric_type;
+
+static history_metric_type history[]= {
+	{TIMESERIES("grid_ap",	grid_ap,	10.0,	1000),	HISTORY_GRID,	offsetof(DDSU666H_data_type, ActivePower),	0, 0},
+	{TIMESERIES("solar_ap",	solar_ap,	10.0,	1000),	HISTORY_SOLAR,	offsetof(SDM120CT_data_type, ActivePower),	0, 0},
+	{TIMESERIES("grid_v",	grid_v,		10.0,	10000),	HISTORY_GRID,	offsetof(DDSU666H_data_type, Voltage),		0, 0},
+	{TIMESERIES("solar_v",	solar_v,	10.0,	30000),	HISTORY_SOLAR,	offsetof(SDM120CT_data_type, Voltage),		0, 0},
+};
+#define HISTORY_METRICS		(sizeof(history) / sizeof(history[0]))
+
+void history_task(void *arg)
+{
+	DDSU666H_data_type grid;
+	SDM120CT_data_type solar;
+	const uint8_t *data[2]= {(const uint8_t *) &grid, (const uint8_t *) &solar};
+	measurement_snapshot_type snapshot[2];
+	while(1)
+	{
+		vTaskDelay(HISTORY_TICK_MS / portTICK_PERIOD_MS);
+		DDSU666H_data_snapshot(&grid, &snapshot[HISTORY_GRID]);
+		SDM120CT_data_snapshot(&solar, &snapshot[HISTORY_SOLAR]);
+		for(int i=0; i<HISTORY_METRICS; i++)
+		{
+			history_metric_type *h= &history[i];
+			const measurement_field_type *f= measurement_snapshot_field(&snapshot[h->source], h->offset);
+			// new value only, with the time it was captured
+			if(f == 0 || f->sequence == 0 || f->sequence == h->sequence) continue;
+			h->sequence= f->sequence;
+			float value;
+			memcpy(&value, data[h->source] + h->offset, sizeof(value));
+			timeseries_append(&h->ts, f->time / 1000, value);
+		}
+	}
+} // history_task
+
+// REST "history": {"history":[chunk,chunk,...]}, chunks as in timeseries_json()
+static int history_stream(int (*write) (const void*, size_t, void*), void *ctx)
+{
+	static char chunk[256];
+	int total= 0;
+	if(write("{\"history\":[", 12, ctx) != 0) return -1;
+	for(int i=0; i<HISTORY_METRICS; i++)
+	{
+		int64_t from= esp_timer_get_time() / 1000 - 1000LL * HISTORY_REST_SEC;
+		// as many chunks as needed, one (empty) for a metric without samples
+		for(int c=0; ; c++)
+		{
+			int n= timeseries_json(&history[i].ts, from, chunk, sizeof(chunk), &from);
+			if(n == 0 && c > 0) break;
+			if(i + c > 0 && write(",", 1, ctx) != 0) return -1;
+			if(write(chunk, strlen(chunk), ctx) != 0) return -1;
+			total += n;
+			if(n == 0) break;
+		}
+	}
+	if(write("]}", 2, ctx) != 0) return -1;
+	return total;
+} // history_stream
+
+// Grid active power at the polling rate, compressed (gorilla.c) and appended by the RX task through
+// DDSU666H_power_callback(). Rounded to 1 W it takes 12.4 bits/sample on the modbus_bench trace: 
+// the HISTORY_GRID_BLOCKS KB hold about 2 hours, 24 hours would take some 520 KB (boards with PSRAM)
+#define HISTORY_GRID_BLOCKS		48
+#define HISTORY_GRID_REST_SEC	3600
+
+static gorilla_block_type history_grid_block[HISTORY_GRID_BLOCKS];
+static gorilla_type history_grid;
+static portMUX_TYPE history_grid_lock= portMUX_INITIALIZER_UNLOCKED;
+
+// RX task, constant time
+static void history_grid_append(float power, int64_t time)
+{
+	taskENTER_CRITICAL(&history_grid_lock);
+	gorilla_append(&history_grid, time / 1000, roundf(power));
+	taskEXIT_CRITICAL(&history_grid_lock);
+} // history_grid_append
+
+// Copy of the oldest block with samples newer than from_ms, decoded by the reader outside the lock
+// return	0 none
+static int history_grid_block_copy(int64_t from_ms, gorilla_block_type *copy)
+{
+	int found= 0;
+	taskENTER_CRITICAL(&history_grid_lock);
+	for(int k=0; k<history_grid.n && !found; k++)
+	{
+		const gorilla_block_type *b= gorilla_block(&history_grid, k);
+		if(b->last_ms <= from_ms) continue;
+		memcpy(copy, b, sizeof(gorilla_block_type));
+		found= 1;
+	}
+	taskEXIT_CRITICAL(&history_grid_lock);
+	return found;
+} // history_grid_block_copy
+
+// REST "grid_history": last HISTORY_GRID_REST_SEC at the polling rate
+// {"ts":"grid_ap","scale":1,"now":<ms>,"t":<ms>,"d":[[0,-138],[270,-140],...]} as in timeseries_json()
+static int history_grid_stream(int (*write) (const void*, size_t, void*), void *ctx)
+{
+	static gorilla_block_type copy;
+	static char chunk[256];
+	int64_t from= esp_timer_get_time() / 1000 - 1000LL * HISTORY_GRID_REST_SEC;
+	int64_t previous= 0;
+	int count= 0;
+	size_t len= snprintf(chunk, sizeof(chunk), "{\"ts\":\"grid_ap\",\"scale\":1,\"now\":%lld,", esp_timer_get_time() / 1000);
+	while(history_grid_block_copy(from, &copy))
+	{
+		gorilla_reader_type r;
+		gorilla_sample_type sample;
+		gorilla_reader_init(&r, &copy);
+		while(gorilla_reader_next(&r, &sample))
+		{
+			if(sample.time <= from) continue;
+			if(len + TIMESERIES_JSON_ROOM > sizeof(chunk))
+			{
+				if(write(chunk, len, ctx) != 0) return -1;
+				len= 0;
+			}
+			if(count == 0) len += snprintf(chunk + len, sizeof(chunk) - len, "\"t\":%lld,\"d\":[[0,%ld]", sample.time, (long) sample.value);
+			else len += snprintf(chunk + len, sizeof(chunk) - len, ",[%ld,%ld]", (long) (sample.time - previous), (long) sample.value);
+			previous= sample.time;
+			count ++;
+		}
+		from= copy.last_ms;
+	}
+	len += snprintf(chunk + len, sizeof(chunk) - len, count ? "]}" : "\"d\":[]}");
+	if(write(chunk, len, ctx) != 0) return -1;
+	return count;
+} // history_grid_stream
+
+void history_printf(void)
+{
+	fprintf(stdout, "\nHistory");
+	for(int i=0; i<HISTORY_METRICS; i++) timeseries_printf(&history[i].ts);
+	taskENTER_CRITICAL(&history_grid_lock);
+	uint32_t held= gorilla_held(&history_grid);
+	uint32_t bytes= gorilla_bytes(&history_grid);
+	int64_t span= history_grid.n ? history_grid.previous_ms - gorilla_block(&history_grid, 0)->first_ms : 0;
+	uint32_t dropped= history_grid.dropped;
+	taskEXIT_CRITICAL(&history_grid_lock);
+	fprintf(stdout, "\n   grid_ap    %7lu samples %6lu bytes %5.2f bits/sample  span %6ld s  dropped %lu (gorilla)", 
+		(unsigned long) held, (unsigned long) bytes, held ? 8.0 * bytes / held : 0.0, (long) (span / 1000), (unsigned long) dropped);
+	fprintf(stdout, "\n");
+} // history_printf
+
+
+
 /**
 ---------------------------------------------------------------------------------------------------
 		
@@ -345,21 +620,34 @@ int RestAPICallback(char * type, char *response, size_t sz_response)
 
 ---------------------------------------------------------------------------------------------------
 **/
-static char publish_mess[256];
+// the longest topic (history) and the message within PUBLISH_VARIABLE_SIZE (mqtt.h)
+static char publish_mess[PUBLISH_VARIABLE_SIZE - sizeof(DEVICE_MQTT_NAME"/history") + 1];
+static SemaphoreHandle_t publish_mutex;
+
+// Publish from any task, one message at a time on the TCP connection
+static void publish(const char *topic, const char *message)
+{
+	xSemaphoreTake(publish_mutex, portMAX_DELAY);
+	mqtt_publish(network_tcp_send, topic, message);	
+	xSemaphoreGive(publish_mutex);
+	// grid_power alone publishes 4 times a second
+	if(_VERBOSE_) fprintf(stdout,"mqtt_publish %d bytes\n", strlen(message));
+} // publish
 
 void SDM120CT_publish(void)
 {
 	if(MQTT_is_connected())
 	{
-		
-		snprintf(publish_mess, sizeof(publish_mess),
-			"{"
-			"\"SDM120CT\":{\"v\":\"%3.2f\",\"c\":\"%3.2f\",\"ap\":\"%3.2f\",\"rp\":\"%3.2f\"}"
-			"}",
-			SDM120CT_data.Voltage, SDM120CT_data.Current, SDM120CT_data.ActivePower, SDM120CT_data.ReactivePower
-			);
-		mqtt_publish(network_tcp_send, DEVICE_MQTT_NAME"/set", publish_mess);	
-		fprintf(stdout,"mqtt_publish %d bytes\n", strlen(publish_mess));
+		SDM120CT_data_type SDM120CT_data;
+		measurement_snapshot_type snapshot;
+		SDM120CT_data_snapshot(&SDM120CT_data, &snapshot);
+		snprintf(publish_mess, sizeof(publish_mess), "{\"SDM120CT\":");
+		int len= strlen(publish_mess);
+		// nothing fresh: the last values are not published again as current
+		if(measurement_json(&publish_mess[len], sizeof(publish_mess)-len, &SDM120CT_data, &snapshot, SDM120CT_keys, MODBUS_REGISTER_MAP_SIZE(SDM120CT_keys)) == 0) return;
+		len= strlen(publish_mess);
+		snprintf(&publish_mess[len], sizeof(publish_mess)-len, "}");
+		publish(DEVICE_MQTT_NAME"/set", publish_mess);
 	}
 } // SDM120CT_publish
 
@@ -367,35 +655,307 @@ void DDSU666H_publish(void)
 {
 	if(MQTT_is_connected())
 	{
-		snprintf(publish_mess, sizeof(publish_mess),
-			"{"
-			"\"DDSU666H\":{\"v\":\"%3.2f\",\"c\":\"%3.2f\",\"ap\":\"%3.2f\",\"rp\":\"%3.2f\"}"
-			"}",
-			DDSU666H_data.Voltage, DDSU666H_data.Current, DDSU666H_data.ActivePower, DDSU666H_data.ReactivePower
-			); 		
-		mqtt_publish(network_tcp_send, DEVICE_MQTT_NAME"/set", publish_mess);	
-		fprintf(stdout,"mqtt_publish %d bytes\n", strlen(publish_mess));
+		DDSU666H_data_type DDSU666H_data;
+		measurement_snapshot_type snapshot;
+		DDSU666H_data_snapshot(&DDSU666H_data, &snapshot);
+		snprintf(publish_mess, sizeof(publish_mess), "{\"DDSU666H\":");
+		int len= strlen(publish_mess);
+		if(measurement_json(&publish_mess[len], sizeof(publish_mess)-len, &DDSU666H_data, &snapshot, DDSU666H_keys, MODBUS_REGISTER_MAP_SIZE(DDSU666H_keys)) == 0) return;
+		len= strlen(publish_mess);
+		snprintf(&publish_mess[len], sizeof(publish_mess)-len, "}");
+		publish(DEVICE_MQTT_NAME"/set", publish_mess);
 	}
 } // DDSU666H_publish
 
+// About 210 bytes with one slave, skipped if the counters ever outgrow publish_mess
+void modbus_publish(void)
+{
+	if(MQTT_is_connected())
+	{
+		snprintf(publish_mess, sizeof(publish_mess), "{\"modbus\":{\"SDM120CT\":");
+		int len= strlen(publish_mess);
+		len += SDM120CT_modbus_json(&publish_mess[len], sizeof(publish_mess)-len);
+		if(len >= sizeof(publish_mess) - 2) return;
+		snprintf(&publish_mess[len], sizeof(publish_mess)-len, "}}");
+		publish(DEVICE_MQTT_NAME"/set", publish_mess);
+	}
+} // modbus_publish
+
+// One message per UART: about 130 bytes each, up to 170 with 10-digit counters, both together
+// would not fit publish_mess (PUBLISH_VARIABLE_SIZE)
+void bus_publish(void)
+{
+	if(MQTT_is_connected())
+	{
+		snprintf(publish_mess, sizeof(publish_mess), "{\"bus\":{\"SDM120CT\":");
+		int len= strlen(publish_mess);
+		len += SDM120CT_bus_json(&publish_mess[len], sizeof(publish_mess)-len, 1);
+		if(len >= sizeof(publish_mess) - 2) return;
+		snprintf(&publish_mess[len], sizeof(publish_mess)-len, "}}");
+		publish(DEVICE_MQTT_NAME"/set", publish_mess);
+
+		snprintf(publish_mess, sizeof(publish_mess), "{\"bus\":{\"DDSU666H\":");
+		len= strlen(publish_mess);
+		len += DDSU666H_bus_json(&publish_mess[len], sizeof(publish_mess)-len, 1);
+		if(len >= sizeof(publish_mess) - 2) return;
+		snprintf(&publish_mess[len], sizeof(publish_mess)-len, "}}");
+		publish(DEVICE_MQTT_NAME"/set", publish_mess);
+	}
+} // bus_publish
+
+// Samples not published yet, HISTORY_MQTT_CHUNKS messages per metric at most
+void history_publish(void)
+{
+	for(int i=0; i<HISTORY_METRICS; i++)
+	{
+		for(int c=0; c<HISTORY_MQTT_CHUNKS && MQTT_is_connected(); c++)
+		{
+			if(timeseries_json(&history[i].ts, history[i].published_ms, publish_mess, HISTORY_MQTT_SIZE, &history[i].published_ms) == 0) break;
+			publish(DEVICE_MQTT_NAME"/history", publish_mess);
+		}
+	}
+} // history_publish
+
+// SDM120CT_callback() runs in the SDM120CT master (or scheduler) task at the UART priority: it only 
+// wakes up report_task, the console dumps and the MQTT publishes go on at low priority, with the 
+// SDM120CT bus free for the next reads
+static TaskHandle_t report_handle;
+
 void SDM120CT_callback (SDM120CT_sequence_phase_t SDM120CT_sequence_phase)
 {
-	printf("\n");
-	if(SDM120CT_sequence_phase == INFO)
+	if(report_handle) xTaskNotify(report_handle, 1 << SDM120CT_sequence_phase, eSetBits);
+} // SDM120CT_callback
+
+void report_task(void *arg)
+{
+	uint32_t phases;
+	while(1)
 	{
-		SDM120CT_info_printf();
+		xTaskNotifyWait(0, 0xFFFFFFFF, &phases, portMAX_DELAY);
+		printf("\n");
+		if(phases & (1 << INFO))
+		{
+			SDM120CT_info_printf();
+		}
+		if(phases & (1 << DATA))
+		{
+			SDM120CT_printf();
+			DDSU666H_printf();
+			
+			SDM120CT_publish();
+			DDSU666H_publish();
+			modbus_publish();
+			bus_publish();
+			history_publish();
+		}
+		fflush(stdout);
 	}
-	else
+} // report_task
+
+
+// Grid active power stream
+// The inverter polls the DDSU666-H active power every 250-300 ms, DDSU666H_power_callback() keeps
+// every sample (history_grid) and wakes up grid_power_task that publishes the latest value at most 
+// every MQTT_GRID_POWER_MS
+static TaskHandle_t grid_power_handle;
+
+void DDSU666H_power_callback(float power, int64_t time)
+{
+	history_grid_append(power, time);
+	if(grid_power_handle) xTaskNotifyGive(grid_power_handle);
+} // DDSU666H_power_callback
+
+void grid_power_task(void *arg)
+{
+	static char mess[64];
+	DDSU666H_data_type DDSU666H_data;
+	while(1)
 	{
-		SDM120CT_printf();
-		DDSU666H_printf();
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if(!MQTT_is_connected()) continue;
+		DDSU666H_data_get(&DDSU666H_data);
+		snprintf(mess, sizeof(mess), "{\"DDSU666H\":{\"ap\":\"%3.2f\",\"age\":%ld}}", 
+			DDSU666H_data.ActivePower, DDSU666H_age_ms(DDSU666H_REG_ACTIVE_POWER));
+		publish(DEVICE_MQTT_NAME"/grid_power", mess);
+		// rate limit, samples in between are skipped
+		vTaskDelay(MQTT_GRID_POWER_MS / portTICK_PERIOD_MS);
+	}
+} // grid_power_task
+
+
+/**
+---------------------------------------------------------------------------------------------------
 		
-		SDM120CT_publish();
-		DDSU666H_publish();
+								   AGGREGATES
+
+---------------------------------------------------------------------------------------------------
+Min, max, mean and time-weighted integral of the main metrics over 1 s, 1 min and 15 min windows
+(aggregate.c), updated by every decoded value through the measurement store hook, so no sample 
+is missed whatever the publish rate.
+	REST	"aggregates" streams the last closed window of every length and metric
+	MQTT	DEVICE_MQTT_NAME/aggregate carries every new 1 min and 15 min summary, one per message 
+			(the 1 s windows are REST only)
+The windows are aligned to the uptime, there is no wall clock on the device.
+---------------------------------------------------------------------------------------------------
+**/
+#define AGGREGATE_TICK_MS		250
+#define AGGREGATE_MQTT_FROM		1			// first window length published (1 min)
+
+typedef struct aggregate_metric_s
+{
+	const char *name;
+	aggregate_type a;
+	int source;						// HISTORY_GRID or HISTORY_SOLAR
+	size_t offset;					// field of the data structure
+	uint32_t published[AGGREGATE_WINDOWS];	// closed windows already published
+} aggregate_metric_type;
+
+static aggregate_metric_type aggregates[]= {
+	{.name= "grid_ap",	.source= HISTORY_GRID,		.offset= offsetof(DDSU666H_data_type, ActivePower)},
+	{.name= "solar_ap",	.source= HISTORY_SOLAR,	.offset= offsetof(SDM120CT_data_type, ActivePower)},
+	{.name= "grid_v",	.source= HISTORY_GRID,		.offset= offsetof(DDSU666H_data_type, Voltage)},
+	{.name= "solar_v",	.source= HISTORY_SOLAR,	.offset= offsetof(SDM120CT_data_type, Voltage)},
+};
+#define AGGREGATE_METRICS		(sizeof(aggregates) / sizeof(aggregate_metric_type))
+
+// Measurement store hook, runs in the meter task for every decoded value
+// arg is the source, time the capture time (us)
+static void aggregate_sample(void *arg, size_t offset, float value, int64_t time)
+{
+	int source= (int) (intptr_t) arg;
+	for(int i=0; i<AGGREGATE_METRICS; i++)
+	{
+		if(aggregates[i].source == source && aggregates[i].offset == offset) 
+			aggregate_add(&aggregates[i].a, time / 1000, value);
 	}
-} // SDM120CT_callback
+} // aggregate_sample
+
+void aggregate_task(void *arg)
+{
+	// about 115 bytes, with the topic within PUBLISH_VARIABLE_SIZE (mqtt.h)
+	static char mess[PUBLISH_VARIABLE_SIZE - sizeof(DEVICE_MQTT_NAME"/aggregate")];
+	aggregate_summary_type summary;
+	while(1)
+	{
+		vTaskDelay(AGGREGATE_TICK_MS / portTICK_PERIOD_MS);
+		int64_t now= esp_timer_get_time() / 1000;
+		for(int i=0; i<AGGREGATE_METRICS; i++)
+		{
+			aggregate_advance(&aggregates[i].a, now);
+			for(int w=AGGREGATE_MQTT_FROM; w<AGGREGATE_WINDOWS; w++)
+			{
+				uint32_t closed= aggregate_closed(&aggregates[i].a, w, &summary);
+				if(closed == aggregates[i].published[w]) continue;
+				// summaries closed while disconnected are skipped, the latest one is kept for REST
+				if(!MQTT_is_connected()) continue;
+				aggregates[i].published[w]= closed;
+				aggregate_json(aggregates[i].a.name, &summary, mess, sizeof(mess));
+				publish(DEVICE_MQTT_NAME"/aggregate", mess);
+			}
+		}
+	}
+} // aggregate_task
+
+// REST "aggregates": [{"agg":"grid_ap","w":1,...},{"agg":"grid_ap","w":60,...},...] as in aggregate_json()
+static int aggregate_stream(int (*write) (const void*, size_t, void*), void *ctx)
+{
+	static char chunk[192];
+	aggregate_summary_type summary;
+	int count= 0;
+	for(int i=0; i<AGGREGATE_METRICS; i++)
+	{
+		for(int w=0; w<AGGREGATE_WINDOWS; w++)
+		{
+			if(aggregate_closed(&aggregates[i].a, w, &summary) == 0) continue;
+			chunk[0]= count ? ',' : '[';
+			int len= 1 + aggregate_json(aggregates[i].a.name, &summary, chunk + 1, sizeof(chunk) - 1);
+			if(len >= sizeof(chunk)) len= sizeof(chunk) - 1;
+			if(write(chunk, len, ctx) != 0) return -1;
+			count ++;
+		}
+	}
+	if(write(count ? "]" : "[]", count ? 1 : 2, ctx) != 0) return -1;
+	return count;
+} // aggregate_stream
+
+void aggregate_init_all(void)
+{
+	for(int i=0; i<AGGREGATE_METRICS; i++) aggregate_init(&aggregates[i].a, aggregates[i].name);
+} // aggregate_init_all
+
+void aggregates_printf(void)
+{
+	fprintf(stdout, "\nAggregates");
+	for(int i=0; i<AGGREGATE_METRICS; i++) aggregate_printf(&aggregates[i].a);
+	fprintf(stdout, "\n");
+} // aggregates_printf
 
 
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   VIRTUAL SLAVE
+
+---------------------------------------------------------------------------------------------------
+	MODBUS_SLAVE_ADDRESS on UART_0 and any unit id on Modbus TCP port 502
+	FC03 and FC04 read the same registers
+	Float32, high word first, 2 registers each
+
+	0x0000	grid voltage (V)				DDSU666-H
+	0x0002	grid current (A)
+	0x0004	grid active power (W)			> 0 import
+	0x0006	grid reactive power (var)
+	0x0008	grid power factor
+	0x000A	grid frequency (Hz)
+	0x000C	grid positive active energy (kWh)
+	0x000E	grid negative active energy (kWh)
+	0x0010	grid active power age (ms)		-1 never received
+
+	0x0020	solar voltage (V)				SDM120CT
+	0x0022	solar current (A)
+	0x0024	solar active power (W)
+	0x0026	solar reactive power (var)
+	0x0028	solar power factor
+	0x002A	solar frequency (Hz)
+	0x002C	solar import active energy (kWh)
+	0x002E	solar export active energy (kWh)
+
+	0x0040	consumption (W)					grid + solar active power
+---------------------------------------------------------------------------------------------------
+**/
+#define SLAVE_REG_GRID			0x0000
+#define SLAVE_REG_SOLAR			0x0020
+#define SLAVE_REG_CONSUMPTION	0x0040
+
+// Called by the slave and Modbus TCP tasks before an answer, at most every MODBUS_SLAVE_REFRESH_MS
+static void modbus_slave_refresh(void)
+{
+	DDSU666H_data_type DDSU666H_data;
+	DDSU666H_data_get(&DDSU666H_data);
+	SDM120CT_data_type SDM120CT_data;
+	SDM120CT_data_get(&SDM120CT_data);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x00, DDSU666H_data.Voltage);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x02, DDSU666H_data.Current);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x04, DDSU666H_data.ActivePower);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x06, DDSU666H_data.ReactivePower);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x08, DDSU666H_data.PowerFactor);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x0A, DDSU666H_data.Frecuency);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x0C, DDSU666H_data.PositiveActiveEnergy);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x0E, DDSU666H_data.NegativeActiveEnergy);
+	modbus_slave_set_float(SLAVE_REG_GRID + 0x10, DDSU666H_age_ms(DDSU666H_REG_ACTIVE_POWER));
+
+	modbus_slave_set_float(SLAVE_REG_SOLAR + 0x00, SDM120CT_data.Voltage);
+	modbus_slave_set_float(SLAVE_REG_SOLAR + 0x02, SDM120CT_data.Current);
+	modbus_slave_set_float(SLAVE_REG_SOLAR + 0x04, SDM120CT_data.ActivePower);
+	modbus_slave_set_float(SLAVE_REG_SOLAR + 0x06, SDM120CT_data.ReactivePower);
+	modbus_slave_set_float(SLAVE_REG_SOLAR + 0x08, SDM120CT_data.PowerFactor);
+	modbus_slave_set_float(SLAVE_REG_SOLAR + 0x0A, SDM120CT_data.Frecuency);
+	modbus_slave_set_float(SLAVE_REG_SOLAR + 0x0C, SDM120CT_data.ImportActiveEnergy);
+	modbus_slave_set_float(SLAVE_REG_SOLAR + 0x0E, SDM120CT_data.ExportActiveEnergy);
+
+	modbus_slave_set_float(SLAVE_REG_CONSUMPTION, DDSU666H_data.ActivePower + SDM120CT_data.ActivePower);
+} // modbus_slave_refresh
+
 /**
 ---------------------------------------------------------------------------------------------------
 		
@@ -478,13 +1038,40 @@ void app_main(void)
 	// TASK
 	// REST API SERVER
 	network_server_create(RestAPICallback, 3);
+#if MODBUS_CAPTURE
+	network_server_stream("capture", "application/vnd.tcpdump.pcap", modbus_capture_stream);
+#endif
+	network_server_stream("history", SERVER_CONTENT_TYPE, history_stream);
+	network_server_stream("grid_history", SERVER_CONTENT_TYPE, history_grid_stream);
+	network_server_stream("aggregates", SERVER_CONTENT_TYPE, aggregate_stream);
 
 	// --------------------------------------------------------------------------------------------
 	// TASK
+	// MQTT publish from the meter tasks
+	publish_mutex= xSemaphoreCreateMutex();
+	xTaskCreate(report_task, "report", 4*1024, NULL, 2, &report_handle);
+	xTaskCreate(grid_power_task, "grid_power", 3*1024, NULL, 2, &grid_power_handle);
+	// History of the main metrics
+	for(int i=0; i<HISTORY_METRICS; i++) timeseries_init(&history[i].ts);
+	gorilla_init(&history_grid, history_grid_block, HISTORY_GRID_BLOCKS);
+	xTaskCreate(history_task, "history", 3*1024, NULL, 2, NULL);
+	// Windowed aggregates, fed by the meter tasks
+	aggregate_init_all();
+	xTaskCreate(aggregate_task, "aggregate", 3*1024, NULL, 2, NULL);
 	// SDM120CT serial
 	SDM120CT_create(SDM120CT_callback, configMAX_PRIORITIES-1);
+	SDM120CT_data_hook(aggregate_sample, (void *) (intptr_t) HISTORY_SOLAR);
 	// DSU666H serial
-	DDSU666H_create(configMAX_PRIORITIES-1);
+	DDSU666H_create(DDSU666H_power_callback, configMAX_PRIORITIES-1);
+	DDSU666H_data_hook(aggregate_sample, (void *) (intptr_t) HISTORY_GRID);
+	// Virtual slave for the other masters in the house and the network tools
+	modbus_slave_init(MODBUS_SLAVE_ADDRESS, modbus_slave_refresh);
+#if MODBUS_SLAVE
+	modbus_slave_create(MODBUS_SLAVE_UART, MODBUS_SLAVE_BAUDRATE, MODBUS_SLAVE_TX_GPIO, MODBUS_SLAVE_RX_GPIO, configMAX_PRIORITIES-1);
+#endif
+#if MODBUS_TCP
+	modbus_tcp_create(3);
+#endif
 
 	// --------------------------------------------------------------------------------------------
 	// On-board blue LED
@@ -501,6 +1088,17 @@ void app_main(void)
 				PROJECTInfo();
 				SystemInfo();
 				SDM120CT_info_printf();	
+				SDM120CT_scheduler_printf();
+				SDM120CT_modbus_printf();
+				SDM120CT_bus_printf();
+				DDSU666H_bus_printf();
+				modbus_slave_printf();
+#if MODBUS_TCP
+				modbus_tcp_printf();
+#endif
+				modbus_capture_printf();
+				history_printf();
+				aggregates_printf();
 				fflush(stdout);
 			}
 			// Ctrl + w
@@ -518,6 +1116,13 @@ void app_main(void)
 				fflush(stdout);
 				gpio_set_level(PIN_GPIO_ONBOARD_LED, led_is_on? 1:0);
 			}	
+			// Ctrl + t
+			if(c==0x14)
+			{
+				CRC16_benchmark();
+				replay_benchmark();
+				gorilla_benchmark();
+			}
 			// Ctrl + m
 			if(c==0x0a)
 			{
@@ -0,0 +1,211 @@
+/** ************************************************************************************************
+ *	Measurement store
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - timestamped fields with staleness
+ * 	1.1.0 - sample hook (aggregates)
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+The latest values of a meter and, per field, when they were captured and how many times. A value
+is only worth publishing while it is recent: the inverter may stop polling the DDSU666-H, the 
+SDM120CT may stop answering, and the data structure would keep the last values for ever.
+
+	field		float of the meter data structure (offset), with its staleness threshold
+	time		capture time of the frame that carried it (us)
+	sequence	updates of the field, 0 never received; the store has one for all of them
+	quality		worked out when read: never seen, fresh, or stale (older than the threshold)
+
+The writer (the task that decodes the responses) updates values and fields inside one seqlock 
+write, the readers take a snapshot of both with measurement_store_get(), so the value and its
+time always belong together.
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>			// memcpy
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"		// esp_timer_get_time()
+
+#include "modbus.h"
+#include "seqlock.h"
+#include "measurement.h"
+
+void measurement_store_init(measurement_store_type *store, const char *name, void *data, size_t size, measurement_field_type *field, int n)
+{
+	store->name= name;
+	store->data= data;
+	store->size= size;
+	store->field= field;
+	store->n= n > MEASUREMENT_FIELDS_MAX ? MEASUREMENT_FIELDS_MAX : n;
+	store->sequence= 0;
+	store->sample= 0;
+	store->sample_arg= 0;
+	memset(data, 0, size);
+	for(int i=0; i<store->n; i++)
+	{
+		field[i].time= 0;
+		field[i].sequence= 0;
+	}
+	seqlock_init(&store->lock);
+} // measurement_store_init
+
+static measurement_field_type *measurement_field(measurement_field_type *field, int n, size_t offset)
+{
+	for(int i=0; i<n; i++) if(field[i].offset == offset) return &field[i];
+	return 0;
+} // measurement_field
+
+// Decode the fields of the map inside the block [start, start + count) and stamp them
+// Called between seqlock_write_begin(&store->lock) and seqlock_write_end(&store->lock)
+// data		first register of the block, wire order
+// time		capture time (us)
+// samples	collects the decoded values for measurement_store_samples(), may be 0
+// return	number of fields decoded
+int measurement_store_decode(measurement_store_type *store, const modbus_register_map_type *map, int map_n, uint16_t start, const uint8_t *data, uint16_t count, int64_t time, measurement_samples_type *samples)
+{
+	int n= 0;
+	for(int i=0; i<map_n; i++)
+	{
+		if(modbus_decode_block(&map[i], 1, start, data, count, store->data) == 0) continue;
+		measurement_field_type *f= measurement_field(store->field, store->n, map[i].offset);
+		if(f)
+		{
+			f->time= time;
+			f->sequence ++;
+		}
+		if(samples && map[i].type == MODBUS_FLOAT32 && samples->n < MEASUREMENT_FIELDS_MAX)
+		{
+			samples->time= time;
+			samples->sample[samples->n].offset= map[i].offset;
+			memcpy(&samples->sample[samples->n].value, (uint8_t *) store->data + map[i].offset, sizeof(float));
+			samples->n ++;
+		}
+		n ++;
+	}
+	if(n) store->sequence ++;
+	return n;
+} // measurement_store_decode
+
+// Values collected by measurement_store_decode() to the sample hook, after seqlock_write_end(): 
+// the write stays short (critical section) whatever the hook does
+void measurement_store_samples(measurement_store_type *store, measurement_samples_type *samples)
+{
+	void (*sample) (void *arg, size_t offset, float value, int64_t time)= store->sample;
+	if(sample == 0) return;
+	for(int i=0; i<samples->n; i++) sample(store->sample_arg, samples->sample[i].offset, samples->sample[i].value, samples->time);
+	samples->n= 0;
+} // measurement_store_samples
+
+// Every decoded value is also passed to sample(), e.g. to aggregate it
+void measurement_store_hook(measurement_store_type *store, void (*sample) (void *arg, size_t offset, float value, int64_t time), void *arg)
+{
+	seqlock_write_begin(&store->lock);
+	store->sample_arg= arg;
+	store->sample= sample;
+	seqlock_write_end(&store->lock);
+} // measurement_store_hook
+
+// Consistent copy of the values (data, may be 0) and of the field information (snapshot, may be 0)
+void measurement_store_get(measurement_store_type *store, void *data, measurement_snapshot_type *snapshot)
+{
+	uint32_t sequence;
+	do
+	{
+		sequence= seqlock_read_begin(&store->lock);
+		if(data) memcpy(data, store->data, store->size);
+		if(snapshot)
+		{
+			snapshot->sequence= store->sequence;
+			snapshot->n= store->n;
+			memcpy(snapshot->field, store->field, store->n * sizeof(measurement_field_type));
+		}
+	} while(seqlock_read_retry(&store->lock, sequence));
+	if(snapshot) snapshot->now= esp_timer_get_time();
+} // measurement_store_get
+
+// Field information of the snapshot, 0 if the offset is not a field of the store
+const measurement_field_type *measurement_snapshot_field(const measurement_snapshot_type *snapshot, size_t offset)
+{
+	return measurement_field((measurement_field_type *) snapshot->field, snapshot->n, offset);
+} // measurement_snapshot_field
+
+int measurement_quality(const measurement_snapshot_type *snapshot, size_t offset)
+{
+	const measurement_field_type *f= measurement_snapshot_field(snapshot, offset);
+	if(f == 0 || f->sequence == 0) return MEASUREMENT_NEVER;
+	if(f->stale_ms && snapshot->now - f->time > 1000LL * f->stale_ms) return MEASUREMENT_STALE;
+	return MEASUREMENT_FRESH;
+} // measurement_quality
+
+// Age of the field when the snapshot was taken, -1 never received
+int32_t measurement_age_ms(const measurement_snapshot_type *snapshot, size_t offset)
+{
+	const measurement_field_type *f= measurement_snapshot_field(snapshot, offset);
+	if(f == 0 || f->sequence == 0) return -1;
+	return (int32_t) ((snapshot->now - f->time) / 1000);
+} // measurement_age_ms
+
+const char *measurement_quality_name(int quality)
+{
+	switch(quality)
+	{
+		case MEASUREMENT_FRESH:	return "fresh";
+		case MEASUREMENT_STALE:	return "stale";
+		default:				return "none";
+	}
+} // measurement_quality_name
+
+// {"v":"230.10","c":null,...,"q":"stale","age":1234,"seq":567}
+// Fresh fields with their value, stale and never received ones null
+// q and age are those of the worst field of the list (none if one was never received)
+// return	number of fresh fields, 0 nothing worth publishing
+int measurement_json(char *buffer, size_t sz, const void *data, const measurement_snapshot_type *snapshot, const measurement_key_type *key, int n)
+{
+	int never= 0, stale= 0, fresh= 0;
+	int32_t age= 0;
+	size_t len= 0;
+	len += snprintf(buffer + len, len < sz ? sz - len : 0, "{");
+	for(int i=0; i<n; i++)
+	{
+		int quality= measurement_quality(snapshot, key[i].offset);
+		int32_t a= measurement_age_ms(snapshot, key[i].offset);
+		if(quality == MEASUREMENT_NEVER) never ++;
+		if(quality == MEASUREMENT_STALE) stale ++;
+		if(quality == MEASUREMENT_FRESH) fresh ++;
+		if(a > age) age= a;
+		float value;
+		memcpy(&value, (const uint8_t *) data + key[i].offset, sizeof(value));
+		if(quality == MEASUREMENT_FRESH)
+			len += snprintf(buffer + len, len < sz ? sz - len : 0, "\"%s\":\"%3.2f\",", key[i].key, value);
+		else
+			len += snprintf(buffer + len, len < sz ? sz - len : 0, "\"%s\":null,", key[i].key);
+	}
+	int quality= never ? MEASUREMENT_NEVER : stale ? MEASUREMENT_STALE : MEASUREMENT_FRESH;
+	if(never) age= -1;
+	snprintf(buffer + len, len < sz ? sz - len : 0, "\"q\":\"%s\",\"age\":%ld,\"seq\":%lu}", 
+		measurement_quality_name(quality), (long) age, (unsigned long) snapshot->sequence);
+	return fresh;
+} // measurement_json
+
+void measurement_store_printf(measurement_store_type *store)
+{
+	uint8_t data[store->size];
+	measurement_snapshot_type snapshot;
+	measurement_store_get(store, data, &snapshot);
+	fprintf(stdout, "\n%s measurements, %lu updates", store->name, (unsigned long) snapshot.sequence);
+	for(int i=0; i<snapshot.n; i++)
+	{
+		const measurement_field_type *f= &snapshot.field[i];
+		float value;
+		memcpy(&value, data + f->offset, sizeof(value));
+		fprintf(stdout, "\n   %-22s %10.2f  %-5s age %8ld ms  updates %6lu  stale after %lu ms", f->name, value, 
+			measurement_quality_name(measurement_quality(&snapshot, f->offset)), (long) measurement_age_ms(&snapshot, f->offset),
+			(unsigned long) f->sequence, (unsigned long) f->stale_ms);
+	}
+	fprintf(stdout, "\n   snapshot reads repeated %lu\n", (unsigned long) store->lock.retries);
+} // measurement_store_printf
+
+// END OF FILE
\ No newline at end of file
@@ -0,0 +1,82 @@
+#ifndef _MEASUREMENT_H_
+#define _MEASUREMENT_H_
+
+#include <stddef.h>		// offsetof
+
+#define MEASUREMENT_FIELDS_MAX		16		// fields of one store
+
+// Quality of a field when it is read
+#define MEASUREMENT_NEVER			0		// never received
+#define MEASUREMENT_FRESH			1
+#define MEASUREMENT_STALE			2		// older than its threshold
+
+// Float field of the meter data structure
+typedef struct measurement_field_s
+{
+	const char *name;
+	size_t offset;				// in the data structure
+	uint32_t stale_ms;			// older than this is stale, 0 never
+	int64_t time;				// capture time (us)
+	uint32_t sequence;			// updates, 0 never received
+} measurement_field_type;
+
+#define MEASUREMENT_FIELD(struct_type, field, stale_ms)		{ #field, offsetof(struct_type, field), stale_ms, 0, 0 }
+
+typedef struct measurement_store_s
+{
+	const char *name;
+	void *data;					// latest values, the meter data structure
+	size_t size;
+	measurement_field_type *field;
+	int n;
+	seqlock_type lock;			// the writers decode inside seqlock_write_begin/end(&store->lock)
+	uint32_t sequence;			// updates of the store
+	// optional, every decoded value (writer task, after the write)
+	void (*sample) (void *arg, size_t offset, float value, int64_t time);
+	void *sample_arg;
+} measurement_store_type;
+
+// Values decoded in one write, handed to the sample hook once the write is over
+typedef struct measurement_samples_s
+{
+	int64_t time;
+	int n;
+	struct
+	{
+		size_t offset;
+		float value;
+	} sample[MEASUREMENT_FIELDS_MAX];
+} measurement_samples_type;
+
+// Consistent copy of the field information of a store
+typedef struct measurement_snapshot_s
+{
+	int64_t now;				// when it was taken (us)
+	uint32_t sequence;
+	int n;
+	measurement_field_type field[MEASUREMENT_FIELDS_MAX];
+} measurement_snapshot_type;
+
+// Published field and its JSON key
+typedef struct measurement_key_s
+{
+	const char *key;
+	size_t offset;
+} measurement_key_type;
+
+#define MEASUREMENT_KEY(key, struct_type, field)			{ key, offsetof(struct_type, field) }
+
+void measurement_store_init(measurement_store_type *store, const char *name, void *data, size_t size, measurement_field_type *field, int n);
+int measurement_store_decode(measurement_store_type *store, const modbus_register_map_type *map, int map_n, uint16_t start, const uint8_t *data, uint16_t count, int64_t time, measurement_samples_type *samples);
+void measurement_store_samples(measurement_store_type *store, measurement_samples_type *samples);
+void measurement_store_hook(measurement_store_type *store, void (*sample) (void *arg, size_t offset, float value, int64_t time), void *arg);
+void measurement_store_get(measurement_store_type *store, void *data, measurement_snapshot_type *snapshot);
+const measurement_field_type *measurement_snapshot_field(const measurement_snapshot_type *snapshot, size_t offset);
+int measurement_quality(const measurement_snapshot_type *snapshot, size_t offset);
+int32_t measurement_age_ms(const measurement_snapshot_type *snapshot, size_t offset);
+const char *measurement_quality_name(int quality);
+int measurement_json(char *buffer, size_t sz, const void *data, const measurement_snapshot_type *snapshot, const measurement_key_type *key, int n);
+void measurement_store_printf(measurement_store_type *store);
+
+#endif
+// END OF FILE
\ No newline at end of file
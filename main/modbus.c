@@ -3,17 +3,84 @@
  *  (c) Fernando R (iambobot.com)
  *
  * 	1.0.0 - June 2025 - created
+ * 	1.1.0 - table-driven CRC16
+ *			RTU frame assembler
+ *			register map decode
+ *			read planner
+ *			shadow register image
+ *			passive sniffer
+ *			ambiguous 8-byte FC01-04 frames held until the next bytes tell
  *
  ** ************************************************************************************************
 **/
 
 #include <stdio.h>		// uint16_t 
+#include <stdint.h>		// uint8_t (host build)
+#include <string.h>		// memset
 #include "modbus.h"
 
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   CRC16
+
+---------------------------------------------------------------------------------------------------
+CRC16 Modbus RTU, reflected polynomial 0xA001, initial value 0xFFFF
+The bit by bit version costs 8 shift/xor iterations per byte. The table versions below produce 
+the same result with one lookup per byte (256-entry table, 512 bytes of flash) or two lookups 
+per byte (16-entry nibble table, 32 bytes). Select with MODBUS_CRC16_TABLE in modbus.h
+**/
+#if MODBUS_CRC16_TABLE == 256
+static const uint16_t CRC16_table[256] = {
+	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241, 0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40, 0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40, 0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641, 0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240, 0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41, 0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41, 0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640, 0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240, 0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41, 0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41, 0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640, 0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241, 0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40, 0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40, 0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641, 0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+#else
+static const uint16_t CRC16_table[16] = {
+	0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401, 
+	0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+#endif
+
+static inline uint16_t CRC16_byte(uint16_t crc, uint8_t byte)
+{
+#if MODBUS_CRC16_TABLE == 256
+	return (crc >> 8) ^ CRC16_table[(crc ^ byte) & 0xFF];
+#else
+	crc ^= byte;
+	crc = (crc >> 4) ^ CRC16_table[crc & 0x0F];
+	return (crc >> 4) ^ CRC16_table[crc & 0x0F];
+#endif
+} // CRC16_byte
+
+uint16_t CRC16(const uint8_t *data, uint16_t longitud) 
+{
+    uint16_t crc = 0xFFFF;
+    for (uint16_t i = 0; i < longitud; i++) {
+		crc = CRC16_byte(crc, data[i]);
+    }
+    return crc;
+}// CRC16
+
 // Función que calcula el CRC16 Modbus
 // CRC16 Modbus RTU (usando el polinomio 0xA001)
 // chatGPT code
-uint16_t CRC16(const uint8_t *data, uint16_t longitud) 
+// Bit by bit reference, kept for CRC16_benchmark()
+uint16_t CRC16_bitwise(const uint8_t *data, uint16_t longitud) 
 {
     uint16_t crc = 0xFFFF;
     for (uint16_t i = 0; i < longitud; i++) {
@@ -27,18 +94,629 @@ uint16_t CRC16(const uint8_t *data, uint16_t longitud)
         }
     }
     return crc;
-}// CRC16
+}// CRC16_bitwise
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   RTU FRAME ASSEMBLER
+
+---------------------------------------------------------------------------------------------------
+Bytes are accumulated across UART reads and the CRC is updated as they arrive. Since the CRC 
+computed over a whole frame, Error Check included, is zero, a frame is verified as soon as its 
+last byte is in:
+- when the length expected from the header is reached and the CRC is zero the frame is delivered 
+  straight away, which also splits back-to-back frames read in one go
+- FC01-04 8 bytes with a zero CRC may be a request or the head of a longer response: they are 
+  kept, with a second CRC from there on. The response length with a zero CRC delivers one response,
+  a complete frame right behind (zero second CRC) or the gap delivers the request first
+- otherwise the frame ends at the t3.5 silence (modbus_rtu_rx_gap). What is left is delivered if 
+  the CRC is zero and dropped if not
+The capture hook, when set, sees every frame boundary with the bytes delivered or dropped.
+**/
+void modbus_rtu_rx_init(modbus_rtu_rx_type *rx, void (*callback) (uint8_t*, int))
+{
+	memset(rx, 0, sizeof(modbus_rtu_rx_type));
+	rx->crc= 0xFFFF;
+	rx->callback= callback;
+} // modbus_rtu_rx_init
+
+static void modbus_rtu_rx_capture(modbus_rtu_rx_type *rx, const uint8_t *frame, int len, int flags)
+{
+	if(rx->capture && len > 0) rx->capture(rx->capture_arg, frame, len, flags);
+} // modbus_rtu_rx_capture
+
+static void modbus_rtu_rx_reset(modbus_rtu_rx_type *rx)
+{
+	rx->len= 0;
+	rx->crc= 0xFFFF;
+	rx->split= 0;
+} // modbus_rtu_rx_reset
+
+// Frame lengths that are possible for the header received so far
+// Requests and responses share the header layout so both lengths are accepted
+static int modbus_rtu_length_match(const uint8_t *frame, int len)
+{
+	if(len < 4) return 0;
+	uint8_t fc= frame[1];
+	// exception response: address, function | 0x80, exception code, CRC
+	if(fc & 0x80) return len == 5;
+	switch(fc)
+	{
+		case 0x01: case 0x02: case 0x03: case 0x04:	return len == 8 || len == 5 + frame[2];
+		case 0x05: case 0x06:						return len == 8;
+		case 0x0F: case 0x10:						return len == 8 || (len > 6 && len == 9 + frame[6]);
+	}
+	return 0;
+} // modbus_rtu_length_match
+
+// 8 bytes of FC01-04 may be a request or the head of a longer response whose CRC happens to be
+// zero there (1 in 65536)
+static int modbus_rtu_length_ambiguous(const uint8_t *frame, int len)
+{
+	return len == 8 && frame[1] >= 0x01 && frame[1] <= 0x04 && 5 + frame[2] > 8;
+} // modbus_rtu_length_ambiguous
+
+// Longest frame the header received so far may belong to, 0 unknown function code
+static int modbus_rtu_length_max(const uint8_t *frame, int len)
+{
+	if(len < 2) return MODBUS_RTU_FRAME_MAX;
+	uint8_t fc= frame[1];
+	if(fc & 0x80) return 5;
+	switch(fc)
+	{
+		case 0x01: case 0x02: case 0x03: case 0x04:	return len < 3 ? MODBUS_RTU_FRAME_MAX : (5 + frame[2] > 8 ? 5 + frame[2] : 8);
+		case 0x05: case 0x06:						return 8;
+		case 0x0F: case 0x10:						return len < 7 ? MODBUS_RTU_FRAME_MAX : 9 + frame[6];
+	}
+	return 0;
+} // modbus_rtu_length_max
+
+static void modbus_rtu_rx_deliver(modbus_rtu_rx_type *rx, uint8_t *frame, int len)
+{
+	rx->frames ++;
+	modbus_rtu_rx_capture(rx, frame, len, MODBUS_RTU_FRAME_OK);
+	if(rx->callback) rx->callback(frame, len);
+} // modbus_rtu_rx_deliver
+
+// Bytes with a bad CRC at the gap
+static void modbus_rtu_rx_drop(modbus_rtu_rx_type *rx, const uint8_t *frame, int len)
+{
+	rx->crc_errors ++;
+	// cut short (lost tail, noise on the line) or complete with a bad CRC
+	if(!modbus_rtu_length_match(frame, len) && len < modbus_rtu_length_max(frame, len))
+		modbus_rtu_rx_capture(rx, frame, len, MODBUS_RTU_FRAME_TRUNCATED);
+	else
+		modbus_rtu_rx_capture(rx, frame, len, MODBUS_RTU_FRAME_CRC);
+} // modbus_rtu_rx_drop
+
+void modbus_rtu_rx_feed(modbus_rtu_rx_type *rx, const uint8_t *data, int n)
+{
+	for(int i=0; i<n; i++)
+	{
+		if(rx->len >= MODBUS_RTU_FRAME_MAX)
+		{
+			// no valid frame is that long, wait for the next gap
+			if(rx->split) modbus_rtu_rx_deliver(rx, rx->frame, rx->split);
+			rx->overruns ++;
+			modbus_rtu_rx_capture(rx, rx->frame + rx->split, rx->len - rx->split, MODBUS_RTU_FRAME_OVERRUN);
+			modbus_rtu_rx_reset(rx);
+		}
+		rx->frame[rx->len ++]= data[i];
+		rx->crc= CRC16_byte(rx->crc, data[i]);
+		if(rx->split) rx->crc_rest= CRC16_byte(rx->crc_rest, data[i]);
+		if(rx->crc == 0 && modbus_rtu_length_match(rx->frame, rx->len))
+		{
+			// request or head of a response: the next bytes tell
+			if(modbus_rtu_length_ambiguous(rx->frame, rx->len))
+			{
+				rx->split= rx->len;
+				rx->crc_rest= 0xFFFF;
+				continue;
+			}
+			modbus_rtu_rx_deliver(rx, rx->frame, rx->len);
+			modbus_rtu_rx_reset(rx);
+		}
+		else if(rx->split && rx->crc_rest == 0 && modbus_rtu_length_match(rx->frame + rx->split, rx->len - rx->split))
+		{
+			// it was a request, with the next frame right behind it
+			modbus_rtu_rx_deliver(rx, rx->frame, rx->split);
+			modbus_rtu_rx_deliver(rx, rx->frame + rx->split, rx->len - rx->split);
+			modbus_rtu_rx_reset(rx);
+		}
+	}
+} // modbus_rtu_rx_feed
+
+// Drop the pending bytes (input flushed after lost bytes)
+void modbus_rtu_rx_discard(modbus_rtu_rx_type *rx)
+{
+	modbus_rtu_rx_capture(rx, rx->frame, rx->len, MODBUS_RTU_FRAME_LOST);
+	modbus_rtu_rx_reset(rx);
+} // modbus_rtu_rx_discard
+
+// t3.5 silence detected
+// return	1 a frame was delivered, 0 nothing pending, -1 pending bytes dropped (CRC error)
+int modbus_rtu_rx_gap(modbus_rtu_rx_type *rx)
+{
+	int r= 0;
+	if(rx->len > 0)
+	{
+		if(rx->len >= 4 && rx->crc == 0)
+		{
+			modbus_rtu_rx_deliver(rx, rx->frame, rx->len);
+			r= 1;
+		}
+		else if(rx->split)
+		{
+			// the request, then whatever came behind it
+			modbus_rtu_rx_deliver(rx, rx->frame, rx->split);
+			r= 1;
+			int rest= rx->len - rx->split;
+			if(rest >= 4 && rx->crc_rest == 0) modbus_rtu_rx_deliver(rx, rx->frame + rx->split, rest);
+			else 
+			{
+				modbus_rtu_rx_drop(rx, rx->frame + rx->split, rest);
+				r= -1;
+			}
+		}
+		else
+		{
+			modbus_rtu_rx_drop(rx, rx->frame, rx->len);
+			r= -1;
+		}
+	}
+	modbus_rtu_rx_reset(rx);
+	return r;
+} // modbus_rtu_rx_gap
 
 float record2float (uint8_t* data)
 {
-	uint16_t DataHigh= data[0]<<8 | data[1];
-	uint16_t DataLow=  data[2]<<8 | data[3];					
-	uint16_t value[2];
-	value[1]= DataHigh;
-	value[0]= DataLow;
-	return *(float *) value;	
+	uint32_t value= (uint32_t)data[0]<<24 | (uint32_t)data[1]<<16 | (uint32_t)data[2]<<8 | data[3];
+	float f;
+	memcpy(&f, &value, sizeof(f));
+	return f;	
 } // record2float
 
+// IEEE 754 float to 4 bytes, high word and high byte first
+void float2record (float f, uint8_t* data)
+{
+	uint32_t value;
+	memcpy(&value, &f, sizeof(value));
+	data[0]= value >> 24;
+	data[1]= value >> 16;
+	data[2]= value >> 8;
+	data[3]= value;
+} // float2record
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   REGISTER MAP DECODE
+
+---------------------------------------------------------------------------------------------------
+A meter is described by a constant table of modbus_register_map_type sorted by register address.
+modbus_decode_block() walks the table once for a response block [start, start + count) and writes 
+every field that lies completely inside the block into the destination structure.
+**/
+int modbus_register_width(modbus_datatype_t type)
+{
+	return (type == MODBUS_HEX16) ? 1 : 2;
+} // modbus_register_width
+
+// data		first register of the block (response byte 3)
+// count	number of 16-bit registers in the block
+// return	number of fields decoded
+int modbus_decode_block(const modbus_register_map_type *map, int map_n, uint16_t start, const uint8_t *data, uint16_t count, void *dst)
+{
+	int n= 0;
+	uint32_t end= (uint32_t) start + count;
+	for(int i=0; i<map_n; i++)
+	{
+		const modbus_register_map_type *r= &map[i];
+		if(r->reg < start) continue;
+		if(r->reg >= end) break;
+		if(r->reg + modbus_register_width(r->type) > end) continue;
+		const uint8_t *p= data + 2 * (r->reg - start);
+		uint8_t *field= (uint8_t *) dst + r->offset;
+		switch(r->type)
+		{
+			case MODBUS_FLOAT32:
+			{
+				float value= record2float((uint8_t *) p) * r->scale;
+				memcpy(field, &value, sizeof(value));
+				break;
+			}
+			case MODBUS_UINT32:
+			{
+				uint32_t value= (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+				memcpy(field, &value, sizeof(value));
+				break;
+			}
+			case MODBUS_HEX16:
+			{
+				uint16_t value= p[0]<<8 | p[1];
+				memcpy(field, &value, sizeof(value));
+				break;
+			}
+		}
+		n ++;
+	}
+	return n;
+} // modbus_decode_block
 
 
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   SHADOW REGISTER IMAGE
+
+---------------------------------------------------------------------------------------------------
+Raw registers of one slave as they come on the wire (2 bytes per register, big endian), split in 
+blocks with their own update time. A response is stored with one memcpy per block it touches and
+the fields are decoded only when a consumer asks for them, with the same register map as 
+modbus_decode_block(). Registers outside the blocks are not kept.
+Blocks are sorted by start register and do not overlap.
+**/
+// storage	2 x (sum of the block counts) bytes, shared by the blocks in order
+void modbus_image_init(modbus_image_type *image, uint8_t slave, modbus_image_block_type *block, int n, uint8_t *storage)
+{
+	image->slave= slave;
+	image->block= block;
+	image->n= n;
+	for(int i=0; i<n; i++)
+	{
+		block[i].raw= storage;
+		block[i].time= 0;
+		block[i].updates= 0;
+		memset(storage, 0, 2 * block[i].count);
+		storage += 2 * block[i].count;
+	}
+} // modbus_image_init
+
+// data		first register of the response (response byte 3)
+// return	number of registers stored
+int modbus_image_store(modbus_image_type *image, uint16_t start, const uint8_t *data, uint16_t count, int64_t time)
+{
+	int n= 0;
+	uint32_t end= (uint32_t) start + count;
+	for(int i=0; i<image->n; i++)
+	{
+		modbus_image_block_type *b= &image->block[i];
+		uint32_t b_end= (uint32_t) b->start + b->count;
+		if(b_end <= start) continue;
+		if(b->start >= end) break;
+		uint32_t from= start > b->start ? start : b->start;
+		uint32_t to= end < b_end ? end : b_end;
+		memcpy(b->raw + 2 * (from - b->start), data + 2 * (from - start), 2 * (to - from));
+		b->time= time;
+		b->updates ++;
+		n += to - from;
+	}
+	return n;
+} // modbus_image_store
+
+// Copy registers [start, start + count) in wire order
+// time		oldest update time of the blocks involved (may be 0)
+// return	0 ok, -1 some register is not in the image or was never received
+int modbus_image_read(const modbus_image_type *image, uint16_t start, uint16_t count, uint8_t *dst, int64_t *time)
+{
+	uint32_t reg= start;
+	uint32_t end= (uint32_t) start + count;
+	int64_t oldest= 0;
+	for(int i=0; i<image->n && reg<end; i++)
+	{
+		const modbus_image_block_type *b= &image->block[i];
+		uint32_t b_end= (uint32_t) b->start + b->count;
+		if(b_end <= reg) continue;
+		if(b->start > reg || b->updates == 0) return -1;
+		uint32_t to= end < b_end ? end : b_end;
+		memcpy(dst + 2 * (reg - start), b->raw + 2 * (reg - b->start), 2 * (to - reg));
+		if(oldest == 0 || b->time < oldest) oldest= b->time;
+		reg= to;
+	}
+	if(reg < end) return -1;
+	if(time) *time= oldest;
+	return 0;
+} // modbus_image_read
+
+// Decode the fields of the map that have been received
+// return	number of fields decoded
+int modbus_image_decode(const modbus_image_type *image, const modbus_register_map_type *map, int map_n, void *dst)
+{
+	int n= 0;
+	uint8_t raw[4];
+	for(int i=0; i<map_n; i++)
+	{
+		int width= modbus_register_width(map[i].type);
+		if(modbus_image_read(image, map[i].reg, width, raw, 0) != 0) continue;
+		n += modbus_decode_block(&map[i], 1, map[i].reg, raw, width, dst);
+	}
+	return n;
+} // modbus_image_decode
+
+// Update time of the block holding reg, 0 if never received or not in the image
+int64_t modbus_image_time(const modbus_image_type *image, uint16_t reg)
+{
+	for(int i=0; i<image->n; i++)
+	{
+		const modbus_image_block_type *b= &image->block[i];
+		if(reg >= b->start && reg < b->start + b->count) return b->time;
+	}
+	return 0;
+} // modbus_image_time
+
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   PASSIVE SNIFFER
+
+---------------------------------------------------------------------------------------------------
+Follows the traffic between a master and any number of slaves without sending anything.
+Every CRC-checked frame is either a request, kept in a table of outstanding requests, or the 
+response to the latest outstanding request of the same slave and function code with a consistent
+length (byte count, echo or start/count). The master only moves on to a new request of the same 
+kind when the previous one is done, so the older ones of that slave and function code got no 
+response and are dropped.
+
+The frame length tells requests and responses apart:
+	03/04	request 8 bytes, response 5 + byte count (even, so never 8)
+	06		request and response are the same 8 bytes: a response if it echoes an outstanding request
+	0x10	request 9 + byte count, response 8 bytes
+	fc|0x80	exception response, 5 bytes
+**/
+static uint16_t modbus_be16(const uint8_t *p)
+{
+	return (uint16_t) (p[0] << 8 | p[1]);
+} // modbus_be16
+
+void modbus_sniffer_init(modbus_sniffer_type *sniffer, void (*callback) (const modbus_sniffer_transaction_type *t, void *arg), void *arg)
+{
+	memset(sniffer, 0, sizeof(modbus_sniffer_type));
+	sniffer->callback= callback;
+	sniffer->arg= arg;
+} // modbus_sniffer_init
+
+static modbus_sniffer_slave_type *modbus_sniffer_slave(modbus_sniffer_type *sniffer, uint8_t slave)
+{
+	for(int i=0; i<MODBUS_SNIFFER_SLAVES; i++)
+	{
+		if(sniffer->slaves[i].slave == slave) return &sniffer->slaves[i];
+		if(sniffer->slaves[i].slave == 0)
+		{
+			sniffer->slaves[i].slave= slave;
+			return &sniffer->slaves[i];
+		}
+	}
+	return 0;
+} // modbus_sniffer_slave
+
+static void modbus_sniffer_remove(modbus_sniffer_type *sniffer, int i)
+{
+	sniffer->pending_n --;
+	memmove(&sniffer->pending[i], &sniffer->pending[i + 1], (sniffer->pending_n - i) * sizeof(modbus_sniffer_request_type));
+} // modbus_sniffer_remove
+
+static void modbus_sniffer_request(modbus_sniffer_type *sniffer, const uint8_t *frame, int len, int64_t time)
+{
+	// expired
+	for(int i=0; i<sniffer->pending_n; )
+	{
+		if(time - sniffer->pending[i].time > MODBUS_SNIFFER_EXPIRE_US) 
+		{
+			modbus_sniffer_remove(sniffer, i);
+			sniffer->unanswered ++;
+		}
+		else i++;
+	}
+	if(sniffer->pending_n == MODBUS_SNIFFER_PENDING)
+	{
+		modbus_sniffer_remove(sniffer, 0);
+		sniffer->unanswered ++;
+	}
+	modbus_sniffer_request_type *r= &sniffer->pending[sniffer->pending_n ++];
+	r->slave= frame[0];
+	r->function= frame[1];
+	r->start= modbus_be16(frame + 2);
+	r->count= r->function == 0x06 ? 1 : modbus_be16(frame + 4);
+	r->time= time;
+	memcpy(r->frame, frame, 8);
+	if(r->function == 0x06) memcpy(r->data, frame + 4, 2);
+	if(r->function == 0x10) memcpy(r->data, frame + 7, len - 9);
+	modbus_sniffer_slave_type *st= modbus_sniffer_slave(sniffer, frame[0]);
+	if(st) st->requests ++;
+} // modbus_sniffer_request
+
+// Request sent by this device on a bus it sniffs: the response is matched to it like any other
+// (half-duplex transceivers do not hear their own transmission)
+void modbus_sniffer_request_sent(modbus_sniffer_type *sniffer, const uint8_t *frame, int len, int64_t time)
+{
+	modbus_sniffer_request(sniffer, frame, len, time);
+} // modbus_sniffer_request_sent
+
+// Latest outstanding request the response frame may answer, -1 if none
+static int modbus_sniffer_match(modbus_sniffer_type *sniffer, const uint8_t *frame, int len)
+{
+	uint8_t function= frame[1] & 0x7F;
+	for(int i=sniffer->pending_n - 1; i>=0; i--)
+	{
+		modbus_sniffer_request_type *r= &sniffer->pending[i];
+		if(r->slave != frame[0] || r->function != function) continue;
+		if(frame[1] & 0x80) return i;
+		switch(function)
+		{
+			case 0x03: case 0x04:	if(frame[2] == 2 * r->count) return i; break;
+			case 0x06:				if(memcmp(r->frame, frame, 8) == 0) return i; break;
+			case 0x10:				if(modbus_be16(frame + 2) == r->start && modbus_be16(frame + 4) == r->count) return i; break;
+		}
+	}
+	return -1;
+} // modbus_sniffer_match
+
+static void modbus_sniffer_response(modbus_sniffer_type *sniffer, int i, const uint8_t *frame, int64_t time)
+{
+	modbus_sniffer_request_type *r= &sniffer->pending[i];
+	modbus_sniffer_transaction_type t= {
+		.slave= r->slave,
+		.function= r->function,
+		.start= r->start,
+		.count= r->count,
+		.exception= (frame[1] & 0x80) ? frame[2] : 0,
+		.data= (frame[1] & 0x80) ? 0 : (r->function == 0x03 || r->function == 0x04) ? frame + 3 : r->data,
+		.request_time= r->time,
+		.response_time= time
+	};
+	modbus_sniffer_slave_type *st= modbus_sniffer_slave(sniffer, r->slave);
+	if(st)
+	{
+		if(t.exception) st->exceptions ++;
+		else st->responses ++;
+	}
+	if(sniffer->callback) sniffer->callback(&t, sniffer->arg);
+	// the answered request and the unanswered ones of the same slave and function before it
+	uint8_t slave= r->slave, function= r->function;
+	modbus_sniffer_remove(sniffer, i);
+	for(int j=0; j<i; )
+	{
+		if(sniffer->pending[j].slave == slave && sniffer->pending[j].function == function) 
+		{
+			modbus_sniffer_remove(sniffer, j);
+			sniffer->unanswered ++;
+			i --;
+		}
+		else j++;
+	}
+} // modbus_sniffer_response
+
+// frame	complete, CRC-checked frame
+// time		end of frame (us)
+void modbus_sniffer_frame(modbus_sniffer_type *sniffer, const uint8_t *frame, int len, int64_t time)
+{
+	if(len < 5) return;
+	uint8_t function= frame[1];
+	int i;
+	if(function & 0x80)
+	{
+		if(len != 5) return;
+		if((i= modbus_sniffer_match(sniffer, frame, len)) < 0) sniffer->unmatched ++;
+		else modbus_sniffer_response(sniffer, i, frame, time);
+		return;
+	}
+	switch(function)
+	{
+		case 0x03: case 0x04:
+			if(len == 8) modbus_sniffer_request(sniffer, frame, len, time);
+			else if(len == 5 + frame[2] && (i= modbus_sniffer_match(sniffer, frame, len)) >= 0) modbus_sniffer_response(sniffer, i, frame, time);
+			else sniffer->unmatched ++;
+			break;
+		case 0x06:
+			if(len != 8) return;
+			if((i= modbus_sniffer_match(sniffer, frame, len)) >= 0) modbus_sniffer_response(sniffer, i, frame, time);
+			else modbus_sniffer_request(sniffer, frame, len, time);
+			break;
+		case 0x10:
+			if(len == 8)
+			{
+				if((i= modbus_sniffer_match(sniffer, frame, len)) >= 0) modbus_sniffer_response(sniffer, i, frame, time);
+				else sniffer->unmatched ++;
+			}
+			else if(len == 9 + frame[6] && frame[6] == 2 * modbus_be16(frame + 4)) modbus_sniffer_request(sniffer, frame, len, time);
+			break;
+		default:
+			sniffer->unknown ++;
+	}
+} // modbus_sniffer_frame
+
+void modbus_sniffer_printf(const modbus_sniffer_type *sniffer)
+{
+	for(int i=0; i<MODBUS_SNIFFER_SLAVES && sniffer->slaves[i].slave; i++)
+		fprintf(stdout, "\n   slave %3d requests %6lu responses %6lu exceptions %lu", sniffer->slaves[i].slave, 
+			(unsigned long) sniffer->slaves[i].requests, (unsigned long) sniffer->slaves[i].responses, (unsigned long) sniffer->slaves[i].exceptions);
+	fprintf(stdout, "\n   unanswered %lu unmatched %lu unknown function %lu\n", 
+		(unsigned long) sniffer->unanswered, (unsigned long) sniffer->unmatched, (unsigned long) sniffer->unknown);
+} // modbus_sniffer_printf
+
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   READ PLANNER
+
+---------------------------------------------------------------------------------------------------
+Turns a set of wanted register ranges of one slave and function code into the smallest set of 
+read requests:
+- ranges are sorted and walked once; a range is merged into the current request when the hole 
+  between them is at most max_gap registers, contains no forbidden register and the request does 
+  not grow beyond max_count registers
+- merging only happens when it is allowed, so each split is forced and the number of requests is 
+  the minimum
+It is meant to run at startup or when the wanted set changes, not per poll cycle.
+**/
+static int modbus_plan_forbidden(const modbus_plan_limits_type *limits, uint32_t start, uint32_t end)
+{
+	for(int i=0; i<limits->forbidden_n; i++)
+	{
+		uint32_t f0= limits->forbidden[i].start;
+		uint32_t f1= f0 + limits->forbidden[i].count;
+		if(f0 < end && start < f1) return 1;
+	}
+	return 0;
+} // modbus_plan_forbidden
+
+// wanted	ranges to read, sorted in place by start register
+// plan		output requests
+// return	number of requests, -1 if a wanted range cannot be read or plan_max is too small
+int modbus_plan_reads(modbus_read_request_type *wanted, int n_wanted, const modbus_plan_limits_type *limits, modbus_read_request_type *plan, int plan_max)
+{
+	// sort (insertion, the sets are small)
+	for(int i=1; i<n_wanted; i++)
+	{
+		modbus_read_request_type r= wanted[i];
+		int j= i - 1;
+		for(; j>=0 && wanted[j].start > r.start; j--) wanted[j + 1]= wanted[j];
+		wanted[j + 1]= r;
+	}
+	int n= 0;
+	uint32_t p_start= 0, p_end= 0;		// request being built [p_start, p_end)
+	for(int i=0; i<n_wanted; i++)
+	{
+		uint32_t r_start= wanted[i].start;
+		uint32_t r_end= r_start + wanted[i].count;
+		if(wanted[i].count == 0) continue;
+		if(wanted[i].count > limits->max_count || modbus_plan_forbidden(limits, r_start, r_end)) return -1;
+		if(n > 0)
+		{
+			uint32_t end= r_end > p_end ? r_end : p_end;
+			if(r_start <= p_end + limits->max_gap && end - p_start <= limits->max_count && 
+				(r_start <= p_end || !modbus_plan_forbidden(limits, p_end, r_start)))
+			{
+				p_end= end;
+				plan[n - 1].count= p_end - p_start;
+				continue;
+			}
+		}
+		if(n >= plan_max) return -1;
+		p_start= r_start;
+		p_end= r_end;
+		plan[n].start= p_start;
+		plan[n].count= p_end - p_start;
+		n ++;
+	}
+	return n;
+} // modbus_plan_reads
+
+// Expected bus time of one pass through the plan (FC03/FC04, 8N1)
+// request 8 characters, response 5 + 2 * count characters, t3.5 silence after each frame 
+// and the slave turnaround
+uint32_t modbus_plan_bus_time_us(const modbus_read_request_type *plan, int n, uint32_t baud_rate, uint32_t turnaround_us)
+{
+	uint32_t char_us= 10 * 1000000 / baud_rate;
+	// above 19200 baud the inter-frame silence is fixed to 1750 us
+	uint32_t t35_us= baud_rate > 19200 ? 1750 : (35 * char_us) / 10;
+	uint32_t t= 0;
+	for(int i=0; i<n; i++)
+		t += (8 + 5 + 2 * plan[i].count) * char_us + 2 * t35_us + turnaround_us;
+	return t;
+} // modbus_plan_bus_time_us
+
 // END OF FILE
\ No newline at end of file
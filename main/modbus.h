@@ -1,8 +1,171 @@
 #ifndef _MODBUS_H_
 #define _MODBUS_H_
 
+#include <stddef.h>		// offsetof
+
+// CRC16 implementation: 256 = byte table (512 bytes), 16 = nibble table (32 bytes)
+#define MODBUS_CRC16_TABLE		256
+
+// RTU frame: address (1) + PDU (up to 253) + CRC (2)
+#define MODBUS_RTU_FRAME_MAX	256
+// UART RX timeout in symbols (one character time) used to detect the 3.5 character silence 
+#define MODBUS_RTU_RX_TOUT		4
+
+// Frame boundaries seen by the capture hook
+#define MODBUS_RTU_FRAME_OK			0		// delivered
+#define MODBUS_RTU_FRAME_CRC		1		// dropped at the gap, bad CRC
+#define MODBUS_RTU_FRAME_OVERRUN	2		// dropped, longer than MODBUS_RTU_FRAME_MAX
+#define MODBUS_RTU_FRAME_LOST		3		// dropped, bytes lost by the UART
+#define MODBUS_RTU_FRAME_TRUNCATED	4		// dropped at the gap, shorter than the header says
+
+typedef struct modbus_rtu_rx_s
+{
+	uint8_t frame[MODBUS_RTU_FRAME_MAX];
+	uint16_t len;
+	uint16_t crc;								// running CRC16 of frame[0 .. len-1]
+	uint16_t split;								// FC01-04 8 bytes with a zero CRC, request or the head of a response, 0 none
+	uint16_t crc_rest;							// running CRC16 of frame[split .. len-1]
+	void (*callback) (uint8_t *frame, int len);	// complete, CRC-checked frame
+	// optional, every frame boundary with the bytes delivered or dropped (MODBUS_RTU_FRAME_xxx)
+	void (*capture) (void *arg, const uint8_t *frame, int len, int flags);
+	void *capture_arg;
+	uint32_t frames;
+	uint32_t crc_errors;
+	uint32_t overruns;
+} modbus_rtu_rx_type;
+
+// Register map
+typedef enum {MODBUS_FLOAT32, MODBUS_UINT32, MODBUS_HEX16} modbus_datatype_t;
+
+typedef struct modbus_register_map_s
+{
+	uint16_t reg;				// register address
+	modbus_datatype_t type;		// FLOAT32 and UINT32 take two registers, HEX16 one
+	float scale;				// FLOAT32 only
+	size_t offset;				// destination field in the data structure
+} modbus_register_map_type;
+
+#define MODBUS_REGISTER(reg, type, scale, struct_type, field) 	{ reg, type, scale, offsetof(struct_type, field) }
+#define MODBUS_REGISTER_MAP_SIZE(map)							(sizeof(map) / sizeof(map[0]))
+
+// Read request: start register and number of registers
+typedef struct modbus_read_request_s
+{
+	uint16_t start;
+	uint16_t count;
+} modbus_read_request_type;
+
+// Shadow register image of one slave
+typedef struct modbus_image_block_s
+{
+	uint16_t start;
+	uint16_t count;
+	uint8_t *raw;				// 2 x count bytes, wire order (modbus_image_init)
+	int64_t time;				// last update
+	uint32_t updates;			// 0 never received
+} modbus_image_block_type;
+
+typedef struct modbus_image_s
+{
+	uint8_t slave;
+	modbus_image_block_type *block;	// sorted by start register, not overlapping
+	int n;
+} modbus_image_type;
+
+#define MODBUS_IMAGE_BLOCK(start, count) 	{ start, count, 0, 0, 0 }
+
+// Passive sniffer
+#define MODBUS_SNIFFER_PENDING		8		// outstanding requests
+#define MODBUS_SNIFFER_SLAVES		8		// slaves with statistics
+#define MODBUS_SNIFFER_EXPIRE_US	1000000	// a request without response after this long is dropped
+
+// A request seen on the bus and its response
+typedef struct modbus_sniffer_transaction_s
+{
+	uint8_t slave;
+	uint8_t function;			// without the exception bit
+	uint16_t start;
+	uint16_t count;				// registers
+	uint8_t exception;			// 0 or the exception code
+	const uint8_t *data;		// count registers, wire order: read values (03/04) or written values (06/0x10), 0 on exception
+	int64_t request_time;
+	int64_t response_time;
+} modbus_sniffer_transaction_type;
+
+typedef struct modbus_sniffer_request_s
+{
+	uint8_t slave;
+	uint8_t function;
+	uint16_t start;
+	uint16_t count;
+	uint8_t frame[8];			// 06: the response is an echo of the request
+	uint8_t data[MODBUS_RTU_FRAME_MAX - 9];	// 06/0x10: written values
+	int64_t time;
+} modbus_sniffer_request_type;
+
+typedef struct modbus_sniffer_slave_s
+{
+	uint8_t slave;
+	uint32_t requests;
+	uint32_t responses;
+	uint32_t exceptions;
+} modbus_sniffer_slave_type;
+
+typedef struct modbus_sniffer_s
+{
+	modbus_sniffer_request_type pending[MODBUS_SNIFFER_PENDING];	// oldest first
+	int pending_n;
+	void (*callback) (const modbus_sniffer_transaction_type *t, void *arg);
+	void *arg;
+	modbus_sniffer_slave_type slaves[MODBUS_SNIFFER_SLAVES];
+	uint32_t unanswered;		// requests expired or skipped by a later response
+	uint32_t unmatched;			// responses without request
+	uint32_t unknown;			// function codes not handled
+} modbus_sniffer_type;
+
+// Exception codes
+#define MODBUS_EXCEPTION_ILLEGAL_FUNCTION		0x01
+#define MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS	0x02
+#define MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE		0x03
+#define MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE	0x04
+
+// Read planner limits
+#define MODBUS_MAX_READ_REGISTERS	125		// FC03/FC04 registers per request
+
+typedef struct modbus_plan_limits_s
+{
+	uint16_t max_gap;								// unwanted registers that may be read to merge two ranges
+	uint16_t max_count;								// registers per request
+	const modbus_read_request_type *forbidden;		// ranges that must not be read
+	int forbidden_n;
+} modbus_plan_limits_type;
+
 uint16_t CRC16(const uint8_t *data, uint16_t longitud);
+uint16_t CRC16_bitwise(const uint8_t *data, uint16_t longitud);
 float record2float (uint8_t* data);
+void float2record (float f, uint8_t* data);
+
+void modbus_rtu_rx_init(modbus_rtu_rx_type *rx, void (*callback) (uint8_t*, int));
+void modbus_rtu_rx_feed(modbus_rtu_rx_type *rx, const uint8_t *data, int n);
+int modbus_rtu_rx_gap(modbus_rtu_rx_type *rx);
+void modbus_rtu_rx_discard(modbus_rtu_rx_type *rx);
+
+int modbus_register_width(modbus_datatype_t type);
+int modbus_decode_block(const modbus_register_map_type *map, int map_n, uint16_t start, const uint8_t *data, uint16_t count, void *dst);
+
+void modbus_image_init(modbus_image_type *image, uint8_t slave, modbus_image_block_type *block, int n, uint8_t *storage);
+int modbus_image_store(modbus_image_type *image, uint16_t start, const uint8_t *data, uint16_t count, int64_t time);
+int modbus_image_read(const modbus_image_type *image, uint16_t start, uint16_t count, uint8_t *dst, int64_t *time);
+int modbus_image_decode(const modbus_image_type *image, const modbus_register_map_type *map, int map_n, void *dst);
+int64_t modbus_image_time(const modbus_image_type *image, uint16_t reg);
+
+void modbus_sniffer_init(modbus_sniffer_type *sniffer, void (*callback) (const modbus_sniffer_transaction_type *t, void *arg), void *arg);
+void modbus_sniffer_frame(modbus_sniffer_type *sniffer, const uint8_t *frame, int len, int64_t time);
+void modbus_sniffer_request_sent(modbus_sniffer_type *sniffer, const uint8_t *frame, int len, int64_t time);
+void modbus_sniffer_printf(const modbus_sniffer_type *sniffer);
+
+int modbus_plan_reads(modbus_read_request_type *wanted, int n_wanted, const modbus_plan_limits_type *limits, modbus_read_request_type *plan, int plan_max);
+uint32_t modbus_plan_bus_time_us(const modbus_read_request_type *plan, int n, uint32_t baud_rate, uint32_t turnaround_us);
 
 #endif
 // END OF FILE
\ No newline at end of file
@@ -0,0 +1,519 @@
+/** ************************************************************************************************
+ *	MODBUS benchmarks
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - CRC16 benchmark
+ * 	1.1.0 - RS-485 stream replay benchmark
+ * 	1.2.0 - Gorilla compression of meter traces
+ *
+ *	On the ESP32 the benchmarks run from the console (Ctrl+t) and report cycles/byte.
+ *	The file has no ESP-IDF dependency when ESP_PLATFORM is not defined, so it also runs on the host:
+ *		gcc -O2 -Imain main/modbus.c main/gorilla.c main/modbus_bench.c -lm -o modbus_bench && ./modbus_bench
+ *	and replays a bus capture downloaded from the REST server (modbus_capture.c):
+ *		./modbus_bench bus.pcap
+ *	The exit code is not zero when a decode check fails, so it can be used as a regression test.
+ *
+ ** ************************************************************************************************
+**/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>		// memcpy
+#include <stdlib.h>		// malloc
+#include <math.h>
+#include "modbus.h"
+#include "gorilla.h"
+#include "modbus_bench.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"		// esp_timer_get_time()
+#include "esp_cpu.h"		// esp_cpu_get_cycle_count()
+#define BENCH_TIME_US()		esp_timer_get_time()
+#define BENCH_CYCLES()		esp_cpu_get_cycle_count()
+#else
+#include <time.h>
+static int64_t bench_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#define BENCH_TIME_US()		bench_time_us()
+#define BENCH_CYCLES()		0
+#endif
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   CRC16
+
+---------------------------------------------------------------------------------------------------
+**/
+// DDSU666-H 0x2000 block response (README), 73 bytes
+static const uint8_t bench_frame_2000[]= {
+	0x0B, 0x03, 0x44,
+	0x43, 0x68, 0x33, 0x33, 0x3F, 0x16, 0x45, 0xA2, 0x00, 0x00, 0x00, 0x00, 0xBE, 0x0B, 0xC6, 0xA8,
+	0xBE, 0x0B, 0xC6, 0xA8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x3E, 0x0B, 0xC6, 0xA8, 0x3E, 0x0B, 0xC6, 0xA8, 0x00, 0x00, 0x00, 0x00,
+	0xBF, 0x80, 0x00, 0x00, 0xBF, 0x80, 0x00, 0x00, 0xBF, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x42, 0x47, 0xF5, 0xC3,
+	0x63, 0xF0
+};
+
+#define BENCH_CRC16_LOOPS	20000
+
+static void CRC16_bench_run(const char *name, uint16_t (*crc16)(const uint8_t*, uint16_t))
+{
+	volatile uint16_t crc= 0;
+	uint16_t len= sizeof(bench_frame_2000) - 2;
+	int64_t t0= BENCH_TIME_US();
+	uint32_t c0= BENCH_CYCLES();
+	for(int i=0; i<BENCH_CRC16_LOOPS; i++) crc ^= crc16(bench_frame_2000, len);
+	uint32_t c1= BENCH_CYCLES();
+	int64_t t1= BENCH_TIME_US();
+	double bytes= (double) BENCH_CRC16_LOOPS * len;
+	double elapsed_s= (t1 > t0) ? (double)(t1 - t0) / 1e6 : 1e-6;
+	fprintf(stdout, "\n   %-8s %10.0f bytes/s", name, bytes / elapsed_s);
+#ifdef ESP_PLATFORM
+	fprintf(stdout, "   %6.2f cycles/byte", (double)(uint32_t)(c1 - c0) / bytes);
+#else
+	(void) c0; (void) c1;
+#endif
+	(void) crc;
+} // CRC16_bench_run
+
+void CRC16_benchmark(void)
+{
+	uint16_t len= sizeof(bench_frame_2000) - 2;
+	uint16_t ErrorCheck= bench_frame_2000[len + 1]<<8 | bench_frame_2000[len];
+	fprintf(stdout, "\nCRC16 benchmark (%d-byte frame, table %d)", len, MODBUS_CRC16_TABLE);
+	fprintf(stdout, "\n   check    bitwise %04X table %04X frame %04X %s", 
+		CRC16_bitwise(bench_frame_2000, len), CRC16(bench_frame_2000, len), ErrorCheck,
+		(CRC16(bench_frame_2000, len) == ErrorCheck && CRC16_bitwise(bench_frame_2000, len) == ErrorCheck) ? "ok" : "FAIL");
+	CRC16_bench_run("bitwise", CRC16_bitwise);
+	CRC16_bench_run("table", CRC16);
+	fprintf(stdout, "\n");
+	fflush(stdout);
+} // CRC16_benchmark
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   STREAM REPLAY
+
+---------------------------------------------------------------------------------------------------
+A synthetic RS-485 stream built from the frames in the README and sdm120ct.h goes through the 
+same path as the RX tasks: frame assembler -> passive sniffer -> shadow register image -> decode.
+Per poll cycle:
+	the inverter polls 0x2006 four times, reads 0x2000 and 0x4000 from the DDSU666-H (0x0B)
+	the SDM120CT (0x01) is read at 0x0000
+The stream is cut into chunks of 1..64 bytes as the UART driver would deliver them. Request and 
+response are sent back to back (no gap between them), one frame in BENCH_REPLAY_CORRUPT has a bad 
+CRC. Delivered frames, CRC errors, transactions and decoded values are checked against what the 
+generator put in.
+**/
+// 0x2006 poll (README)
+static const uint8_t bench_request_2006[]= { 0x0B, 0x03, 0x20, 0x06, 0x00, 0x02, 0x2F, 0x60 };
+static const uint8_t bench_response_2006[]= { 0x0B, 0x03, 0x04, 0xBE, 0x0D, 0x6A, 0x16, 0x4A, 0xB6 };
+// 0x2000 block (README), response bench_frame_2000
+static const uint8_t bench_request_2000[]= { 0x0B, 0x03, 0x20, 0x00, 0x00, 0x22, 0xCE, 0xB9 };
+// 0x4000 block (README)
+static const uint8_t bench_request_4000[]= { 0x0B, 0x03, 0x40, 0x00, 0x00, 0x20, 0x51, 0x78 };
+static const uint8_t bench_response_4000[]= {
+	0x0B, 0x03, 0x40,
+	0xC4, 0xEA, 0xDB, 0x33, 0xC4, 0xEA, 0xDB, 0x33, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x44, 0xE5, 0xD5, 0x71, 0x44, 0xE5, 0xD5, 0x71, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x45, 0x68, 0x58, 0x52, 0x45, 0x68, 0x58, 0x52,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xCE, 0x89
+};
+// SDM120CT voltage (sdm120ct.h samples)
+static const uint8_t bench_request_sdm[]= { 0x01, 0x04, 0x00, 0x00, 0x00, 0x02, 0x71, 0xCB };
+static const uint8_t bench_response_sdm[]= { 0x01, 0x04, 0x04, 0x43, 0x62, 0x00, 0x00, 0x4F, 0xDE };
+
+typedef struct bench_values_s
+{
+	float Voltage;
+	float Current;
+	float ActivePower;
+	float Frecuency;
+	float ActiveInElectricity;
+	float NegativeActiveEnergy;
+	float PositiveActiveEnergy;
+	float SDM120CT_Voltage;
+} bench_values_type;
+
+// Same registers and scales as DDSU666H_map (DDSU666H.c)
+static const modbus_register_map_type bench_ddsu_map[]= {
+	MODBUS_REGISTER(0x2000, MODBUS_FLOAT32, 1.0,	bench_values_type, Voltage),
+	MODBUS_REGISTER(0x2002, MODBUS_FLOAT32, 1.0,	bench_values_type, Current),
+	MODBUS_REGISTER(0x2006, MODBUS_FLOAT32, 1000.0,	bench_values_type, ActivePower),
+	MODBUS_REGISTER(0x2020, MODBUS_FLOAT32, 1.0,	bench_values_type, Frecuency),
+	MODBUS_REGISTER(0x4000, MODBUS_FLOAT32, 1.0,	bench_values_type, ActiveInElectricity),
+	MODBUS_REGISTER(0x400A, MODBUS_FLOAT32, 1.0,	bench_values_type, NegativeActiveEnergy),
+	MODBUS_REGISTER(0x4014, MODBUS_FLOAT32, 1.0,	bench_values_type, PositiveActiveEnergy),
+};
+static const modbus_register_map_type bench_sdm_map[]= {
+	MODBUS_REGISTER(0x0000, MODBUS_FLOAT32, 1.0,	bench_values_type, SDM120CT_Voltage),
+};
+
+#ifdef ESP_PLATFORM
+#define BENCH_REPLAY_CYCLES		16
+#else
+#define BENCH_REPLAY_CYCLES		4000
+#endif
+#define BENCH_REPLAY_CYCLE_MAX	(4 * 17 + 8 + 73 + 8 + 69 + 8 + 9)
+#define BENCH_REPLAY_CORRUPT	23		// one frame in 23 with a bad CRC
+
+static uint8_t bench_stream[BENCH_REPLAY_CYCLES * BENCH_REPLAY_CYCLE_MAX];
+// gap after the byte (t3.5 silence): one bit per byte
+static uint8_t bench_stream_gap[(BENCH_REPLAY_CYCLES * BENCH_REPLAY_CYCLE_MAX + 7) / 8];
+static int bench_stream_len;
+
+static modbus_rtu_rx_type bench_rx;
+static int64_t bench_now;				// bus time (us), 9600 baud
+static modbus_sniffer_type bench_sniffer;
+static modbus_image_block_type bench_ddsu_block[]= { MODBUS_IMAGE_BLOCK(0x2000, 34), MODBUS_IMAGE_BLOCK(0x4000, 32) };
+static uint8_t bench_ddsu_storage[2 * (34 + 32)];
+static modbus_image_type bench_ddsu_image;
+static bench_values_type bench_values;
+static uint32_t bench_transactions;
+
+// deterministic, same stream on every run
+static uint32_t bench_random_state;
+static uint32_t bench_random(void)
+{
+	bench_random_state= bench_random_state * 1103515245 + 12345;
+	return (bench_random_state >> 16) & 0x7FFF;
+} // bench_random
+
+static void bench_put(const uint8_t *frame, int len, int corrupt, int gap)
+{
+	memcpy(&bench_stream[bench_stream_len], frame, len);
+	// last data byte, the header (and so the expected length) stays right
+	if(corrupt) bench_stream[bench_stream_len + len - 3] ^= 0x5A;
+	bench_stream_len += len;
+	if(gap) bench_stream_gap[(bench_stream_len - 1) / 8] |= 1 << ((bench_stream_len - 1) % 8);
+} // bench_put
+
+// return	frames in the stream, *corrupted frames with a bad CRC, *transactions complete ones
+static int bench_stream_build(int *corrupted, int *transactions)
+{
+	const struct { const uint8_t *request; int request_len; const uint8_t *response; int response_len; } poll[]= {
+		{ bench_request_2006, sizeof(bench_request_2006), bench_response_2006, sizeof(bench_response_2006) },
+		{ bench_request_2006, sizeof(bench_request_2006), bench_response_2006, sizeof(bench_response_2006) },
+		{ bench_request_2000, sizeof(bench_request_2000), bench_frame_2000, sizeof(bench_frame_2000) },
+		{ bench_request_2006, sizeof(bench_request_2006), bench_response_2006, sizeof(bench_response_2006) },
+		{ bench_request_4000, sizeof(bench_request_4000), bench_response_4000, sizeof(bench_response_4000) },
+		{ bench_request_2006, sizeof(bench_request_2006), bench_response_2006, sizeof(bench_response_2006) },
+		{ bench_request_sdm, sizeof(bench_request_sdm), bench_response_sdm, sizeof(bench_response_sdm) },
+	};
+	int n= 0;
+	*corrupted= *transactions= 0;
+	bench_stream_len= 0;
+	memset(bench_stream_gap, 0, sizeof(bench_stream_gap));
+	for(int c=0; c<BENCH_REPLAY_CYCLES; c++)
+	{
+		for(int i=0; i<(int)(sizeof(poll)/sizeof(poll[0])); i++)
+		{
+			int bad_request= (++ n % BENCH_REPLAY_CORRUPT) == 0;
+			int bad_response= (++ n % BENCH_REPLAY_CORRUPT) == 0;
+			// a corrupted frame is only found at the gap
+			bench_put(poll[i].request, poll[i].request_len, bad_request, bad_request);
+			bench_put(poll[i].response, poll[i].response_len, bad_response, 1);
+			*corrupted += bad_request + bad_response;
+			if(!bad_request && !bad_response) (*transactions) ++;
+		}
+	}
+	return n;
+} // bench_stream_build
+
+static void bench_transaction(const modbus_sniffer_transaction_type *t, void *arg)
+{
+	bench_transactions ++;
+	if(t->exception) return;
+	if(t->slave == 0x0B) modbus_image_store(&bench_ddsu_image, t->start, t->data, t->count, t->response_time);
+	else if(t->slave == 0x01) modbus_decode_block(bench_sdm_map, MODBUS_REGISTER_MAP_SIZE(bench_sdm_map), t->start, t->data, t->count, &bench_values);
+} // bench_transaction
+
+static void bench_frame(uint8_t *frame, int len)
+{
+	modbus_sniffer_frame(&bench_sniffer, frame, len, bench_now);
+} // bench_frame
+
+static void bench_replay_init(void)
+{
+	modbus_rtu_rx_init(&bench_rx, bench_frame);
+	modbus_sniffer_init(&bench_sniffer, bench_transaction, 0);
+	modbus_image_init(&bench_ddsu_image, 0x0B, bench_ddsu_block, MODBUS_REGISTER_MAP_SIZE(bench_ddsu_block), bench_ddsu_storage);
+	memset(&bench_values, 0, sizeof(bench_values));
+	bench_transactions= 0;
+	bench_now= 0;
+} // bench_replay_init
+
+static int bench_check(const char *name, double value, double expected)
+{
+	int ok= value > expected - 0.01 && value < expected + 0.01;
+	fprintf(stdout, "\n   %-22s %10.3f expected %10.3f %s", name, value, expected, ok ? "ok" : "FAIL");
+	return ok;
+} // bench_check
+
+// return	0 all checks passed
+int replay_benchmark(void)
+{
+	int corrupted, transactions;
+	int frames= bench_stream_build(&corrupted, &transactions);
+	bench_replay_init();
+	bench_random_state= 1;
+	int64_t t0= BENCH_TIME_US();
+	uint32_t c0= BENCH_CYCLES();
+	int gaps= 0;
+	for(int i=0; i<bench_stream_len; )
+	{
+		// one UART read: up to 64 bytes, never past a gap (the RX timeout event ends the read)
+		int chunk= 1 + bench_random() % 64;
+		int j;
+		for(j=i; j<bench_stream_len && j<i+chunk; j++) 
+			if(bench_stream_gap[j / 8] & (1 << (j % 8))) { j++; break; }
+		bench_now += (j - i) * 1042;
+		modbus_rtu_rx_feed(&bench_rx, &bench_stream[i], j - i);
+		if(bench_stream_gap[(j - 1) / 8] & (1 << ((j - 1) % 8))) 
+		{
+			bench_now += 20000;
+			modbus_rtu_rx_gap(&bench_rx);
+			gaps ++;
+		}
+		i= j;
+	}
+	uint32_t c1= BENCH_CYCLES();
+	int64_t t1= BENCH_TIME_US();
+	modbus_image_decode(&bench_ddsu_image, bench_ddsu_map, MODBUS_REGISTER_MAP_SIZE(bench_ddsu_map), &bench_values);
+	double elapsed_s= (t1 > t0) ? (double)(t1 - t0) / 1e6 : 1e-6;
+	fprintf(stdout, "\nReplay benchmark (%d frames, %d bytes, %d gaps)", frames, bench_stream_len, gaps);
+	fprintf(stdout, "\n   %10.0f frames/s %8.1f ns/frame %8.2f MB/s", frames / elapsed_s, elapsed_s * 1e9 / frames, bench_stream_len / elapsed_s / 1e6);
+#ifdef ESP_PLATFORM
+	fprintf(stdout, "   %6.1f cycles/byte", (double)(uint32_t)(c1 - c0) / bench_stream_len);
+#else
+	(void) c0; (void) c1;
+#endif
+	int ok= 1;
+	ok &= bench_check("frames", bench_rx.frames, frames - corrupted);
+	ok &= bench_check("crc errors", bench_rx.crc_errors, corrupted);
+	ok &= bench_check("transactions", bench_transactions, transactions);
+	ok &= bench_check("Voltage", bench_values.Voltage, 232.2);
+	ok &= bench_check("Current", bench_values.Current, 0.587);
+	ok &= bench_check("ActivePower", bench_values.ActivePower, -138.1);
+	ok &= bench_check("Frecuency", bench_values.Frecuency, 49.99);
+	ok &= bench_check("ActiveInElectricity", bench_values.ActiveInElectricity, -1878.85);
+	ok &= bench_check("NegativeActiveEnergy", bench_values.NegativeActiveEnergy, 1838.67);
+	ok &= bench_check("PositiveActiveEnergy", bench_values.PositiveActiveEnergy, 3717.52);
+	ok &= bench_check("SDM120CT Voltage", bench_values.SDM120CT_Voltage, 226.0);
+	fprintf(stdout, "\n   %s\n", ok ? "PASS" : "FAIL");
+	fflush(stdout);
+	return ok ? 0 : -1;
+} // replay_benchmark
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   GORILLA
+
+---------------------------------------------------------------------------------------------------
+Compression of synthetic traces with the timing and value structure of the two meters (gorilla.c):
+	DDSU666H	grid active power polled by the inverter every 250-300 ms, 345,600 samples a day; 
+				the meter refreshes the register once per second (assumed) and sends kW, the value 
+				is kW x 1000 as DDSU666H.c decodes it; house load (base, fridge cycles, kettle, 
+				noise) minus the solar production
+	SDM120CT	solar active power read every second by the fast class, a few ms of scheduling 
+				jitter; clear sky curve, clouds and noise, exactly 0 at night
+Each trace is encoded, decoded and compared bit by bit, then encoded again with the value rounded to 
+1 W, which is what the firmware keeps. Raw size is 12 bytes per sample (int64 ms + float).
+On the ESP32 the traces are BENCH_GORILLA_SECONDS long and the ring holds the last blocks only.
+**/
+#ifdef ESP_PLATFORM
+#define BENCH_GORILLA_SECONDS	300
+#define BENCH_GORILLA_BLOCKS	8
+#else
+#define BENCH_GORILLA_SECONDS	(24 * 3600)
+#define BENCH_GORILLA_BLOCKS	4096
+#endif
+
+static double bench_noise(double amplitude)
+{
+	return amplitude * ((int) bench_random() - 16384) / 16384.0;
+} // bench_noise
+
+// W, t in ms
+static double bench_solar(int64_t t)
+{
+	double h= fmod(t / 3600000.0 + 6.0, 24.0);		// the trace starts at 06:00
+	if(h <= 6.5 || h >= 19.5) return 0.0;
+	double p= 3200.0 * sin(M_PI * (h - 6.5) / 13.0);
+	// passing clouds 10 minutes out of 30
+	if((t / 600000) % 3 == 1) p *= 0.35 + 0.15 * sin(t / 20000.0);
+	return p + bench_noise(3.0);
+} // bench_solar
+
+static int bench_trace_ddsu(gorilla_sample_type *sample, int max)
+{
+	int n= 0;
+	int64_t t= 0, refresh= 0;
+	float value= 0;
+	bench_random_state= 7;
+	while(n < max && t < 1000LL * BENCH_GORILLA_SECONDS)
+	{
+		if(t >= refresh)
+		{
+			double load= 250.0 + 50.0 * sin(t / 3600000.0 * 2 * M_PI / 24.0) + bench_noise(10.0);
+			if((t / 60000) % 45 < 15) load += 110.0;								// fridge
+			if((t / 60000) % 60 >= (t / 3600000 * 37) % 60 && (t / 60000) % 60 < (t / 3600000 * 37) % 60 + 4) 
+				load += 2000.0;														// kettle
+			float kw= (float) ((load - bench_solar(t)) / 1000.0);
+			value= kw * 1000.0f;
+			refresh += 1000;
+		}
+		sample[n].time= t;
+		sample[n].value= value;
+		n ++;
+		t += 250 + bench_random() % 51;
+	}
+	return n;
+} // bench_trace_ddsu
+
+static int bench_trace_sdm(gorilla_sample_type *sample, int max)
+{
+	int n= 0;
+	int64_t t= 0;
+	bench_random_state= 11;
+	while(n < max && t < 1000LL * BENCH_GORILLA_SECONDS)
+	{
+		sample[n].time= t;
+		sample[n].value= (float) bench_solar(t);
+		if(sample[n].value < 0) sample[n].value= 0;
+		n ++;
+		t += 995 + bench_random() % 21;
+	}
+	return n;
+} // bench_trace_sdm
+
+// return	1 decoded trace identical to the input
+static int bench_gorilla_run(const char *name, const gorilla_sample_type *sample, int n, gorilla_block_type *block, int per_day)
+{
+	static gorilla_type g;
+	gorilla_init(&g, block, BENCH_GORILLA_BLOCKS);
+	int64_t t0= BENCH_TIME_US();
+	for(int i=0; i<n; i++) gorilla_append(&g, sample[i].time, sample[i].value);
+	int64_t t1= BENCH_TIME_US();
+	// the oldest samples may have been dropped
+	uint32_t held= gorilla_held(&g);
+	int i= n - held, errors= 0;
+	gorilla_sample_type s;
+	int64_t t2= BENCH_TIME_US();
+	for(int k=0; k<g.n; k++)
+	{
+		gorilla_reader_type r;
+		gorilla_reader_init(&r, gorilla_block(&g, k));
+		while(gorilla_reader_next(&r, &s))
+		{
+			if(s.time != sample[i].time || memcmp(&s.value, &sample[i].value, sizeof(float)) != 0) errors ++;
+			i ++;
+		}
+	}
+	int64_t t3= BENCH_TIME_US();
+	uint32_t bytes= gorilla_bytes(&g);
+	fprintf(stdout, "\n   %-16s %7lu samples %8lu bytes %6.2f bits/sample ratio %5.1f  encode %6.1f decode %6.1f ns/sample  24 h %5lu KB %s", 
+		name, (unsigned long) held, (unsigned long) bytes, 8.0 * bytes / held, 12.0 * held / bytes, 
+		1000.0 * (t1 - t0) / n, 1000.0 * (t3 - t2) / held, (unsigned long) ((double) bytes / held * per_day / 1024), 
+		errors ? "FAIL" : "ok");
+	return errors == 0;
+} // bench_gorilla_run
+
+// return	0 all traces decoded as they were encoded
+int gorilla_benchmark(void)
+{
+	int max= BENCH_GORILLA_SECONDS * 4 + 1;
+	gorilla_sample_type *sample= malloc(max * sizeof(gorilla_sample_type));
+	gorilla_block_type *block= malloc(BENCH_GORILLA_BLOCKS * sizeof(gorilla_block_type));
+	if(!sample || !block)
+	{
+		fprintf(stdout, "\nGorilla benchmark: no memory\n");
+		free(sample);
+		free(block);
+		return -1;
+	}
+	int ok= 1;
+	fprintf(stdout, "\nGorilla compression (%d s traces, %d blocks of %d bytes)", BENCH_GORILLA_SECONDS, BENCH_GORILLA_BLOCKS, GORILLA_BLOCK_BYTES);
+	for(int trace=0; trace<2; trace++)
+	{
+		int n= trace == 0 ? bench_trace_ddsu(sample, max) : bench_trace_sdm(sample, max);
+		int per_day= trace == 0 ? 345600 : 86400;
+		ok &= bench_gorilla_run(trace == 0 ? "DDSU666H" : "SDM120CT", sample, n, block, per_day);
+		for(int i=0; i<n; i++) sample[i].value= roundf(sample[i].value);
+		ok &= bench_gorilla_run(trace == 0 ? "DDSU666H 1 W" : "SDM120CT 1 W", sample, n, block, per_day);
+	}
+	fprintf(stdout, "\n   %s\n", ok ? "PASS" : "FAIL");
+	fflush(stdout);
+	free(sample);
+	free(block);
+	return ok ? 0 : -1;
+} // gorilla_benchmark
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   HOST
+
+---------------------------------------------------------------------------------------------------
+**/
+#ifndef ESP_PLATFORM
+#include <stdlib.h>
+
+// Replay a pcap file from modbus_capture_stream(): port, flags, frame per packet
+static int pcap_replay(const char *filename)
+{
+	FILE *f= fopen(filename, "rb");
+	if(!f) 
+	{
+		perror(filename);
+		return -1;
+	}
+	uint8_t header[24];
+	if(fread(header, 1, sizeof(header), f) != sizeof(header))
+	{
+		fclose(f);
+		return -1;
+	}
+	bench_replay_init();
+	int packets= 0, bytes= 0;
+	uint8_t record[16], packet[2 + MODBUS_RTU_FRAME_MAX];
+	int64_t t0= BENCH_TIME_US();
+	while(fread(record, 1, sizeof(record), f) == sizeof(record))
+	{
+		uint32_t len= record[8] | record[9]<<8 | record[10]<<16 | (uint32_t) record[11]<<24;
+		if(len < 2 || len > sizeof(packet) || fread(packet, 1, len, f) != len) break;
+		modbus_rtu_rx_feed(&bench_rx, packet + 2, len - 2);
+		modbus_rtu_rx_gap(&bench_rx);
+		packets ++;
+		bytes += len - 2;
+	}
+	int64_t t1= BENCH_TIME_US();
+	fclose(f);
+	double elapsed_s= (t1 > t0) ? (double)(t1 - t0) / 1e6 : 1e-6;
+	fprintf(stdout, "\n%s: %d packets %d bytes, %lu frames %lu crc errors %lu transactions", filename, packets, bytes, 
+		(unsigned long) bench_rx.frames, (unsigned long) bench_rx.crc_errors, (unsigned long) bench_transactions);
+	fprintf(stdout, "\n   %10.0f frames/s %8.1f ns/frame", packets / elapsed_s, elapsed_s * 1e9 / (packets ? packets : 1));
+	modbus_sniffer_printf(&bench_sniffer);
+	return 0;
+} // pcap_replay
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1) return pcap_replay(argv[1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	CRC16_benchmark();
+	int ok= replay_benchmark() == 0;
+	ok &= gorilla_benchmark() == 0;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
+// END OF FILE
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef _MODBUS_BENCH_H_
+#define _MODBUS_BENCH_H_
+
+void CRC16_benchmark(void);
+int replay_benchmark(void);
+int gorilla_benchmark(void);
+
+#endif
+// END OF FILE
\ No newline at end of file
@@ -0,0 +1,156 @@
+/** ************************************************************************************************
+ *	MODBUS RTU bus capture
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - RAM ring and pcap export
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+Every frame boundary found by the frame assembler of a modbus_uart port is recorded in a RAM ring, 
+good frames and dropped bytes alike, with the time of the end of the frame. Recording is a header 
+and a memcpy under a spinlock, it can stay on in production. When the ring is full the oldest 
+frames are overwritten.
+
+Positions in the ring are absolute byte counts (head: next write, tail: oldest record), the ring 
+index is position % MODBUS_CAPTURE_SIZE. A reader keeps its own position and skips ahead when the 
+writer has overwritten it.
+
+Export (modbus_capture_stream) is a pcap file, one packet per frame:
+	link type		MODBUS_CAPTURE_LINKTYPE (USER0)
+	time stamp		esp_timer_get_time(), time since boot
+	packet			port (UART number) | flags (MODBUS_RTU_FRAME_xxx) | frame bytes, CRC included
+
+	curl -X GET http://<ip>:80 -d '{"type":"capture","key":"..."}' -o bus.pcap
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <string.h>			// memcpy
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "modbus.h"
+#include "modbus_capture.h"
+
+typedef struct modbus_capture_record_s
+{
+	int64_t time;			// us
+	uint8_t port;
+	uint8_t flags;
+	uint16_t len;
+} modbus_capture_record_type;
+
+static uint8_t modbus_capture_ring[MODBUS_CAPTURE_SIZE];
+static uint32_t modbus_capture_head;		// next write
+static uint32_t modbus_capture_tail;		// oldest record
+static uint32_t modbus_capture_frames;
+static uint32_t modbus_capture_overwritten;
+static portMUX_TYPE modbus_capture_lock= portMUX_INITIALIZER_UNLOCKED;
+
+static void modbus_capture_put(uint32_t pos, const void *data, uint32_t len)
+{
+	uint32_t i= pos % MODBUS_CAPTURE_SIZE;
+	uint32_t first= MODBUS_CAPTURE_SIZE - i < len ? MODBUS_CAPTURE_SIZE - i : len;
+	memcpy(&modbus_capture_ring[i], data, first);
+	memcpy(modbus_capture_ring, (const uint8_t *) data + first, len - first);
+} // modbus_capture_put
+
+static void modbus_capture_get(uint32_t pos, void *data, uint32_t len)
+{
+	uint32_t i= pos % MODBUS_CAPTURE_SIZE;
+	uint32_t first= MODBUS_CAPTURE_SIZE - i < len ? MODBUS_CAPTURE_SIZE - i : len;
+	memcpy(data, &modbus_capture_ring[i], first);
+	memcpy((uint8_t *) data + first, modbus_capture_ring, len - first);
+} // modbus_capture_get
+
+// Frame boundary (modbus_rtu_rx_type capture hook, RX tasks)
+void modbus_capture_frame(uint8_t port, const uint8_t *frame, int len, int flags, int64_t time)
+{
+	modbus_capture_record_type r= { .time= time, .port= port, .flags= flags, .len= len };
+	uint32_t size= sizeof(r) + len;
+	taskENTER_CRITICAL(&modbus_capture_lock);
+	// room for the new record
+	while(modbus_capture_head + size - modbus_capture_tail > MODBUS_CAPTURE_SIZE)
+	{
+		modbus_capture_record_type old;
+		modbus_capture_get(modbus_capture_tail, &old, sizeof(old));
+		modbus_capture_tail += sizeof(old) + old.len;
+		modbus_capture_overwritten ++;
+	}
+	modbus_capture_put(modbus_capture_head, &r, sizeof(r));
+	modbus_capture_put(modbus_capture_head + sizeof(r), frame, len);
+	modbus_capture_head += size;
+	modbus_capture_frames ++;
+	taskEXIT_CRITICAL(&modbus_capture_lock);
+} // modbus_capture_frame
+
+// Copy the record at *pos and move *pos to the next one
+// return	frame length, -1 nothing left before end
+static int modbus_capture_next(uint32_t *pos, uint32_t end, modbus_capture_record_type *r, uint8_t *frame)
+{
+	int len= -1;
+	taskENTER_CRITICAL(&modbus_capture_lock);
+	// overwritten while the reader was busy
+	if((int32_t) (*pos - modbus_capture_tail) < 0) *pos= modbus_capture_tail;
+	if((int32_t) (end - *pos) > 0)
+	{
+		modbus_capture_get(*pos, r, sizeof(*r));
+		modbus_capture_get(*pos + sizeof(*r), frame, r->len);
+		*pos += sizeof(*r) + r->len;
+		len= r->len;
+	}
+	taskEXIT_CRITICAL(&modbus_capture_lock);
+	return len;
+} // modbus_capture_next
+
+// pcap file of the frames recorded so far
+// write	sends data, returns 0 ok
+// return	frames written, -1 write error
+int modbus_capture_stream(int (*write) (const void *data, size_t len, void *ctx), void *ctx)
+{
+	const struct {
+		uint32_t magic;
+		uint16_t version_major;
+		uint16_t version_minor;
+		int32_t thiszone;
+		uint32_t sigfigs;
+		uint32_t snaplen;
+		uint32_t network;
+	} header= { 0xA1B2C3D4, 2, 4, 0, 0, 2 + MODBUS_RTU_FRAME_MAX, MODBUS_CAPTURE_LINKTYPE };
+	struct {
+		uint32_t ts_sec;
+		uint32_t ts_usec;
+		uint32_t incl_len;
+		uint32_t orig_len;
+		uint8_t port;
+		uint8_t flags;
+		uint8_t frame[MODBUS_RTU_FRAME_MAX];
+	} packet;
+	modbus_capture_record_type r;
+	if(write(&header, sizeof(header), ctx) != 0) return -1;
+	taskENTER_CRITICAL(&modbus_capture_lock);
+	uint32_t pos= modbus_capture_tail;
+	uint32_t end= modbus_capture_head;
+	taskEXIT_CRITICAL(&modbus_capture_lock);
+	int n= 0;
+	int len;
+	while((len= modbus_capture_next(&pos, end, &r, packet.frame)) >= 0)
+	{
+		packet.ts_sec= r.time / 1000000;
+		packet.ts_usec= r.time % 1000000;
+		packet.incl_len= packet.orig_len= 2 + len;
+		packet.port= r.port;
+		packet.flags= r.flags;
+		if(write(&packet, 16 + 2 + len, ctx) != 0) return -1;
+		n ++;
+	}
+	return n;
+} // modbus_capture_stream
+
+void modbus_capture_printf(void)
+{
+	fprintf(stdout, "\ncapture %lu frames, %lu overwritten, %lu bytes in the ring\n", 
+		modbus_capture_frames, modbus_capture_overwritten, modbus_capture_head - modbus_capture_tail);
+} // modbus_capture_printf
+
+// END OF FILE
\ No newline at end of file
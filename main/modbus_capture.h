@@ -0,0 +1,13 @@
+#ifndef _MODBUS_CAPTURE_H_
+#define _MODBUS_CAPTURE_H_
+
+#define MODBUS_CAPTURE				1		// 1: record the frames of every modbus_uart port
+#define MODBUS_CAPTURE_SIZE			16384	// RAM ring (bytes), 16 bytes of header per frame (modbus_capture_record_type)
+#define MODBUS_CAPTURE_LINKTYPE		147		// pcap LINKTYPE_USER0
+
+void modbus_capture_frame(uint8_t port, const uint8_t *frame, int len, int flags, int64_t time);
+int modbus_capture_stream(int (*write) (const void *data, size_t len, void *ctx), void *ctx);
+void modbus_capture_printf(void);
+
+#endif
+// END OF FILE
\ No newline at end of file
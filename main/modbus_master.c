@@ -0,0 +1,368 @@
+/** ************************************************************************************************
+ *	MODBUS RTU master
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - asynchronous transactions
+ * 	1.1.0 - response time estimator and adaptive timeouts
+ * 	1.2.0 - FC10 write multiple registers
+ * 			idle hook, called once the transaction is over
+ * 			requests of other masters skipped, their responses not taken for ours
+ * 			response time without the RX timeout delivery delay
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+Transactions are queued by modbus_master_submit() and run one at a time by the master task:
+
+	IDLE --(transaction)--> TURNAROUND --(bus silent MODBUS_MASTER_TURNAROUND_MS)--> SEND 
+	SEND --> WAIT_RESPONSE --(response)--> callback(OK or EXCEPTION)
+	                       --(timeout or bad response)--> SEND again while retries are left
+	                                                      callback(TIMEOUT or BAD_RESPONSE) otherwise
+
+The RX task hands every CRC-checked frame to modbus_master_frame(). Frames from other slaves or 
+with another function code are ignored, so traffic of other masters does not complete a transaction.
+Requests of other masters to our slave are skipped too; after one of them the next response answers
+the other master, even with our byte count, so responses are ignored until the timeout (retry).
+An exception response (function code | 0x80) completes the transaction straight away, retrying 
+would get the same answer.
+FC10 transactions carry up to MODBUS_MASTER_WRITE_MAX register values, the response echoes the start
+address and the register count.
+
+Response time: every first-attempt response updates the estimator of its slave (smoothed mean and 
+deviation as in TCP, plus a decaying histogram for the p99). Responses after a retry are not sampled,
+the request they answer is ambiguous (Karn). The sample is the slave's turnaround: from the end of
+the request to the first byte of the response, without the response frame time and the 
+MODBUS_RTU_RX_TOUT characters the RX timeout takes to deliver it. A transaction with timeout_ms 0 
+waits p99 + response frame time + RX timeout + margin, doubled on each retry, so a lost response 
+costs little more than the slave's real response time instead of the fixed MODBUS_MASTER_TIMEOUT_MS.
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <string.h>			// memcpy
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "esp_timer.h"		// esp_timer_get_time()
+
+#include "config.h"
+#include "modbus.h"
+#include "modbus_master.h"
+
+static const char *TAG = "modbus_master";
+
+// Called from the RX task with every CRC-checked frame
+void modbus_master_frame(modbus_master_type *m, uint8_t *frame, int len)
+{
+	modbus_master_frame_type f;
+	m->bus_idle_time= f.time= esp_timer_get_time();
+	f.len= len;
+	memcpy(f.data, frame, len);
+	xQueueSend(m->responses, &f, 0);
+} // modbus_master_frame
+
+// Queue a transaction
+// return	0 ok, -1 queue full or too many registers to write
+int modbus_master_submit(modbus_master_type *m, const modbus_transaction_type *t)
+{
+	if(t->function == 0x10 && (t->count == 0 || t->count > MODBUS_MASTER_WRITE_MAX)) return -1;
+	if(xQueueSend(m->transactions, t, 0) != pdTRUE)
+	{
+		ESP_LOGW(TAG, "UART%d queue full, %02X %02X %04X dropped", m->uart, t->slave, t->function, t->start);
+		return -1;
+	}
+	return 0;
+} // modbus_master_submit
+
+bool modbus_master_idle(modbus_master_type *m)
+{
+	return !m->busy && uxQueueMessagesWaiting(m->transactions) == 0;
+} // modbus_master_idle
+
+// idle() runs in the master task after every transaction (after its callback), keep it short
+void modbus_master_on_idle(modbus_master_type *m, void (*idle) (void *arg), void *arg)
+{
+	m->idle_arg= arg;
+	m->idle= idle;
+} // modbus_master_on_idle
+
+// The UART has been switched to another rate, call with the master idle
+void modbus_master_set_baudrate(modbus_master_type *m, uint32_t baud_rate)
+{
+	m->baud_rate= baud_rate;
+	m->bus_idle_time= esp_timer_get_time();
+} // modbus_master_set_baudrate
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   RESPONSE TIME ESTIMATOR
+
+---------------------------------------------------------------------------------------------------
+**/
+static modbus_rtt_type *modbus_master_rtt(modbus_master_type *m, uint8_t slave)
+{
+	for(int i=0; i<MODBUS_MASTER_RTT_SLAVES; i++)
+	{
+		if(m->rtt[i].slave == slave) return &m->rtt[i];
+		if(m->rtt[i].slave == 0) 
+		{
+			m->rtt[i].slave= slave;
+			return &m->rtt[i];
+		}
+	}
+	return 0;
+} // modbus_master_rtt
+
+// Transmission time of len bytes, 8N1
+static int32_t modbus_master_frame_us(modbus_master_type *m, int len)
+{
+	return (int32_t) (10LL * 1000000 * len / m->baud_rate);
+} // modbus_master_frame_us
+
+static void modbus_master_rtt_sample(modbus_rtt_type *r, int32_t rtt_us)
+{
+	if(rtt_us < 0) rtt_us= 0;
+	if(r->samples == 0)
+	{
+		r->srtt_us= rtt_us;
+		r->rttvar_us= rtt_us / 2;
+		r->min_us= r->max_us= rtt_us;
+	}
+	else
+	{
+		int32_t err= rtt_us - r->srtt_us;
+		r->srtt_us += err / 8;
+		r->rttvar_us += ((err < 0 ? -err : err) - r->rttvar_us) / 4;
+		if(rtt_us < r->min_us) r->min_us= rtt_us;
+		if(rtt_us > r->max_us) r->max_us= rtt_us;
+	}
+	r->samples ++;
+	int bin= rtt_us / MODBUS_MASTER_RTT_BIN_US;
+	if(bin >= MODBUS_MASTER_RTT_BINS) bin= MODBUS_MASTER_RTT_BINS - 1;
+	r->histogram[bin] ++;
+	if(++ r->histogram_n >= MODBUS_MASTER_RTT_DECAY)
+	{
+		r->histogram_n= 0;
+		for(int i=0; i<MODBUS_MASTER_RTT_BINS; i++) 
+		{
+			r->histogram[i] /= 2;
+			r->histogram_n += r->histogram[i];
+		}
+	}
+} // modbus_master_rtt_sample
+
+// Upper edge of the bin holding the 99th percentile (us), -1 with no samples
+int32_t modbus_master_rtt_p99(const modbus_rtt_type *r)
+{
+	uint32_t total= 0;
+	for(int i=0; i<MODBUS_MASTER_RTT_BINS; i++) total += r->histogram[i];
+	if(total == 0) return -1;
+	uint32_t below= total - total / 100;
+	uint32_t acc= 0;
+	int i;
+	for(i=0; i<MODBUS_MASTER_RTT_BINS - 1; i++)
+	{
+		acc += r->histogram[i];
+		if(acc >= below) break;
+	}
+	return (i + 1) * MODBUS_MASTER_RTT_BIN_US;
+} // modbus_master_rtt_p99
+
+// Response timeout for the first attempt of t
+static uint32_t modbus_master_timeout_ms(modbus_master_type *m, const modbus_transaction_type *t)
+{
+	if(t->timeout_ms) return t->timeout_ms;
+	modbus_rtt_type *r= modbus_master_rtt(m, t->slave);
+	if(!r || r->samples < MODBUS_MASTER_RTT_MIN_SAMPLES) return MODBUS_MASTER_TIMEOUT_MS;
+	// FC03/FC04 response 5 + 2 x count bytes, FC10 8 bytes, and the RX timeout that delivers it
+	int32_t us= modbus_master_rtt_p99(r) + modbus_master_frame_us(m, (t->function == 0x10 ? 8 : 5 + 2 * t->count) + MODBUS_RTU_RX_TOUT);
+	uint32_t ms= us / 1000 + MODBUS_MASTER_RTT_MARGIN_MS;
+	if(ms < MODBUS_MASTER_TIMEOUT_MIN_MS) ms= MODBUS_MASTER_TIMEOUT_MIN_MS;
+	if(ms > MODBUS_MASTER_TIMEOUT_MS) ms= MODBUS_MASTER_TIMEOUT_MS;
+	return ms;
+} // modbus_master_timeout_ms
+
+int modbus_master_json(modbus_master_type *m, char *buffer, size_t sz)
+{
+	int len= snprintf(buffer, sz, "{\"baud\":%lu,\"completed\":%lu,\"timeouts\":%lu,\"retries\":%lu,\"exceptions\":%lu,\"bad\":%lu,\"rtt\":[",
+		m->baud_rate, m->completed, m->timeouts, m->retries, m->exceptions, m->bad_responses);
+	for(int i=0, n=0; i<MODBUS_MASTER_RTT_SLAVES && len < (int) sz; i++)
+	{
+		modbus_rtt_type *r= &m->rtt[i];
+		if(r->slave == 0 || r->samples == 0) continue;
+		len += snprintf(&buffer[len], sz - len, "%s{\"slave\":%d,\"n\":%lu,\"srtt\":%ld,\"rttvar\":%ld,\"p99\":%ld,\"min\":%ld,\"max\":%ld}",
+			n++ ? ",":"", r->slave, r->samples, r->srtt_us, r->rttvar_us, modbus_master_rtt_p99(r), r->min_us, r->max_us);
+	}
+	if(len < (int) sz) len += snprintf(&buffer[len], sz - len, "]}");
+	return len;
+} // modbus_master_json
+
+void modbus_master_printf(modbus_master_type *m)
+{
+	fprintf(stdout, "\nUART%d %lu baud completed %lu timeouts %lu retries %lu exceptions %lu bad responses %lu other masters %lu", 
+		m->uart, m->baud_rate, m->completed, m->timeouts, m->retries, m->exceptions, m->bad_responses, m->foreign_requests);
+	for(int i=0; i<MODBUS_MASTER_RTT_SLAVES; i++)
+	{
+		modbus_rtt_type *r= &m->rtt[i];
+		if(r->slave == 0 || r->samples == 0) continue;
+		fprintf(stdout, "\n   slave %3d response time (us) srtt %ld rttvar %ld p99 %ld min %ld max %ld (%lu samples)", 
+			r->slave, r->srtt_us, r->rttvar_us, modbus_master_rtt_p99(r), r->min_us, r->max_us, r->samples);
+	}
+	fprintf(stdout, "\n");
+} // modbus_master_printf
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   TRANSACTIONS
+
+---------------------------------------------------------------------------------------------------
+**/
+static void modbus_master_send(modbus_master_type *m, const modbus_transaction_type *t)
+{
+	uint8_t frame[9 + 2 * MODBUS_MASTER_WRITE_MAX];
+	int len= 0;
+	frame[len++]= t->slave;
+	frame[len++]= t->function;
+	frame[len++]= t->start >> 8;
+	frame[len++]= t->start & 0xFF;
+	frame[len++]= t->count >> 8;
+	frame[len++]= t->count & 0xFF;
+	if(t->function == 0x10)
+	{
+		frame[len++]= 2 * t->count;
+		for(int i=0; i<t->count; i++)
+		{
+			frame[len++]= t->values[i] >> 8;
+			frame[len++]= t->values[i] & 0xFF;
+		}
+	}
+	uint16_t crc= CRC16(frame, len);
+	frame[len++]= crc & 0xFF;
+	frame[len++]= crc >> 8;
+	int txBytes= uart_write_bytes(m->uart, (char*) frame, len);
+	if(txBytes != len) printf("\n[ERROR] modbus_master_send uart_write_bytes %2d bytes", txBytes);
+	uart_wait_tx_done(m->uart, MODBUS_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+	m->bus_idle_time= esp_timer_get_time();
+} // modbus_master_send
+
+// Request rather than response: FC03/FC04 requests are 8 bytes, a response never is (even byte 
+// count); FC10 responses are 8 bytes, requests never are
+static bool modbus_master_request(const modbus_transaction_type *t, const modbus_master_frame_type *f)
+{
+	return t->function == 0x10 ? f->len != 8 : f->len == 8;
+} // modbus_master_request
+
+// Wait for the response to t
+// Once another master has addressed the slave after our request, the next response answers it, 
+// not us: responses are ignored from then on and the transaction times out (retry)
+// return	MODBUS_STATUS_xxx, f holds the response for OK and EXCEPTION
+static int modbus_master_wait(modbus_master_type *m, const modbus_transaction_type *t, uint32_t timeout_ms, modbus_master_frame_type *f)
+{
+	int64_t deadline= esp_timer_get_time() + 1000LL * timeout_ms;
+	bool foreign= false;
+	while(1)
+	{
+		int64_t remaining_ms= (deadline - esp_timer_get_time()) / 1000;
+		if(remaining_ms <= 0) return MODBUS_STATUS_TIMEOUT;
+		TickType_t ticks= remaining_ms / portTICK_PERIOD_MS;
+		if(xQueueReceive(m->responses, f, ticks > 0 ? ticks : 1) != pdTRUE) return MODBUS_STATUS_TIMEOUT;
+		// not for this transaction
+		if(f->data[0] != t->slave) continue;
+		if(f->data[1] == (t->function | 0x80) && f->len == 5) 
+		{
+			if(foreign) continue;
+			return MODBUS_STATUS_EXCEPTION;
+		}
+		if(f->data[1] != t->function) continue;
+		if(modbus_master_request(t, f))
+		{
+			// identical to ours (echo, or the same read): its response would do for us too
+			if((f->data[2] << 8 | f->data[3]) != t->start || (f->data[4] << 8 | f->data[5]) != t->count)
+			{
+				foreign= true;
+				m->foreign_requests ++;
+			}
+			continue;
+		}
+		if(foreign) continue;
+		// FC10: start address and register count echoed
+		if(t->function == 0x10)
+		{
+			if((f->data[2] << 8 | f->data[3]) != t->start || (f->data[4] << 8 | f->data[5]) != t->count) return MODBUS_STATUS_BAD_RESPONSE;
+			return MODBUS_STATUS_OK;
+		}
+		// FC03/FC04: byte count
+		if(f->data[2] != 2 * t->count || f->len != 5 + f->data[2]) return MODBUS_STATUS_BAD_RESPONSE;
+		return MODBUS_STATUS_OK;
+	}
+} // modbus_master_wait
+
+static void modbus_master_task(void *arg)
+{
+	modbus_master_type *m= (modbus_master_type *) arg;
+	modbus_master_frame_type *f= &m->response;
+	modbus_transaction_type t;
+	while(1)
+	{
+		if(xQueueReceive(m->transactions, &t, portMAX_DELAY) != pdTRUE) continue;
+		m->busy= true;
+		int status;
+		uint32_t timeout_ms= modbus_master_timeout_ms(m, &t);
+		for(int attempt=0; ; attempt++)
+		{
+			// turnaround: leave the bus silent before the request
+			int64_t idle_ms= (esp_timer_get_time() - m->bus_idle_time) / 1000;
+			if(idle_ms < MODBUS_MASTER_TURNAROUND_MS) 
+				vTaskDelay((MODBUS_MASTER_TURNAROUND_MS - idle_ms) / portTICK_PERIOD_MS + 1);
+			// a late response to a previous request must not be taken for this one
+			xQueueReset(m->responses);
+			modbus_master_send(m, &t);
+			int64_t tx_end= m->bus_idle_time;
+			status= modbus_master_wait(m, &t, timeout_ms, f);
+			if(status >= MODBUS_STATUS_OK && attempt == 0)
+			{
+				modbus_rtt_type *r= modbus_master_rtt(m, t.slave);
+				// the frame is delivered at the RX timeout, MODBUS_RTU_RX_TOUT characters after its last byte
+				if(r) modbus_master_rtt_sample(r, (int32_t) (f->time - tx_end) - modbus_master_frame_us(m, f->len + MODBUS_RTU_RX_TOUT));
+			}
+			if(status >= MODBUS_STATUS_OK || attempt >= t.retries) break;
+			m->retries ++;
+			// backoff: the estimate may be out of date (wiring, meter, baud rate)
+			if(t.timeout_ms == 0) timeout_ms= timeout_ms * 2 > MODBUS_MASTER_TIMEOUT_MS ? MODBUS_MASTER_TIMEOUT_MS : timeout_ms * 2;
+			if(_VERBOSE_) printf("\nmodbus_master UART%d %02X %04X retry %d (%d)", m->uart, t.function, t.start, attempt + 1, status);
+		}
+		switch(status)
+		{
+			case MODBUS_STATUS_OK: 				m->completed ++; break;
+			case MODBUS_STATUS_EXCEPTION: 		m->exceptions ++; 
+				ESP_LOGW(TAG, "UART%d %02X %02X %04X exception %02X", m->uart, t.slave, t.function, t.start, f->data[2]); 
+				break;
+			case MODBUS_STATUS_TIMEOUT: 		m->timeouts ++; break;
+			case MODBUS_STATUS_BAD_RESPONSE: 	m->bad_responses ++; break;
+		}
+		if(t.callback) 
+		{
+			if(status >= MODBUS_STATUS_OK) t.callback(&t, status, f->data, f->len);
+			else t.callback(&t, status, 0, 0);
+		}
+		m->busy= false;
+		// the scheduler sees the master idle when woken up
+		if(m->idle) m->idle(m->idle_arg);
+	}
+} // modbus_master_task
+
+void modbus_master_create(modbus_master_type *m, uart_port_t uart, const char *name, UBaseType_t uxPriority)
+{
+	memset(m, 0, sizeof(modbus_master_type));
+	m->uart= uart;
+	m->baud_rate= 9600;
+	uart_get_baudrate(uart, &m->baud_rate);
+	m->transactions= xQueueCreate(MODBUS_MASTER_QUEUE_SIZE, sizeof(modbus_transaction_type));
+	m->responses= xQueueCreate(2, sizeof(modbus_master_frame_type));
+	xTaskCreate(modbus_master_task, name, 4*1024, m, uxPriority, NULL);
+} // modbus_master_create
+
+// END OF FILE
\ No newline at end of file
@@ -0,0 +1,105 @@
+#ifndef _MODBUS_MASTER_H_
+#define _MODBUS_MASTER_H_
+
+#define MODBUS_MASTER_QUEUE_SIZE		16		// pending transactions
+#define MODBUS_MASTER_TIMEOUT_MS		500		// default response timeout
+#define MODBUS_MASTER_RETRIES			2		// default retries after a timeout or a bad response
+#define MODBUS_MASTER_TURNAROUND_MS		10		// bus silence before sending the next request
+#define MODBUS_MASTER_WRITE_MAX			4		// FC10 registers per transaction
+
+// Response time estimator (per slave) and adaptive timeout
+// With timeout_ms 0 the timeout is the p99 of the slave response time plus the response frame time 
+// plus MODBUS_MASTER_RTT_MARGIN_MS, within MODBUS_MASTER_TIMEOUT_MIN_MS .. MODBUS_MASTER_TIMEOUT_MS
+#define MODBUS_MASTER_RTT_SLAVES		4		// slaves tracked per master
+#define MODBUS_MASTER_RTT_BINS			64		// response time histogram
+#define MODBUS_MASTER_RTT_BIN_US		2000	// 64 x 2 ms, the last bin holds anything longer
+#define MODBUS_MASTER_RTT_DECAY			256		// halve the histogram every x samples, old samples fade out
+#define MODBUS_MASTER_RTT_MIN_SAMPLES	16		// MODBUS_MASTER_TIMEOUT_MS until then
+#define MODBUS_MASTER_RTT_MARGIN_MS		20
+#define MODBUS_MASTER_TIMEOUT_MIN_MS	50
+
+// Transaction status (callback)
+#define MODBUS_STATUS_OK				0
+#define MODBUS_STATUS_EXCEPTION			1		// exception response, code in frame[2]
+#define MODBUS_STATUS_TIMEOUT			-1		// no response after the retries
+#define MODBUS_STATUS_BAD_RESPONSE		-2		// response does not match the request after the retries
+
+// Request frame for FC03/FC04
+typedef struct modbus_master_query_s
+{ 
+	uint8_t Slave_Adress;			
+	uint8_t Function_code;	
+	uint16_t Start_Address;
+	uint16_t Number_of_Points;
+	uint16_t Error_Check;
+} modbus_master_query_type;
+
+typedef struct modbus_transaction_s modbus_transaction_type;
+struct modbus_transaction_s
+{
+	uint8_t slave;
+	uint8_t function;				// 0x03, 0x04 or 0x10
+	uint16_t start;
+	uint16_t count;
+	uint16_t values[MODBUS_MASTER_WRITE_MAX];	// FC10: the count registers to write
+	uint16_t timeout_ms;			// 0: MODBUS_MASTER_TIMEOUT_MS
+	uint8_t retries;
+	int tag;						// free for the caller
+	// Completion, called from the master task 
+	// frame/len is the response for MODBUS_STATUS_OK and MODBUS_STATUS_EXCEPTION, 0 otherwise
+	void (*callback) (const modbus_transaction_type *t, int status, uint8_t *frame, int len);
+};
+
+// Response time of one slave: from the end of the request to the first byte of the response 
+// (arrival time minus the response frame time)
+typedef struct modbus_rtt_s
+{
+	uint8_t slave;					// 0: free
+	uint32_t samples;
+	int32_t srtt_us;				// smoothed mean, gain 1/8
+	int32_t rttvar_us;				// smoothed mean deviation, gain 1/4
+	int32_t min_us;
+	int32_t max_us;
+	uint16_t histogram[MODBUS_MASTER_RTT_BINS];
+	uint16_t histogram_n;
+} modbus_rtt_type;
+
+typedef struct modbus_master_frame_s
+{
+	int64_t time;					// delivered by the frame assembler (us)
+	uint16_t len;
+	uint8_t data[MODBUS_RTU_FRAME_MAX];
+} modbus_master_frame_type;
+
+typedef struct modbus_master_s
+{
+	uart_port_t uart;
+	QueueHandle_t transactions;		// pending transactions
+	QueueHandle_t responses;		// frames from the RX task
+	int64_t bus_idle_time;			// end of the last frame on the bus (us)
+	volatile bool busy;				// a transaction is in progress
+	void (*idle) (void *arg);		// optional, called by the master task once busy is cleared
+	void *idle_arg;
+	uint32_t completed;
+	uint32_t timeouts;
+	uint32_t retries;
+	uint32_t exceptions;
+	uint32_t bad_responses;
+	uint32_t foreign_requests;		// requests of other masters to our slave during a transaction
+	uint32_t baud_rate;
+	modbus_rtt_type rtt[MODBUS_MASTER_RTT_SLAVES];
+	modbus_master_frame_type response;	// the master task's own, one per instance
+} modbus_master_type;
+
+void modbus_master_create(modbus_master_type *m, uart_port_t uart, const char *name, UBaseType_t uxPriority);
+int modbus_master_submit(modbus_master_type *m, const modbus_transaction_type *t);
+void modbus_master_frame(modbus_master_type *m, uint8_t *frame, int len);
+bool modbus_master_idle(modbus_master_type *m);
+void modbus_master_on_idle(modbus_master_type *m, void (*idle) (void *arg), void *arg);
+void modbus_master_set_baudrate(modbus_master_type *m, uint32_t baud_rate);
+int32_t modbus_master_rtt_p99(const modbus_rtt_type *r);
+int modbus_master_json(modbus_master_type *m, char *buffer, size_t sz);
+void modbus_master_printf(modbus_master_type *m);
+
+#endif
+// END OF FILE
\ No newline at end of file
@@ -0,0 +1,189 @@
+/** ************************************************************************************************
+ *	MODBUS RTU virtual slave
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - FC03/FC04 reads from a register image
+ * 	1.1.0 - transport independent PDU handling (Modbus TCP)
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+Other masters in the house (a heat pump controller, a second inverter) read the measurements from 
+this slave instead of polling the meters: one acquisition, any number of consumers.
+
+The registers are an image of MODBUS_SLAVE_REGISTERS, wire order, written by the refresh callback 
+given to modbus_slave_init(). modbus_slave_pdu() answers a request PDU (function code + data) for
+any transport: it runs the callback when the image is older than MODBUS_SLAVE_REFRESH_MS and copies 
+the registers, both under modbus_slave_mutex, so the values are as fresh as the meter tasks have 
+them and the RTU and TCP tasks never see a half written image. The serial buses are never touched.
+
+RTU (modbus_slave_create): the request is answered from the frame callback, inside 
+modbus_uart_receive() of the slave task:
+- the frame is delivered about MODBUS_RTU_RX_TOUT characters after its last byte (UART RX timeout),
+  which is also the 3.5 character silence the response must wait for
+- refresh + response build + CRC take a few tens of us, the task runs at the priority of the UART 
+  tasks. The turnaround, from the end of the request to the response handed to the UART, is measured
+  on every answer and the ones above MODBUS_SLAVE_TURNAROUND_US are counted as late
+Exceptions: 01 for any function code other than 03/04, 03 for a count out of 1..125, 02 for 
+registers outside the image. Frames for other slaves are counted and ignored.
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <string.h>			// memset
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "esp_timer.h"		// esp_timer_get_time()
+
+#include "modbus.h"
+#include "modbus_uart.h"
+#include "modbus_slave.h"
+
+static const char *TAG = "modbus_slave";
+
+static modbus_uart_type modbus_slave_uart;
+static uint8_t modbus_slave_address;
+static void (*modbus_slave_refresh) (void)= 0;
+static uint8_t modbus_slave_registers[2 * MODBUS_SLAVE_REGISTERS];
+static int64_t modbus_slave_refresh_time;
+static SemaphoreHandle_t modbus_slave_mutex;
+static modbus_slave_stats_type modbus_slave_stats;
+
+// Refresh callback only
+void modbus_slave_set_float(uint16_t reg, float value)
+{
+	if(reg + 2 > MODBUS_SLAVE_REGISTERS) return;
+	float2record(value, &modbus_slave_registers[2 * reg]);
+} // modbus_slave_set_float
+
+void modbus_slave_set_uint16(uint16_t reg, uint16_t value)
+{
+	if(reg >= MODBUS_SLAVE_REGISTERS) return;
+	modbus_slave_registers[2 * reg]= value >> 8;
+	modbus_slave_registers[2 * reg + 1]= value & 0xFF;
+} // modbus_slave_set_uint16
+
+static void modbus_slave_turnaround(int32_t us)
+{
+	modbus_slave_stats_type *s= &modbus_slave_stats;
+	if(s->turnaround_n ++ == 0 || us < s->turnaround_min_us) s->turnaround_min_us= us;
+	if(us > s->turnaround_max_us) s->turnaround_max_us= us;
+	s->turnaround_sum_us += us;
+	if(us > MODBUS_SLAVE_TURNAROUND_US) s->late ++;
+} // modbus_slave_turnaround
+
+// Request PDU: function code and data, no address / unit identifier and no CRC
+// response	room for MODBUS_SLAVE_PDU_MAX bytes
+// return	response PDU length
+int modbus_slave_pdu(const uint8_t *pdu, int len, uint8_t *response)
+{
+	int n= 0;
+	uint8_t function= pdu[0];
+	uint16_t start= len >= 3 ? (uint16_t) pdu[1] << 8 | pdu[2] : 0;
+	uint16_t count= len >= 5 ? (uint16_t) pdu[3] << 8 | pdu[4] : 0;
+	uint8_t exception= 0;
+	if(function != 0x03 && function != 0x04) exception= MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+	else if(len != 5 || count == 0 || count > MODBUS_MAX_READ_REGISTERS) exception= MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	else if((uint32_t) start + count > MODBUS_SLAVE_REGISTERS) exception= MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+	xSemaphoreTake(modbus_slave_mutex, portMAX_DELAY);
+	modbus_slave_stats.requests ++;
+	if(exception)
+	{
+		response[n++]= function | 0x80;
+		response[n++]= exception;
+		modbus_slave_stats.exceptions ++;
+	}
+	else
+	{
+		int64_t now= esp_timer_get_time();
+		if(modbus_slave_refresh && now - modbus_slave_refresh_time >= 1000LL * MODBUS_SLAVE_REFRESH_MS)
+		{
+			modbus_slave_refresh();
+			modbus_slave_refresh_time= now;
+			modbus_slave_stats.refreshes ++;
+		}
+		response[n++]= function;
+		response[n++]= 2 * count;
+		memcpy(&response[n], &modbus_slave_registers[2 * start], 2 * count);
+		n += 2 * count;
+		modbus_slave_stats.responses ++;
+	}
+	xSemaphoreGive(modbus_slave_mutex);
+	return n;
+} // modbus_slave_pdu
+
+// Complete, CRC-checked frame from the frame assembler (slave task)
+static void modbus_slave_frame(uint8_t *frame, int len)
+{
+	// the request ended MODBUS_RTU_RX_TOUT characters before the RX timeout event
+	int64_t request_end= esp_timer_get_time() - MODBUS_RTU_RX_TOUT * modbus_slave_uart.char_us;
+	uint8_t response[1 + MODBUS_SLAVE_PDU_MAX + 2];
+
+	// reads are never broadcast
+	if(frame[0] != modbus_slave_address)
+	{
+		modbus_slave_stats.other ++;
+		return;
+	}
+	response[0]= modbus_slave_address;
+	int n= 1 + modbus_slave_pdu(frame + 1, len - 3, response + 1);
+	uint16_t crc= CRC16(response, n);
+	response[n++]= crc & 0xFF;
+	response[n++]= crc >> 8;
+	modbus_slave_turnaround((int32_t) (esp_timer_get_time() - request_end));
+	int txBytes= uart_write_bytes(modbus_slave_uart.uart, (char*) response, n);
+	if(txBytes != n) ESP_LOGW(TAG, "uart_write_bytes %d of %d bytes", txBytes, n);
+} // modbus_slave_frame
+
+static void modbus_slave_task(void *arg)
+{
+	while(1)
+	{
+		// requests are answered from modbus_slave_frame()
+		modbus_uart_receive(&modbus_slave_uart);
+	}
+} // modbus_slave_task
+
+int modbus_slave_json(char *buffer, size_t sz)
+{
+	modbus_slave_stats_type *s= &modbus_slave_stats;
+	return snprintf(buffer, sz, "{\"address\":%d,\"requests\":%lu,\"responses\":%lu,\"exceptions\":%lu,\"refreshes\":%lu,\"other\":%lu,\"late\":%lu,\"turnaround\":[%ld,%ld,%ld]}",
+		modbus_slave_address, s->requests, s->responses, s->exceptions, s->refreshes, s->other, s->late,
+		s->turnaround_min_us, s->turnaround_n ? (int32_t) (s->turnaround_sum_us / s->turnaround_n) : 0, s->turnaround_max_us);
+} // modbus_slave_json
+
+void modbus_slave_printf(void)
+{
+	modbus_slave_stats_type *s= &modbus_slave_stats;
+	fprintf(stdout, "\nSlave %d requests %lu responses %lu exceptions %lu image refreshes %lu", 
+		modbus_slave_address, s->requests, s->responses, s->exceptions, s->refreshes);
+	if(s->turnaround_n) fprintf(stdout, "\n   UART%d other slaves %lu turnaround (us) min %ld avg %ld max %ld, %lu above %d us", 
+		modbus_slave_uart.uart, s->other, s->turnaround_min_us, (int32_t) (s->turnaround_sum_us / s->turnaround_n), s->turnaround_max_us, 
+		s->late, MODBUS_SLAVE_TURNAROUND_US);
+	fprintf(stdout, "\n");
+} // modbus_slave_printf
+
+// Register image, before any transport
+// refresh	writes the image with modbus_slave_set_xxx(), called before an answer when the image is older than MODBUS_SLAVE_REFRESH_MS
+void modbus_slave_init(uint8_t address, void (*refresh) (void))
+{
+	memset(&modbus_slave_stats, 0, sizeof(modbus_slave_stats));
+	memset(modbus_slave_registers, 0, sizeof(modbus_slave_registers));
+	modbus_slave_address= address;
+	modbus_slave_refresh= refresh;
+	modbus_slave_refresh_time= 0;
+	modbus_slave_mutex= xSemaphoreCreateMutex();
+} // modbus_slave_init
+
+// RTU transport
+void modbus_slave_create(uart_port_t uart, int baud_rate, int tx_io_num, int rx_io_num, UBaseType_t uxPriority)
+{
+	modbus_uart_init(&modbus_slave_uart, uart, baud_rate, tx_io_num, rx_io_num, modbus_slave_frame);
+	xTaskCreate(modbus_slave_task, "modbus_slave", 4*1024, NULL, uxPriority, NULL);
+} // modbus_slave_create
+
+// END OF FILE
\ No newline at end of file
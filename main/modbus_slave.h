@@ -0,0 +1,42 @@
+#ifndef _MODBUS_SLAVE_H_
+#define _MODBUS_SLAVE_H_
+
+// Virtual slave: register image served over RTU (modbus_slave_create) and Modbus TCP (modbus_tcp)
+// The ESP32 has three UARTs and UART1/UART2 are the meters: the slave takes UART0, so the console 
+// must be moved off it (CONFIG_ESP_CONSOLE_NONE or USB) before enabling MODBUS_SLAVE
+#define MODBUS_SLAVE					0			// 1: RTU slave answering FC03/FC04 reads on MODBUS_SLAVE_UART
+#define MODBUS_SLAVE_UART				UART_NUM_0
+#define MODBUS_SLAVE_TX_GPIO			1
+#define MODBUS_SLAVE_RX_GPIO			3
+#define MODBUS_SLAVE_BAUDRATE			9600
+#define MODBUS_SLAVE_ADDRESS			10			// RTU, Modbus TCP answers any unit identifier
+#define MODBUS_SLAVE_REGISTERS			128			// register image, FC03 and FC04 read the same registers
+#define MODBUS_SLAVE_TURNAROUND_US		5000		// end of the request to the start of the response, longer is counted as late
+#define MODBUS_SLAVE_REFRESH_MS			10			// image refreshed at most this often, whatever the number of requests
+#define MODBUS_SLAVE_PDU_MAX			(2 + 2 * MODBUS_MAX_READ_REGISTERS)	// response function code + byte count + registers
+
+typedef struct modbus_slave_stats_s
+{
+	uint32_t requests;				// addressed to us, any transport
+	uint32_t responses;
+	uint32_t exceptions;
+	uint32_t refreshes;
+	// RTU
+	uint32_t other;					// frames for other slaves
+	uint32_t late;					// turnaround above MODBUS_SLAVE_TURNAROUND_US
+	int32_t turnaround_min_us;
+	int32_t turnaround_max_us;
+	int64_t turnaround_sum_us;
+	uint32_t turnaround_n;
+} modbus_slave_stats_type;
+
+void modbus_slave_init(uint8_t address, void (*refresh) (void));
+void modbus_slave_create(uart_port_t uart, int baud_rate, int tx_io_num, int rx_io_num, UBaseType_t uxPriority);
+int modbus_slave_pdu(const uint8_t *pdu, int len, uint8_t *response);
+void modbus_slave_set_float(uint16_t reg, float value);
+void modbus_slave_set_uint16(uint16_t reg, uint16_t value);
+int modbus_slave_json(char *buffer, size_t sz);
+void modbus_slave_printf(void);
+
+#endif
+// END OF FILE
\ No newline at end of file
@@ -0,0 +1,222 @@
+/** ************************************************************************************************
+ *	MODBUS TCP server
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - FC03/FC04 reads from the modbus_slave register image
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+Home Assistant, SCADA and loggers read the measurements over Modbus TCP on MODBUS_TCP_PORT. 
+One task serves up to MODBUS_TCP_CLIENTS connections with select():
+- every client has its own receive buffer, requests split across segments or several requests 
+  in one segment (pipelining) are both handled
+- ADU: MBAP header (transaction id, protocol id 0, length, unit id) + PDU. The PDU goes to 
+  modbus_slave_pdu() and the response goes back with the same transaction and unit id. Any unit id 
+  is answered, the server is the end device
+- the register image is RAM, refreshed from the meter data at most every MODBUS_SLAVE_REFRESH_MS:
+  the serial buses are never touched and the service time (request parsed to response ready) is 
+  tens of us, measured on every request
+- TCP_NODELAY, the responses are small and go out straight away. Clients silent for 
+  MODBUS_TCP_IDLE_SEC are closed so that a dead peer does not hold a slot
+The register map is described in main.c (VIRTUAL SLAVE).
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <string.h>			// memmove
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"		// esp_timer_get_time()
+#include "lwip/sockets.h"
+#include "driver/uart.h"
+
+#include "modbus.h"
+#include "modbus_slave.h"
+#include "modbus_tcp.h"
+
+static const char *TAG = "modbus_tcp";
+
+typedef struct modbus_tcp_client_s
+{
+	int sock;						// -1 free
+	int len;
+	int64_t last;					// last request (us)
+	uint8_t buffer[MODBUS_TCP_ADU_MAX];
+} modbus_tcp_client_type;
+
+static modbus_tcp_client_type modbus_tcp_client[MODBUS_TCP_CLIENTS];
+static modbus_tcp_stats_type modbus_tcp_stats;
+
+static void modbus_tcp_close(modbus_tcp_client_type *c)
+{
+	shutdown(c->sock, 0);
+	close(c->sock);
+	c->sock= -1;
+	c->len= 0;
+} // modbus_tcp_close
+
+// Answer the complete ADUs in the client buffer
+// return	0 ok, -1 close the connection
+static int modbus_tcp_requests(modbus_tcp_client_type *c)
+{
+	uint8_t response[7 + MODBUS_SLAVE_PDU_MAX];
+	while(c->len >= 7)
+	{
+		uint16_t protocol= (uint16_t) c->buffer[2] << 8 | c->buffer[3];
+		uint16_t length= (uint16_t) c->buffer[4] << 8 | c->buffer[5];		// unit id + PDU
+		if(protocol != 0 || length < 2 || 6 + length > MODBUS_TCP_ADU_MAX)
+		{
+			modbus_tcp_stats.bad_frames ++;
+			return -1;
+		}
+		if(c->len < 6 + length) break;
+
+		int64_t t0= esp_timer_get_time();
+		int n= modbus_slave_pdu(&c->buffer[7], length - 1, &response[7]);
+		memcpy(response, c->buffer, 4);			// transaction and protocol id
+		response[4]= (1 + n) >> 8;
+		response[5]= (1 + n) & 0xFF;
+		response[6]= c->buffer[6];				// unit id
+		int32_t us= (int32_t) (esp_timer_get_time() - t0);
+		modbus_tcp_stats.requests ++;
+		modbus_tcp_stats.service_sum_us += us;
+		if(us > modbus_tcp_stats.service_max_us) modbus_tcp_stats.service_max_us= us;
+
+		if(send(c->sock, response, 7 + n, 0) != 7 + n) return -1;
+		c->last= t0;
+		c->len -= 6 + length;
+		memmove(c->buffer, &c->buffer[6 + length], c->len);
+	}
+	return 0;
+} // modbus_tcp_requests
+
+static void modbus_tcp_accept(int listen_sock)
+{
+	struct sockaddr_storage source_addr;
+	socklen_t addr_len= sizeof(source_addr);
+	int sock= accept(listen_sock, (struct sockaddr *) &source_addr, &addr_len);
+	if(sock < 0) return;
+	for(int i=0; i<MODBUS_TCP_CLIENTS; i++)
+	{
+		modbus_tcp_client_type *c= &modbus_tcp_client[i];
+		if(c->sock >= 0) continue;
+		int opt= 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+		c->sock= sock;
+		c->len= 0;
+		c->last= esp_timer_get_time();
+		modbus_tcp_stats.connections ++;
+		return;
+	}
+	modbus_tcp_stats.rejected ++;
+	ESP_LOGW(TAG, "%d clients already, connection closed", MODBUS_TCP_CLIENTS);
+	close(sock);
+} // modbus_tcp_accept
+
+static void modbus_tcp_task(void *arg)
+{
+	struct sockaddr_in dest_addr= {
+		.sin_family= AF_INET,
+		.sin_port= htons(MODBUS_TCP_PORT),
+		.sin_addr.s_addr= htonl(INADDR_ANY)
+	};
+	int listen_sock= socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+	if(listen_sock < 0)
+	{
+		ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+		vTaskDelete(NULL);
+		return;
+	}
+	int opt= 1;
+	setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if(bind(listen_sock, (struct sockaddr *) &dest_addr, sizeof(dest_addr)) != 0 || listen(listen_sock, 2) != 0)
+	{
+		ESP_LOGE(TAG, "Unable to listen on port %d: errno %d", MODBUS_TCP_PORT, errno);
+		close(listen_sock);
+		vTaskDelete(NULL);
+		return;
+	}
+	ESP_LOGI(TAG, "Listening on port %d", MODBUS_TCP_PORT);
+
+	while(1)
+	{
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(listen_sock, &rfds);
+		int max_fd= listen_sock;
+		for(int i=0; i<MODBUS_TCP_CLIENTS; i++)
+		{
+			if(modbus_tcp_client[i].sock < 0) continue;
+			FD_SET(modbus_tcp_client[i].sock, &rfds);
+			if(modbus_tcp_client[i].sock > max_fd) max_fd= modbus_tcp_client[i].sock;
+		}
+		// wake up every second for the idle clients
+		struct timeval tv= { .tv_sec= 1, .tv_usec= 0 };
+		int r= select(max_fd + 1, &rfds, NULL, NULL, &tv);
+		if(r < 0)
+		{
+			ESP_LOGE(TAG, "select errno %d", errno);
+			vTaskDelay(1000 / portTICK_PERIOD_MS);
+			continue;
+		}
+		int64_t now= esp_timer_get_time();
+		for(int i=0; i<MODBUS_TCP_CLIENTS; i++)
+		{
+			modbus_tcp_client_type *c= &modbus_tcp_client[i];
+			if(c->sock < 0) continue;
+			if(r > 0 && FD_ISSET(c->sock, &rfds))
+			{
+				int n= recv(c->sock, &c->buffer[c->len], sizeof(c->buffer) - c->len, 0);
+				if(n <= 0)
+				{
+					modbus_tcp_close(c);
+					continue;
+				}
+				c->len += n;
+				if(modbus_tcp_requests(c) != 0) modbus_tcp_close(c);
+			}
+			else if(now - c->last > 1000000LL * MODBUS_TCP_IDLE_SEC)
+			{
+				modbus_tcp_stats.idle_closed ++;
+				modbus_tcp_close(c);
+			}
+		}
+		if(r > 0 && FD_ISSET(listen_sock, &rfds)) modbus_tcp_accept(listen_sock);
+	}
+} // modbus_tcp_task
+
+int modbus_tcp_json(char *buffer, size_t sz)
+{
+	modbus_tcp_stats_type *s= &modbus_tcp_stats;
+	int clients= 0;
+	for(int i=0; i<MODBUS_TCP_CLIENTS; i++) if(modbus_tcp_client[i].sock >= 0) clients ++;
+	return snprintf(buffer, sz, "{\"clients\":%d,\"connections\":%lu,\"rejected\":%lu,\"idle\":%lu,\"requests\":%lu,\"bad\":%lu,\"service\":[%ld,%ld]}",
+		clients, s->connections, s->rejected, s->idle_closed, s->requests, s->bad_frames,
+		s->requests ? (int32_t) (s->service_sum_us / s->requests) : 0, s->service_max_us);
+} // modbus_tcp_json
+
+void modbus_tcp_printf(void)
+{
+	modbus_tcp_stats_type *s= &modbus_tcp_stats;
+	int clients= 0;
+	for(int i=0; i<MODBUS_TCP_CLIENTS; i++) if(modbus_tcp_client[i].sock >= 0) clients ++;
+	fprintf(stdout, "\nModbus TCP port %d clients %d connections %lu rejected %lu idle closed %lu", 
+		MODBUS_TCP_PORT, clients, s->connections, s->rejected, s->idle_closed);
+	fprintf(stdout, "\n   requests %lu bad frames %lu service time (us) avg %ld max %ld\n", 
+		s->requests, s->bad_frames, s->requests ? (int32_t) (s->service_sum_us / s->requests) : 0, s->service_max_us);
+} // modbus_tcp_printf
+
+// modbus_slave_init() first
+void modbus_tcp_create(UBaseType_t uxPriority)
+{
+	memset(&modbus_tcp_stats, 0, sizeof(modbus_tcp_stats));
+	for(int i=0; i<MODBUS_TCP_CLIENTS; i++)
+	{
+		modbus_tcp_client[i].sock= -1;
+		modbus_tcp_client[i].len= 0;
+	}
+	xTaskCreate(modbus_tcp_task, "modbus_tcp", 4*1024, NULL, uxPriority, NULL);
+} // modbus_tcp_create
+
+// END OF FILE
\ No newline at end of file
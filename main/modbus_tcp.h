@@ -0,0 +1,26 @@
+#ifndef _MODBUS_TCP_H_
+#define _MODBUS_TCP_H_
+
+#define MODBUS_TCP					1			// 1: Modbus TCP server for the modbus_slave register image
+#define MODBUS_TCP_PORT				502
+#define MODBUS_TCP_CLIENTS			4			// concurrent connections, one more is accepted and closed
+#define MODBUS_TCP_IDLE_SEC			60			// a client silent for this long is closed
+#define MODBUS_TCP_ADU_MAX			260			// MBAP header (7) + PDU (253)
+
+typedef struct modbus_tcp_stats_s
+{
+	uint32_t connections;
+	uint32_t rejected;				// no free client slot
+	uint32_t idle_closed;
+	uint32_t requests;
+	uint32_t bad_frames;			// MBAP protocol identifier or length out of range, connection closed
+	int32_t service_max_us;			// request parsed to response ready
+	int64_t service_sum_us;
+} modbus_tcp_stats_type;
+
+void modbus_tcp_create(UBaseType_t uxPriority);
+int modbus_tcp_json(char *buffer, size_t sz);
+void modbus_tcp_printf(void);
+
+#endif
+// END OF FILE
\ No newline at end of file
@@ -0,0 +1,316 @@
+/** ************************************************************************************************
+ *	MODBUS RTU over UART
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - event driven RX
+ * 	1.1.0 - bus capture (MODBUS_CAPTURE)
+ * 	1.2.0 - bus load and frame quality statistics
+ * 	1.2.1 - frame end time per byte, resync byte count
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+The UART driver is installed with an event queue and the RX task sleeps on it.
+- UART_DATA is posted when the RX FIFO reaches its threshold or when the RX timeout (no new byte 
+  for MODBUS_RTU_RX_TOUT character times) expires. The timeout one is flagged with timeout_flag
+  and marks the end of the frame, so the frame is delivered about one character time after its 
+  last byte instead of on the next poll
+- UART_FIFO_OVF and UART_BUFFER_FULL mean bytes were lost: they are counted, the input is flushed 
+  and the pending frame is discarded. A non-zero count means MODBUS_UART_BUF_SIZE is too small or 
+  the RX task is starved
+Every frame boundary, dropped bytes included, goes through modbus_uart_boundary():
+- stats counts bytes and frames, CRC errors apart from truncated frames, and frames per (slave, 
+  function code). The bytes of bad frames are skipped up to the next silence, where the assembler 
+  resynchronises: they are counted as resync bytes, apart from those lost by the UART
+- the bytes of a read are fed one by one, each with its own end time estimated back from the 
+  read: the last byte of a timeout event arrived MODBUS_RTU_RX_TOUT characters before it, the 
+  last byte of a FIFO threshold event just now, and every byte one character before the next. 
+  A frame ends with the byte that closes it, so frames glued in one read get their own end and 
+  the inter-frame gap is good to a character (1.04 ms at 9600 baud)
+- the bus load (bytes/s, frames/s and line occupancy) is computed over MODBUS_UART_LOAD_WINDOW_MS 
+  windows rolled by modbus_uart_receive(), the per pair rate over MODBUS_UART_RATE_WINDOW_SEC
+- only the received side is seen: on the sniff link that is the whole bus, on a master link the 
+  queries are sent by modbus_master and not heard back
+- with MODBUS_CAPTURE the boundary is recorded by modbus_capture as well
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <string.h>			// memset
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+#include "esp_log.h"		// ESP_LOGW
+#include "esp_timer.h"		// esp_timer_get_time()
+
+#include "modbus.h"
+#include "modbus_uart.h"
+#include "modbus_capture.h"
+
+static const char *TAG = "modbus_uart";
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   STATISTICS
+
+---------------------------------------------------------------------------------------------------
+**/
+static modbus_uart_key_type *modbus_uart_key(modbus_uart_stats_type *s, uint8_t slave, uint8_t function)
+{
+	for(int i=0; i<MODBUS_UART_STATS_KEYS; i++)
+	{
+		modbus_uart_key_type *k= &s->key[i];
+		if(k->frames == 0)
+		{
+			k->slave= slave;
+			k->function= function;
+			return k;
+		}
+		if(k->slave == slave && k->function == function) return k;
+	}
+	return 0;
+} // modbus_uart_key
+
+// Frame boundary from the assembler, delivered or dropped
+static void modbus_uart_boundary(void *arg, const uint8_t *frame, int len, int flags)
+{
+	modbus_uart_type *port= (modbus_uart_type *) arg;
+	modbus_uart_stats_type *s= &port->stats;
+	int64_t now= esp_timer_get_time();
+
+	s->bytes += len;
+	s->load_bytes += len;
+	switch(flags)
+	{
+		case MODBUS_RTU_FRAME_OK:
+		{
+			s->frames ++;
+			s->load_frames ++;
+			modbus_uart_key_type *k= modbus_uart_key(s, frame[0], frame[1] & 0x7F);
+			if(k)
+			{
+				k->frames ++;
+				k->window_frames ++;
+			}
+			else s->key_overflow ++;
+			break;
+		}
+		case MODBUS_RTU_FRAME_CRC:			s->crc_errors ++; break;
+		case MODBUS_RTU_FRAME_TRUNCATED:	s->truncated ++; break;
+		case MODBUS_RTU_FRAME_OVERRUN:		s->overruns ++; break;
+		case MODBUS_RTU_FRAME_LOST:			s->lost ++; break;
+	}
+	if(flags != MODBUS_RTU_FRAME_OK) s->dropped_bytes += len;
+	// lost bytes were flushed with the UART input, the rest were skipped to find the next frame
+	if(flags != MODBUS_RTU_FRAME_OK && flags != MODBUS_RTU_FRAME_LOST) s->resync_bytes += len;
+
+	// the frame ends with the last byte fed
+	int64_t end= port->byte_end;
+	int64_t start= end - (int64_t) len * port->char_us;
+	if(s->last_end)
+	{
+		int64_t gap= start > s->last_end ? start - s->last_end : 0;
+		if(gap < MODBUS_UART_GAP_MAX_US)
+		{
+			if(s->gaps == 0 || gap < s->gap_min_us) s->gap_min_us= gap;
+			if(gap > s->gap_max_us) s->gap_max_us= gap;
+			s->gap_sum_us += gap;
+			s->gaps ++;
+		}
+	}
+	s->last_end= end;
+
+#if MODBUS_CAPTURE
+	modbus_capture_frame(port->uart, frame, len, flags, now);
+#endif
+} // modbus_uart_boundary
+
+// Close the load and rate windows that are due
+static void modbus_uart_window(modbus_uart_type *port, int64_t now)
+{
+	modbus_uart_stats_type *s= &port->stats;
+	if(s->load_start == 0)
+	{
+		s->load_start= now;
+		s->rate_start= now;
+		return;
+	}
+	int64_t elapsed= now - s->load_start;
+	if(elapsed >= MODBUS_UART_LOAD_WINDOW_MS * 1000LL)
+	{
+		s->bytes_per_s= s->load_bytes * 1000000LL / elapsed;
+		s->frames_per_s= s->load_frames * 1000000LL / elapsed;
+		s->occupancy= 100.0f * s->load_bytes * port->char_us / elapsed;
+		if(s->occupancy > s->occupancy_max) s->occupancy_max= s->occupancy;
+		s->load_bytes= 0;
+		s->load_frames= 0;
+		s->load_start= now;
+	}
+	elapsed= now - s->rate_start;
+	if(elapsed >= MODBUS_UART_RATE_WINDOW_SEC * 1000000LL)
+	{
+		for(int i=0; i<MODBUS_UART_STATS_KEYS && s->key[i].frames; i++)
+		{
+			s->key[i].frames_per_min= s->key[i].window_frames * 60000000LL / elapsed;
+			s->key[i].window_frames= 0;
+		}
+		s->rate_start= now;
+	}
+} // modbus_uart_window
+
+int modbus_uart_json(modbus_uart_type *port, char *buffer, size_t sz)
+{
+	modbus_uart_stats_type *s= &port->stats;
+	int len= snprintf(buffer, sz, "{\"uart\":%d,\"bytes\":%lu,\"frames\":%lu,\"crc\":%lu,\"trunc\":%lu,\"overrun\":%lu,\"lost\":%lu,\"dropped\":%lu,\"resync\":%lu,"
+		"\"bps\":%lu,\"fps\":%lu,\"occ\":%.1f,\"occmax\":%.1f,\"gap\":[%lu,%lu,%lu],\"keys\":[",
+		port->uart, s->bytes, s->frames, s->crc_errors, s->truncated, s->overruns, s->lost, s->dropped_bytes, s->resync_bytes,
+		s->bytes_per_s, s->frames_per_s, s->occupancy, s->occupancy_max,
+		s->gap_min_us, s->gaps ? (uint32_t) (s->gap_sum_us / s->gaps) : 0, s->gap_max_us);
+	for(int i=0; i<MODBUS_UART_STATS_KEYS && s->key[i].frames && len < (int) sz; i++)
+	{
+		modbus_uart_key_type *k= &s->key[i];
+		len += snprintf(&buffer[len], sz - len, "%s[%d,%d,%lu,%lu]", i ? ",":"", k->slave, k->function, k->frames, k->frames_per_min);
+	}
+	if(len < (int) sz) len += snprintf(&buffer[len], sz - len, "]}");
+	return len;
+} // modbus_uart_json
+
+// Short form for MQTT: load and quality only
+int modbus_uart_summary_json(modbus_uart_type *port, char *buffer, size_t sz)
+{
+	modbus_uart_stats_type *s= &port->stats;
+	return snprintf(buffer, sz, "{\"uart\":%d,\"bps\":%lu,\"fps\":%lu,\"occ\":%.1f,\"frames\":%lu,\"crc\":%lu,\"trunc\":%lu,\"resync\":%lu,\"gap\":%lu}",
+		port->uart, s->bytes_per_s, s->frames_per_s, s->occupancy, s->frames, s->crc_errors, s->truncated, s->resync_bytes,
+		s->gaps ? (uint32_t) (s->gap_sum_us / s->gaps) : 0);
+} // modbus_uart_summary_json
+
+void modbus_uart_printf(modbus_uart_type *port)
+{
+	modbus_uart_stats_type *s= &port->stats;
+	fprintf(stdout, "\nUART%d %lu bytes %lu frames  CRC errors %lu truncated %lu overruns %lu lost %lu (%lu bytes dropped, %lu to resync)", 
+		port->uart, s->bytes, s->frames, s->crc_errors, s->truncated, s->overruns, s->lost, s->dropped_bytes, s->resync_bytes);
+	fprintf(stdout, "\n   load %lu bytes/s %lu frames/s occupancy %.1f%% (max %.1f%%)  gap (us) min %lu avg %lu max %lu", 
+		s->bytes_per_s, s->frames_per_s, s->occupancy, s->occupancy_max, 
+		s->gap_min_us, s->gaps ? (uint32_t) (s->gap_sum_us / s->gaps) : 0, s->gap_max_us);
+	fprintf(stdout, "\n   FIFO overflows %lu ring buffer full %lu line errors %lu", port->fifo_overflows, port->buffer_full, port->line_errors);
+	for(int i=0; i<MODBUS_UART_STATS_KEYS && s->key[i].frames; i++)
+	{
+		modbus_uart_key_type *k= &s->key[i];
+		fprintf(stdout, "\n   slave %3d fc %02X %8lu frames %5lu/min", k->slave, k->function, k->frames, k->frames_per_min);
+	}
+	if(s->key_overflow) fprintf(stdout, "\n   %lu frames not tracked (more than %d pairs)", s->key_overflow, MODBUS_UART_STATS_KEYS);
+	fprintf(stdout, "\n");
+} // modbus_uart_printf
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   UART
+
+---------------------------------------------------------------------------------------------------
+**/
+
+void modbus_uart_init(modbus_uart_type *port, uart_port_t uart, int baud_rate, int tx_io_num, int rx_io_num, void (*callback) (uint8_t*, int))
+{
+	memset(port, 0, sizeof(modbus_uart_type));
+	port->uart= uart;
+	port->char_us= 10 * 1000000 / baud_rate;
+	modbus_rtu_rx_init(&port->rx, callback);
+	port->rx.capture= modbus_uart_boundary;
+	port->rx.capture_arg= port;
+
+	uart_config_t uart_config = {
+        .baud_rate = baud_rate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+    ESP_ERROR_CHECK(uart_driver_install(uart, MODBUS_UART_BUF_SIZE, 0, MODBUS_UART_QUEUE_SIZE, &port->queue, 0));
+    ESP_ERROR_CHECK(uart_param_config(uart, &uart_config));
+	// esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num)
+    ESP_ERROR_CHECK(uart_set_pin(uart, tx_io_num, rx_io_num, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+	// RX timeout (frame end) 
+	ESP_ERROR_CHECK(uart_set_rx_timeout(uart, MODBUS_RTU_RX_TOUT));
+} // modbus_uart_init
+
+// Switch the line rate, call with the bus idle
+// The assembler belongs to the RX task: bytes still pending from the old rate are dropped at the next gap
+void modbus_uart_set_baudrate(modbus_uart_type *port, int baud_rate)
+{
+	ESP_ERROR_CHECK(uart_set_baudrate(port->uart, baud_rate));
+	port->char_us= 10 * 1000000 / baud_rate;
+	port->stats.last_end= 0;
+	uart_flush_input(port->uart);
+} // modbus_uart_set_baudrate
+
+// Bytes were lost: whatever is pending cannot be a valid frame
+static void modbus_uart_discard(modbus_uart_type *port)
+{
+	uart_flush_input(port->uart);
+	xQueueReset(port->queue);
+	modbus_rtu_rx_discard(&port->rx);
+} // modbus_uart_discard
+
+// Wait for the next UART event and process it
+// Frames are delivered through the callback given to modbus_uart_init()
+// return	the modbus_rtu_rx_gap() result when a frame end was detected, 0 otherwise
+int modbus_uart_receive(modbus_uart_type *port)
+{
+	uint8_t data[64];
+	uart_event_t event;
+	int r= 0;
+	
+	modbus_uart_window(port, esp_timer_get_time());
+	if(xQueueReceive(port->queue, &event, MODBUS_UART_IDLE_MS / portTICK_PERIOD_MS) != pdTRUE)
+	{
+		// Safety net: a frame whose last byte did not raise the RX timeout
+		return modbus_rtu_rx_gap(&port->rx);
+	}
+	switch(event.type)
+	{
+		case UART_DATA:
+		{
+			// end time of the last byte of the event
+			int64_t now= esp_timer_get_time();
+			if(event.timeout_flag) now -= MODBUS_RTU_RX_TOUT * port->char_us;
+			size_t pending= event.size;
+			while(pending > 0)
+			{
+				int rxBytes= uart_read_bytes(port->uart, data, pending < sizeof(data) ? pending : sizeof(data), 0);
+				if(rxBytes <= 0) break;
+				pending -= rxBytes;
+				// one at a time: a frame closed in the middle of the read sees its own end time
+				for(int i=0; i<rxBytes; i++)
+				{
+					port->byte_end= now - (int64_t) (pending + rxBytes - 1 - i) * port->char_us;
+					modbus_rtu_rx_feed(&port->rx, &data[i], 1);
+				}
+			}
+			if(event.timeout_flag) r= modbus_rtu_rx_gap(&port->rx);
+			break;
+		}
+		case UART_FIFO_OVF:
+			port->fifo_overflows ++;
+			ESP_LOGW(TAG, "UART%d FIFO overflow (%lu)", port->uart, port->fifo_overflows);
+			modbus_uart_discard(port);
+			break;
+		case UART_BUFFER_FULL:
+			port->buffer_full ++;
+			ESP_LOGW(TAG, "UART%d ring buffer full (%lu)", port->uart, port->buffer_full);
+			modbus_uart_discard(port);
+			break;
+		case UART_BREAK:
+		case UART_FRAME_ERR:
+		case UART_PARITY_ERR:
+			port->line_errors ++;
+			break;
+		default:
+			break;
+	}
+	return r;
+} // modbus_uart_receive
+
+// END OF FILE
\ No newline at end of file
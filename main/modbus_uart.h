@@ -0,0 +1,72 @@
+#ifndef _MODBUS_UART_H_
+#define _MODBUS_UART_H_
+
+#define MODBUS_UART_BUF_SIZE		256		// driver RX ring buffer
+#define MODBUS_UART_QUEUE_SIZE		20		// driver event queue
+#define MODBUS_UART_IDLE_MS			100		// no event for this long closes any pending frame
+
+#define MODBUS_UART_STATS_KEYS		16		// (slave, function code) pairs tracked per port
+#define MODBUS_UART_LOAD_WINDOW_MS	1000	// bus load window
+#define MODBUS_UART_RATE_WINDOW_SEC	60		// per (slave, function code) rate window
+#define MODBUS_UART_GAP_MAX_US		1000000	// longer silences are idle time, not inter-frame gaps
+
+typedef struct modbus_uart_key_s
+{
+	uint8_t slave;
+	uint8_t function;				// exception responses are counted under the requested code
+	uint32_t frames;
+	uint32_t window_frames;
+	uint32_t frames_per_min;		// last MODBUS_UART_RATE_WINDOW_SEC window
+} modbus_uart_key_type;
+
+typedef struct modbus_uart_stats_s
+{
+	uint32_t bytes;					// every byte seen at a frame boundary
+	uint32_t frames;				// delivered
+	uint32_t crc_errors;			// complete length, bad CRC
+	uint32_t truncated;				// shorter than the header says
+	uint32_t overruns;
+	uint32_t lost;					// frames discarded after a FIFO overflow / ring buffer full
+	uint32_t dropped_bytes;			// bytes of the above
+	uint32_t resync_bytes;			// bytes skipped by the assembler up to the next silence (CRC, truncated, overrun)
+	// inter-frame gap (estimated from the byte end times, modbus_uart_type.byte_end)
+	int64_t last_end;
+	uint32_t gap_min_us;
+	uint32_t gap_max_us;
+	uint64_t gap_sum_us;
+	uint32_t gaps;
+	// bus load
+	int64_t load_start;
+	uint32_t load_bytes;
+	uint32_t load_frames;
+	uint32_t bytes_per_s;
+	uint32_t frames_per_s;
+	float occupancy;				// % of the line time, last window
+	float occupancy_max;
+	int64_t rate_start;
+	modbus_uart_key_type key[MODBUS_UART_STATS_KEYS];
+	uint32_t key_overflow;			// frames of pairs that did not fit in key[]
+} modbus_uart_stats_type;
+
+typedef struct modbus_uart_s
+{
+	uart_port_t uart;
+	QueueHandle_t queue;			// UART driver event queue
+	modbus_rtu_rx_type rx;			// frame assembler
+	uint32_t fifo_overflows;		// UART_FIFO_OVF
+	uint32_t buffer_full;			// UART_BUFFER_FULL
+	uint32_t line_errors;			// UART_FRAME_ERR, UART_PARITY_ERR, UART_BREAK
+	uint32_t char_us;				// one character (start, 8 data, stop) on the line
+	int64_t byte_end;				// estimated end time of the last byte fed to the assembler
+	modbus_uart_stats_type stats;
+} modbus_uart_type;
+
+void modbus_uart_init(modbus_uart_type *port, uart_port_t uart, int baud_rate, int tx_io_num, int rx_io_num, void (*callback) (uint8_t*, int));
+int modbus_uart_receive(modbus_uart_type *port);
+void modbus_uart_set_baudrate(modbus_uart_type *port, int baud_rate);
+int modbus_uart_json(modbus_uart_type *port, char *buffer, size_t sz);
+int modbus_uart_summary_json(modbus_uart_type *port, char *buffer, size_t sz);
+void modbus_uart_printf(modbus_uart_type *port);
+
+#endif
+// END OF FILE
\ No newline at end of file
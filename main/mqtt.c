@@ -6,6 +6,7 @@
  * 	1.1.0 - January 2025
  *		- Adapted to ESP IDF (plain C language)
  *      - int(*f)(char*,size_t)
+ * 	1.2.0 - PUBLISH Remaining Length encoded as a variable byte integer
  *
  ** ************************************************************************************************
 **/
@@ -21,6 +22,22 @@
 
 ---------------------------------------------------------------------------------------------------
 **/
+// Remaining Length of the fixed header: variable byte integer, 7 bits per byte, least significant 
+// first, bit 7 set when another byte follows (127 -> 7F, 128 -> 80 01, 321 -> C1 02)
+// return	bytes written
+static size_t mqtt_remaining_length(uint8_t *p, size_t length)
+{
+	size_t n= 0;
+	do
+	{
+		uint8_t b= length % 128;
+		length /= 128;
+		if(length) b |= 0x80;
+		p[n++]= b;
+	} while(length);
+	return n;
+} // mqtt_remaining_length
+
 int mqtt_connect(int(*f)(char*,size_t))
 {
 	mqtt_connect_message_type connect_m = MQTT_CONNECT_DEFAULT_MESSAGE();
@@ -29,17 +46,21 @@ int mqtt_connect(int(*f)(char*,size_t))
 
 int mqtt_publish(int(*f)(char*,size_t), const char *topic, const char *message)
 {
-	mqtt_publish_message_type publish_m = MQTT_PUBLISH_DEFAULT_MESSAGE();
-	uint8_t topic_length= (uint8_t)strlen(topic);
-	publish_m.Topic_Name_Length= ENDIAN((uint16_t)topic_length);
-	uint8_t i=0;
-// C++	for(uint8_t j=0; j<topic_length    && i<sizeof(mqtt_publish_message_type::variable); i++, j++) publish_m.variable[i]= topic[j];
-	for(uint8_t j=0; j<topic_length    && i<PUBLISH_VARIABLE_SIZE; i++, j++) publish_m.variable[i]= topic[j];
-// C++	for(uint8_t j=0; j<strlen(message) && i<sizeof(mqtt_publish_message_type::variable); i++, j++) publish_m.variable[i]= message[j];
-	for(uint8_t j=0; j<strlen(message) && i<PUBLISH_VARIABLE_SIZE; i++, j++) publish_m.variable[i]= message[j];
-	publish_m.Remaining_Length= 2 + i;
-	uint8_t n= 2 + publish_m.Remaining_Length;
-	return f((char*)&publish_m, n);
+	uint8_t packet[PUBLISH_FIXED_HEADER_SIZE + 2 + PUBLISH_VARIABLE_SIZE];
+	size_t topic_length= strlen(topic);
+	size_t message_length= strlen(message);
+	// topic & message, not sent at all rather than truncated
+	if(topic_length + message_length > PUBLISH_VARIABLE_SIZE) return -1;
+	size_t remaining= 2 + topic_length + message_length;
+	packet[0]= (PUBLISH << 4) & 0xF0;
+	size_t n= 1 + mqtt_remaining_length(&packet[1], remaining);
+	packet[n++]= (uint8_t) (topic_length >> 8);
+	packet[n++]= (uint8_t) topic_length;
+	memcpy(&packet[n], topic, topic_length);
+	n += topic_length;
+	memcpy(&packet[n], message, message_length);
+	n += message_length;
+	return f((char*)packet, n);
 } // mqtt_publish()
 
 int mqtt_ping(int(*f)(char*,size_t))
@@ -90,26 +90,14 @@ typedef struct mqtt_connect_s
 **/
 //  1  2  1  2  3  4  5  6  7  8  9 10 11 12
 // 30 6A 00 15 7A 69 67 62 65 65 32 6D 71 74 74 2F   
-#define MQTT_PUBLISH_DEFAULT_MESSAGE() 							\
-    {                         									\
-        .Control_Packet_type =   ((PUBLISH << 4) & 0xF0), 		\
-        .Remaining_Length =      0x00,  						\
-        .Topic_Name_Length =     0,        						\
-     }
-#define PUBLISH_VARIABLE_SIZE	252	 
-typedef struct mqtt_publish_s
-{
-	//  PINGREQ Packet fixed header 
-	uint8_t Control_Packet_type;			// byte 1
-	uint8_t Remaining_Length;				// byte 2
-	// Variable header 
-	// 		Topic Name 
-	// 		Packet Identifier - only present in PUBLISH Packets where the QoS level is 1 or 2.
-	uint16_t Topic_Name_Length;				// bytes 1..2
-	// Payload
-	//		The Payload contains the Application Message that is being published
-	uint8_t variable[PUBLISH_VARIABLE_SIZE]; // topic & message
-} mqtt_publish_message_type;
+// 30 A4 01 00 1E 7A 69 67 62 65 65 32 6D 71 74 74    Remaining Length over 127 takes 2 bytes
+// PUBLISH Packet
+// (1) fixed header				Control Packet type, Remaining Length (1 to 4 bytes, variable byte integer)
+// (2) Variable header			Topic Name Length (MSB, LSB), Topic Name
+//								Packet Identifier - only present in PUBLISH Packets where the QoS level is 1 or 2.
+// (3) Payload					The Application Message that is being published
+#define PUBLISH_FIXED_HEADER_SIZE	3		// Remaining Length up to 16383, PUBLISH_VARIABLE_SIZE fits in 2 bytes
+#define PUBLISH_VARIABLE_SIZE		252		// topic & message
 
 
 /**
@@ -3,6 +3,8 @@
  *  (c) Fernando R (iambobot.com)
  *
  * 	1.0.0 - December 2025 - created
+ * 	1.1.0 - binary streamed responses (network_server_stream)
+ * 			several stream types
  *
  ** ************************************************************************************************
 **/
@@ -17,6 +19,7 @@ static const char *TAG = "webserver";
 // Test Rest API interface
 // curl  -X GET http://192.168.1.110:80 -d '{"type":"data_request","key":"qWpJnwA0crlmgv"}'
 // curl  -X GET http://192.168.1.110:80 -d '{"type":"device_info","key":"qWpJnwA0crlmgv"}'
+// curl  -X GET http://192.168.1.110:80 -d '{"type":"capture","key":"qWpJnwA0crlmgv"}' -o bus.pcap
 
 /**
 ---------------------------------------------------------------------------------------------------
@@ -36,10 +39,46 @@ static int (*NetworkServerCallback) (char*,char*,size_t)= 0;
 static char httpdata[1024];
 static char response[512];
 
+// Streamed response: content of unknown length, the connection is closed at the end
+typedef struct network_server_stream_s
+{
+	const char *type;
+	const char *content_type;
+	int (*callback) (int (*write) (const void*, size_t, void*), void *ctx);
+} network_server_stream_type;
+
+static network_server_stream_type streams[SERVER_STREAMS];
+static int streams_n= 0;
+static network_server_stream_type *stream= 0;		// of the request being answered
+
+void network_server_stream(const char *type, const char *content_type, int (*callback) (int (*write) (const void*, size_t, void*), void *ctx))
+{
+	if(streams_n == SERVER_STREAMS) return;
+	streams[streams_n].type= type;
+	streams[streams_n].content_type= content_type;
+	streams[streams_n].callback= callback;
+	streams_n ++;
+} // network_server_stream
+
+static int stream_write(const void *data, size_t len, void *ctx)
+{
+	int sock= *(int *) ctx;
+	const char *p= (const char *) data;
+	while(len > 0)
+	{
+		int n= send(sock, p, len, 0);
+		if(n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+} // stream_write
+
 // Process payload and return response
 // payload is a json message with "type" and "key"
 // {"type":"....","key":"...", ....... }'
 // key is a server/client shared string defined in .h file
+// return	0 response ready, 1 streamed response (network_server_stream), -1 no response
 int server_response()
 {
 	response[0]='\0';
@@ -71,6 +110,14 @@ int server_response()
 	jsonParseValue("type", payload, 0, payload_length, value, sizeof(value));
 	cstr_replace(value,'"','\0');
 	
+	for(int i=0; i<streams_n; i++)
+	{
+		if(strcmp(value, streams[i].type)==0) 
+		{
+			stream= &streams[i];
+			return 1;
+		}
+	}
 	if(NetworkServerCallback) NetworkServerCallback (value, response, sizeof(response));
 #endif
 	return 0;
@@ -170,7 +217,22 @@ void tcp_server_task(void *pvParameters)
 			
 			// ------------------------------------------------------------------------
 			
-			if( server_response() == 0)
+			int r= server_response();
+			if(r == 1)
+			{
+				snprintf(httpdata, sizeof(httpdata),
+				"HTTP/1.1 200 OK\r\n"
+				"Server: %s\r\n"					// SERVER_NAME
+				"Content-Type: %s\r\n"
+				"Connection: close\r\n"
+				"\r\n",
+				SERVER_NAME,
+				stream->content_type);
+				int n= -1;
+				if(stream_write(httpdata, strlen(httpdata), &sock) == 0) n= stream->callback(stream_write, &sock);
+				fprintf(stdout,"\nResponse streamed %s %d", stream->type, n);
+			}
+			else if(r == 0)
 			{
 				snprintf(httpdata, sizeof(httpdata),
 				"HTTP/1.1 200 OK\r\n"
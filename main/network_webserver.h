@@ -10,9 +10,11 @@
 #define SERVER_NAME		        "modbus2MQTT/1.0"
 #define SERVER_CONTENT_TYPE     "application/json"
 #define SECURE_KEY		    	"qWpJnwA0crlmgv"
+#define SERVER_STREAMS			4		// streamed response types (network_server_stream)
 
 
 void network_server_create(int (*callback) (char*, char*, size_t), UBaseType_t);
+void network_server_stream(const char *type, const char *content_type, int (*callback) (int (*write) (const void*, size_t, void*), void *ctx));
 
 #endif
 // END OF FILE
\ No newline at end of file
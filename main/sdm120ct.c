@@ -2,6 +2,11 @@
  *	SDM120CT  
  *  (c) Fernando R (iambobot.com)
  * 	1.0.0 - April 2025
+ * 	1.1.0 - master transactions, multi-rate scheduler, baud rate negotiation, passive first
+ * 			measurements behind a seqlock (SDM120CT_data_get)
+ * 			measurement store: capture time, updates and staleness of every field
+ * 			sample hook: every decoded value (SDM120CT_data_hook)
+ * 			next read released by the master idle hook
  *
  ** ************************************************************************************************
 **/
@@ -58,6 +63,8 @@ power factor indicates that some of the power is reactive.
 #include <string.h>		// memcpy
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
@@ -65,13 +72,31 @@ power factor indicates that some of the power is reactive.
 
 #include "config.h"
 #include "modbus.h"
+#include "modbus_uart.h"
+#include "modbus_master.h"
+#include "seqlock.h"
+#include "measurement.h"
 #include "sdm120ct.h"
 
 static void (*SDM120CT_callback) (SDM120CT_sequence_phase_t SDM120CT_sequence_phase)= 0;
 
 SDM120CT_sequence_phase_t SDM120CT_sequence_phase;
 SDM120CT_device_info_type SDM120CT_device_info;
-SDM120CT_data_type SDM120CT_data;
+// Written by the master task (and the RX task in passive first), read with SDM120CT_data_get()
+static SDM120CT_data_type SDM120CT_data;
+// Stale after SDM120CT_STALE_PERIODS periods of the refresh class reading the field (SDM120CT_create)
+static measurement_field_type SDM120CT_fields[]= {
+	MEASUREMENT_FIELD(SDM120CT_data_type, Voltage,				0),
+	MEASUREMENT_FIELD(SDM120CT_data_type, Current,				0),
+	MEASUREMENT_FIELD(SDM120CT_data_type, ApparentPower,		0),
+	MEASUREMENT_FIELD(SDM120CT_data_type, ActivePower,			0),
+	MEASUREMENT_FIELD(SDM120CT_data_type, ReactivePower,		0),
+	MEASUREMENT_FIELD(SDM120CT_data_type, PowerFactor,			0),
+	MEASUREMENT_FIELD(SDM120CT_data_type, Frecuency,			0),
+	MEASUREMENT_FIELD(SDM120CT_data_type, ImportActiveEnergy,	0),
+	MEASUREMENT_FIELD(SDM120CT_data_type, ExportActiveEnergy,	0),
+};
+static measurement_store_type SDM120CT_store;
 
 /**
 ---------------------------------------------------------------------------------------------------
@@ -80,23 +105,15 @@ SDM120CT_data_type SDM120CT_data;
 
 ---------------------------------------------------------------------------------------------------
 **/
-static const int RX_BUF_SIZE = 128;
+void SDM120CT_frame(uint8_t* data, int len);
+static modbus_uart_type SDM120CT_uart;
 // SDM120CT
 void SDM120CT_uart_init(void) 
 {
 	// UART 1
-	uart_config_t uart_config_1 = {
-        .baud_rate = 9600,
-        .data_bits = UART_DATA_8_BITS,
-        .parity    = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_DEFAULT,
-    };
-    ESP_ERROR_CHECK(uart_driver_install(UART_NUM_1, RX_BUF_SIZE * 2, 0, 0, NULL, 0));
-    ESP_ERROR_CHECK(uart_param_config(UART_NUM_1, &uart_config_1));
-	// esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num)
-    ESP_ERROR_CHECK(uart_set_pin(UART_NUM_1, GPIO_NUM_14, GPIO_NUM_13, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+	// TX GPIO 14, RX GPIO 13
+	// SDM120CT_baudrate_startup() finds the meter rate and may switch to a higher one
+	modbus_uart_init(&SDM120CT_uart, UART_NUM_1, SDM120CT_BAUDRATE, GPIO_NUM_14, GPIO_NUM_13, SDM120CT_frame);
 } // SDM120CT_uart_init()
 
 /**
@@ -106,54 +123,98 @@ void SDM120CT_uart_init(void)
 
 ---------------------------------------------------------------------------------------------------
 **/
-void SDM120CT_rxdata_process (uint16_t query, uint8_t* data)
+// Register maps, sorted by register address
+// Device info: function code 03, holding parameters
+static const modbus_register_map_type SDM120CT_deviceinfo_map[]= {
+	MODBUS_REGISTER(SDM120CT_REG_METERID,			MODBUS_FLOAT32, 1.0, SDM120CT_device_info_type, MeterID),
+	MODBUS_REGISTER(SDM120CT_REG_BAUDRATE,			MODBUS_FLOAT32, 1.0, SDM120CT_device_info_type, Baudrate),
+	// 4 bytes / unsigned int32
+	// 01 03 04 01 CC 57 A6 85 BA
+	MODBUS_REGISTER(SDM120CT_REG_SERIALNUMBER,		MODBUS_UINT32,  1.0, SDM120CT_device_info_type, Serialnumber),
+	// 2 bytes Hex
+	// 01 03 04 00 21 00 00 AA 39 
+	MODBUS_REGISTER(SDM120CT_REG_METERCODE,			MODBUS_HEX16,   1.0, SDM120CT_device_info_type, MeterCODE),
+	// 2 bytes Hex
+	//  01 03 04 00 00 00 00 FA 33
+	MODBUS_REGISTER(SDM120CT_REG_SOFTWAREVERSION,	MODBUS_HEX16,   1.0, SDM120CT_device_info_type, SoftwareVersion),
+};
+
+// Measurements: function code 04, input parameters
+// One map per refresh class (SDM120CT_refresh_class)
+// Fast: what appliance switching depends on
+static const modbus_register_map_type SDM120CT_fast_map[]= {
+	MODBUS_REGISTER(SDM120CT_REG_ACTIVEPOWER,		MODBUS_FLOAT32, 1.0, SDM120CT_data_type, ActivePower),
+};
+// Normal: the published measurements
+static const modbus_register_map_type SDM120CT_data_map[]= {
+	MODBUS_REGISTER(SDM120CT_REG_VOLTAGE,			MODBUS_FLOAT32, 1.0, SDM120CT_data_type, Voltage),
+	MODBUS_REGISTER(SDM120CT_REG_CURRENT,			MODBUS_FLOAT32, 1.0, SDM120CT_data_type, Current),
+	MODBUS_REGISTER(SDM120CT_REG_APPARENTPOWER,		MODBUS_FLOAT32, 1.0, SDM120CT_data_type, ApparentPower),
+	MODBUS_REGISTER(SDM120CT_REG_REACTIVEPOWER,		MODBUS_FLOAT32, 1.0, SDM120CT_data_type, ReactivePower),
+	MODBUS_REGISTER(SDM120CT_REG_POWERFACTOR,		MODBUS_FLOAT32, 1.0, SDM120CT_data_type, PowerFactor),
+	MODBUS_REGISTER(SDM120CT_REG_FRECUENCY,			MODBUS_FLOAT32, 1.0, SDM120CT_data_type, Frecuency),
+};
+// Slow: energy counters
+static const modbus_register_map_type SDM120CT_slow_map[]= {
+	MODBUS_REGISTER(SDM120CT_REG_IMPOERACTIVEENERGY,	MODBUS_FLOAT32, 1.0, SDM120CT_data_type, ImportActiveEnergy),
+	MODBUS_REGISTER(SDM120CT_REG_EXPORTACTIVEENERGY,	MODBUS_FLOAT32, 1.0, SDM120CT_data_type, ExportActiveEnergy),
+};
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   REFRESH CLASSES
+
+---------------------------------------------------------------------------------------------------
+Each class has a period and a priority. At every period the reads of the class are released with 
+the deadline release + period, and the scheduler sends the due read with the earliest deadline 
+first (higher priority on a tie). A read completed after its deadline, or a class released again
+while its previous reads are still pending, is a deadline miss.
+**/
+typedef struct SDM120CT_refresh_class_s
+{
+	const char *name;
+	uint32_t period_ms;
+	uint8_t priority;							// higher first when deadlines tie
+	const modbus_register_map_type *map;
+	int map_n;
+	int64_t release;							// next release (us)
+	int pending;								// reads of the current release not yet completed
+	uint32_t cycles;
+	uint32_t deadline_misses;
+} SDM120CT_refresh_class_type;
+
+#define SDM120CT_CLASS_FAST			0
+#define SDM120CT_CLASS_NORMAL		1			// SDM120CT_callback() when its reads complete
+#define SDM120CT_CLASS_SLOW			2
+#define SDM120CT_REFRESH_CLASSES	3
+
+static SDM120CT_refresh_class_type SDM120CT_refresh_class[SDM120CT_REFRESH_CLASSES]= {
+	{"fast",	SDM120CT_FAST_REFRESH_MS,			2, SDM120CT_fast_map, MODBUS_REGISTER_MAP_SIZE(SDM120CT_fast_map), 0, 0, 0, 0},
+	{"normal",	SDM120CT_DATA_REFRESH_SEC * 1000,	1, SDM120CT_data_map, MODBUS_REGISTER_MAP_SIZE(SDM120CT_data_map), 0, 0, 0, 0},
+	{"slow",	SDM120CT_SLOW_REFRESH_SEC * 1000,	0, SDM120CT_slow_map, MODBUS_REGISTER_MAP_SIZE(SDM120CT_slow_map), 0, 0, 0, 0},
+};
+
+// Decode a response to a read starting at register query
+void SDM120CT_rxdata_process (uint8_t function, uint16_t query, uint8_t* data)
 {
+	uint16_t count= data[2] / 2;
 	// device info
-	if(SDM120CT_sequence_phase == INFO)
-	{
-		switch(query)
-		{
-			case SDM120CT_REG_METERID:	
-				SDM120CT_device_info.MeterID= record2float(data+3); 
-				break;		
-			case SDM120CT_REG_BAUDRATE: 
-				SDM120CT_device_info.Baudrate= record2float(data+3);
-				break;
-			// 4 bytes / unsigned int32
-			// 01 03 04 01 CC 57 A6 85 BA
-			case SDM120CT_REG_SERIALNUMBER: 
-			{
-				float value= record2float(data+3);
-				SDM120CT_device_info.Serialnumber= *(uint32_t*) &value;
-				break;
-			}
-			// 2 bytes Hex
-			// 01 03 04 00 21 00 00 AA 39 
-			case SDM120CT_REG_METERCODE: 
-				SDM120CT_device_info.MeterCODE= ENDIAN( *(uint16_t *)&(data[3]) ); 
-				break;
-			// 2 bytes Hex
-			//  01 03 04 00 00 00 00 FA 33
-			case SDM120CT_REG_SOFTWAREVERSION: 
-				SDM120CT_device_info.SoftwareVersion= ENDIAN( *(uint16_t *)&(data[3]) ); 
-				break;
-		}	
-	}
+	if(function == SDM120CT_FC_READHOLDING)
+		modbus_decode_block(SDM120CT_deviceinfo_map, MODBUS_REGISTER_MAP_SIZE(SDM120CT_deviceinfo_map), query, data + 3, count, &SDM120CT_device_info);
 	// Measurements
+	// a block read for one class may cover registers of the others as well
 	else
 	{
-		float value= record2float(data+3);
-		if(_VERBOSE_) fprintf(stdout, "\nvalue %3.2f", value);	
-		switch(query)
-		{
-			case SDM120CT_REG_VOLTAGE: 			SDM120CT_data.Voltage= value; 		break;
-			case SDM120CT_REG_CURRENT: 			SDM120CT_data.Current= value; 		break;
-			case SDM120CT_REG_ACTIVEPOWER: 		SDM120CT_data.ActivePower= value; 	break;
-			case SDM120CT_REG_APPARENTPOWER: 	SDM120CT_data.ApparentPower= value; break;
-			case SDM120CT_REG_REACTIVEPOWER: 	SDM120CT_data.ReactivePower= value; break;
-			case SDM120CT_REG_POWERFACTOR: 		SDM120CT_data.PowerFactor= value; 	break;
-			case SDM120CT_REG_FRECUENCY: 		SDM120CT_data.Frecuency= value; 	break;
-		}
+		int n= 0;
+		int64_t now= esp_timer_get_time();
+		measurement_samples_type samples= {.n= 0};
+		seqlock_write_begin(&SDM120CT_store.lock);
+		for(int c=0; c<SDM120CT_REFRESH_CLASSES; c++)
+			n += measurement_store_decode(&SDM120CT_store, SDM120CT_refresh_class[c].map, SDM120CT_refresh_class[c].map_n, query, data + 3, count, now, &samples);
+		seqlock_write_end(&SDM120CT_store.lock);
+		measurement_store_samples(&SDM120CT_store, &samples);
+		if(_VERBOSE_) fprintf(stdout, "\nregister %04X %d values", query, n);	
 	}
 } // SDM120CT_rxdata_process
 
@@ -164,130 +225,643 @@ void SDM120CT_rxdata_process (uint16_t query, uint8_t* data)
 
 ---------------------------------------------------------------------------------------------------
 **/
-int64_t t0;
-int SDM120CT_query_index;
-uint16_t *SDM120CT_query_list;
-const uint16_t SDM120CT_data_query_list[]= {SDM120CT_REG_VOLTAGE, SDM120CT_REG_CURRENT, SDM120CT_REG_ACTIVEPOWER, SDM120CT_REG_APPARENTPOWER, SDM120CT_REG_REACTIVEPOWER, SDM120CT_REG_POWERFACTOR, SDM120CT_REG_FRECUENCY, 0xFFFF};
-const uint16_t SDM120CT_deviceinfo_query_list[]= {SDM120CT_REG_METERID, SDM120CT_REG_BAUDRATE, SDM120CT_REG_SERIALNUMBER, SDM120CT_REG_METERCODE, SDM120CT_REG_SOFTWAREVERSION, 0xFFFF};
-// int SDM120CT_send_query();
+static modbus_master_type SDM120CT_master;
+static TaskHandle_t SDM120CT_TX_handle;
+
+// Device info query list, built by SDM120CT_plan() from the register map and terminated by start 0xFFFF
+modbus_read_request_type SDM120CT_deviceinfo_query_list[SDM120CT_PLAN_MAX + 1]= {{0xFFFF, 0}};
 
-int SDM120CT_send_query()
+// Measurement reads of all the refresh classes, built by SDM120CT_plan()
+// With SDM120CT_BLOCK_READ the normal class is one FC04 read for 0x0000..0x001F (voltage to power
+// factor) and one for the frequency: 2 round trips instead of 6 and all the values from the same moment
+#define SDM120CT_READ_IDLE			0
+#define SDM120CT_READ_DUE			1
+#define SDM120CT_READ_BUSY			2
+
+typedef struct SDM120CT_read_s
+{
+	modbus_read_request_type request;
+	uint8_t refresh;					// SDM120CT_refresh_class index
+	volatile uint8_t state;				// SDM120CT_READ_xxx
+	int64_t deadline;					// us
+} SDM120CT_read_type;
+
+static SDM120CT_read_type SDM120CT_reads[SDM120CT_PLAN_MAX * SDM120CT_REFRESH_CLASSES];
+static int SDM120CT_reads_n;
+static volatile int SDM120CT_read_failures;				// consecutive, reset by any response
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   PASSIVE FIRST
+
+---------------------------------------------------------------------------------------------------
+With SDM120CT_PASSIVE_FIRST the bus may have another master (a logger, the inverter) polling the 
+meter. Every frame goes through a passive sniffer as well as the master; the responses to the other 
+master's requests are decoded into SDM120CT_data and stamp the registers of interest in 
+SDM120CT_sniff_image, one block per register of the maps.
+- the task listens SDM120CT_PASSIVE_LISTEN_SEC before sending anything. With foreign traffic heard 
+  at SDM120CT_BAUDRATE the rate scan and the negotiation are skipped, changing the rate would cut 
+  the other master off
+- when a class is released, a read whose registers were all sniffed within the class period plus 
+  SDM120CT_PASSIVE_GRACE_MS is not sent. A class with all its reads covered completes on the spot
+- only what nobody else reads, or what has gone stale, is queried, and the master waits for the bus 
+  to be silent MODBUS_MASTER_TURNAROUND_MS after any frame
+Our own requests are not heard back (half-duplex transceiver), so the responses to them do not 
+match any request in the sniffer and never count as sniffed.
+**/
+#if SDM120CT_PASSIVE_FIRST
+static modbus_sniffer_type SDM120CT_sniffer;
+static modbus_image_type SDM120CT_sniff_image;
+static modbus_image_block_type SDM120CT_sniff_block[16];
+static uint8_t SDM120CT_sniff_storage[sizeof(SDM120CT_sniff_block) / sizeof(SDM120CT_sniff_block[0]) * 4];
+static portMUX_TYPE SDM120CT_sniff_lock= portMUX_INITIALIZER_UNLOCKED;
+static volatile uint32_t SDM120CT_sniffed;					// foreign transactions of the meter
+static uint32_t SDM120CT_sniff_skipped;						// reads not sent
+
+// Transaction of another master (RX task)
+static void SDM120CT_sniff_transaction(const modbus_sniffer_transaction_type *t, void *arg)
 {
-	if(SDM120CT_query_index<0 || SDM120CT_query_list[SDM120CT_query_index] == 0xFFFF)
+	if(t->slave != SDM120CT_MODBUS_ADDRESS || t->function != SDM120CT_FC_READINPUT || t->exception) return;
+	measurement_samples_type samples= {.n= 0};
+	seqlock_write_begin(&SDM120CT_store.lock);
+	for(int c=0; c<SDM120CT_REFRESH_CLASSES; c++)
+		measurement_store_decode(&SDM120CT_store, SDM120CT_refresh_class[c].map, SDM120CT_refresh_class[c].map_n, t->start, t->data, t->count, t->response_time, &samples);
+	seqlock_write_end(&SDM120CT_store.lock);
+	measurement_store_samples(&SDM120CT_store, &samples);
+	taskENTER_CRITICAL(&SDM120CT_sniff_lock);
+	modbus_image_store(&SDM120CT_sniff_image, t->start, t->data, t->count, t->response_time);
+	taskEXIT_CRITICAL(&SDM120CT_sniff_lock);
+	SDM120CT_sniffed ++;
+} // SDM120CT_sniff_transaction
+
+// One image block per register of the measurement maps
+static void SDM120CT_sniff_plan(void)
+{
+	int n= 0;
+	const int n_max= sizeof(SDM120CT_sniff_block) / sizeof(SDM120CT_sniff_block[0]);
+	for(int c=0; c<SDM120CT_REFRESH_CLASSES; c++)
 	{
-		if(SDM120CT_query_list[SDM120CT_query_index] == 0xFFFF) 
-			//SDM120CT_querylist_done();
-			SDM120CT_callback(SDM120CT_sequence_phase);
-		SDM120CT_query_index= -1;
-		int r= (SDM120CT_sequence_phase == INFO) ? 1 : 0;
+		SDM120CT_refresh_class_type *rc= &SDM120CT_refresh_class[c];
+		for(int i=0; i<rc->map_n && n<n_max; i++)
+		{
+			// sorted insert
+			modbus_image_block_type b= MODBUS_IMAGE_BLOCK(rc->map[i].reg, modbus_register_width(rc->map[i].type));
+			int j= n++;
+			for(; j>0 && SDM120CT_sniff_block[j - 1].start > b.start; j--) SDM120CT_sniff_block[j]= SDM120CT_sniff_block[j - 1];
+			SDM120CT_sniff_block[j]= b;
+		}
+	}
+	modbus_image_init(&SDM120CT_sniff_image, SDM120CT_MODBUS_ADDRESS, SDM120CT_sniff_block, n, SDM120CT_sniff_storage);
+} // SDM120CT_sniff_plan
+
+// Every register of the class in read r sniffed recently enough
+static bool SDM120CT_sniff_covered(const SDM120CT_read_type *r, int64_t now)
+{
+	const SDM120CT_refresh_class_type *rc= &SDM120CT_refresh_class[r->refresh];
+	int64_t max_age= 1000LL * (rc->period_ms + SDM120CT_PASSIVE_GRACE_MS);
+	bool covered= true;
+	taskENTER_CRITICAL(&SDM120CT_sniff_lock);
+	for(int i=0; i<rc->map_n && covered; i++)
+	{
+		uint16_t reg= rc->map[i].reg;
+		if(reg < r->request.start || reg >= r->request.start + r->request.count) continue;
+		int64_t time= modbus_image_time(&SDM120CT_sniff_image, reg);
+		covered= time != 0 && now - time <= max_age;
+	}
+	taskEXIT_CRITICAL(&SDM120CT_sniff_lock);
+	return covered;
+} // SDM120CT_sniff_covered
+
+// Listen before talking
+// return	true another master polls the meter
+static bool SDM120CT_sniff_listen(void)
+{
+	printf("\nSDM120CT listening %d s for another master", SDM120CT_PASSIVE_LISTEN_SEC);
+	fflush(stdout);
+	vTaskDelay(1000 * SDM120CT_PASSIVE_LISTEN_SEC / portTICK_PERIOD_MS);
+	printf("\nSDM120CT %lu transactions of another master", SDM120CT_sniffed);
+	return SDM120CT_sniffed > 0;
+} // SDM120CT_sniff_listen
+#endif
+
+static int SDM120CT_plan_map(const char *name, const modbus_register_map_type *map, int map_n, modbus_read_request_type *list)
+{
+	modbus_read_request_type wanted[32];
+	const modbus_plan_limits_type limits= {
+		.max_gap= SDM120CT_PLAN_MAX_GAP,
+		.max_count= MODBUS_MAX_READ_REGISTERS,
+		.forbidden= 0,
+		.forbidden_n= 0
+	};
+	int n_wanted= 0;
+	for(int i=0; i<map_n && n_wanted<(int)(sizeof(wanted)/sizeof(wanted[0])); i++, n_wanted++)
+	{
+		wanted[n_wanted].start= map[i].reg;
+		wanted[n_wanted].count= modbus_register_width(map[i].type);
+	}
+	int n= modbus_plan_reads(wanted, n_wanted, &limits, list, SDM120CT_PLAN_MAX);
+	if(n < 0)
+	{
+		printf("\n[ERROR] SDM120CT %s plan does not fit in %d requests", name, SDM120CT_PLAN_MAX);
+		n= 0;
+	}
+	list[n].start= 0xFFFF;
+	list[n].count= 0;
+	printf("\nSDM120CT %s: %d registers in %d requests, bus time %lu ms", name, n_wanted, n, 
+		modbus_plan_bus_time_us(list, n, SDM120CT_BAUDRATE, SDM120CT_TURNAROUND_US) / 1000);
+	for(int i=0; i<n; i++) printf("\n   %04X %d", list[i].start, list[i].count);
+	return n;
+} // SDM120CT_plan_map
+
+// Build the query lists from the register maps
+// Call again whenever a register map changes
+void SDM120CT_plan(void)
+{
+	modbus_read_request_type list[SDM120CT_PLAN_MAX + 1];
+	SDM120CT_plan_map("device info", SDM120CT_deviceinfo_map, MODBUS_REGISTER_MAP_SIZE(SDM120CT_deviceinfo_map), SDM120CT_deviceinfo_query_list);
+	SDM120CT_reads_n= 0;
+	for(int c=0; c<SDM120CT_REFRESH_CLASSES; c++)
+	{
+		SDM120CT_refresh_class_type *rc= &SDM120CT_refresh_class[c];
+		int n= SDM120CT_plan_map(rc->name, rc->map, rc->map_n, list);
+		printf(" every %lu ms", rc->period_ms);
+		for(int i=0; i<n; i++)
+		{
+			SDM120CT_read_type *r= &SDM120CT_reads[SDM120CT_reads_n ++];
+			r->request= list[i];
+			r->refresh= c;
+			r->state= SDM120CT_READ_IDLE;
+			r->deadline= 0;
+		}
+	}
+#if SDM120CT_PASSIVE_FIRST
+	SDM120CT_sniff_plan();
+#endif
+	printf("\n");
+	fflush(stdout);
+} // SDM120CT_plan
+
+void SDM120CT_send_query_list(void);
+
+// Completion of one read of the device info list
+// One lost or bad response only costs its own values, the rest of the list goes on
+static void SDM120CT_response(const modbus_transaction_type *t, int status, uint8_t *data, int len)
+{
+	if(status == MODBUS_STATUS_OK) 
+		SDM120CT_rxdata_process(t->function, t->start, data);
+	else if(status == MODBUS_STATUS_EXCEPTION)
+		printf("\nERROR: SDM120CT %04X exception %02X", t->start, data[2]);
+	else
+		printf("\nERROR: SDM120CT %04X %s", t->start, status == MODBUS_STATUS_TIMEOUT ? "timeout" : "bad response");
+	// last read of the list
+	if(SDM120CT_deviceinfo_query_list[t->tag + 1].start == 0xFFFF)
+	{
+		SDM120CT_callback(SDM120CT_sequence_phase);
+		// device info done, measurements start when the master idle hook wakes up the scheduler
 		SDM120CT_sequence_phase= DATA;
-		SDM120CT_query_list= ( uint16_t *) &SDM120CT_data_query_list;
-		return r;
 	}
-	if(SDM120CT_sequence_phase == INFO)
+	fflush(stdout);
+} // SDM120CT_response
+
+// Queue the device info reads
+void SDM120CT_send_query_list(void)
+{
+	for(int i=0; SDM120CT_deviceinfo_query_list[i].start != 0xFFFF; i++)
 	{
-		modbus_holding_parameter_query_type query = MODBUS_HOLDING_PARAMETER_DEFAULT(SDM120CT_deviceinfo_query_list[SDM120CT_query_index]);
-		query.Error_Check= CRC16( (uint8_t *) &query, sizeof(query) - 2 );
-		char *q= (char*)&query;
-		size_t sz= sizeof(query);
-		t0= esp_timer_get_time();
-		int txBytes= uart_write_bytes(UART_NUM_1, q, sz);
-		if(txBytes != (int) sz) printf("\n[ERROR] SDM120CT_send_queryTx uart_write_bytes %2d bytes", txBytes);	
+		modbus_transaction_type t= {
+			.slave= SDM120CT_MODBUS_ADDRESS,
+			.function= SDM120CT_FC_READHOLDING,
+			.start= SDM120CT_deviceinfo_query_list[i].start,
+			.count= SDM120CT_deviceinfo_query_list[i].count,
+			.timeout_ms= 0,
+			.retries= MODBUS_MASTER_RETRIES,
+			.tag= i,
+			.callback= SDM120CT_response
+		};
+		modbus_master_submit(&SDM120CT_master, &t);
 	}
+} // SDM120CT_send_query_list
+
+// Completion of a scheduled measurement read (master task)
+static void SDM120CT_scheduled_response(const modbus_transaction_type *t, int status, uint8_t *data, int len)
+{
+	SDM120CT_read_type *r= &SDM120CT_reads[t->tag];
+	SDM120CT_refresh_class_type *rc= &SDM120CT_refresh_class[r->refresh];
+	if(status == MODBUS_STATUS_OK) 
+		SDM120CT_rxdata_process(t->function, t->start, data);
+	else if(status == MODBUS_STATUS_EXCEPTION)
+		printf("\nERROR: SDM120CT %04X exception %02X", t->start, data[2]);
 	else
+		printf("\nERROR: SDM120CT %04X %s", t->start, status == MODBUS_STATUS_TIMEOUT ? "timeout" : "bad response");
+	// the link, not the register: exceptions do not count
+	if(status >= MODBUS_STATUS_OK) SDM120CT_read_failures= 0;
+	else SDM120CT_read_failures ++;
+	if(esp_timer_get_time() > r->deadline) rc->deadline_misses ++;
+	r->state= SDM120CT_READ_IDLE;
+	// last read of this release
+	if(-- rc->pending == 0)
 	{
-		modbus_master_query_type query = MODBUS_QUERY_DEFAULT(SDM120CT_data_query_list[SDM120CT_query_index]);
-		query.Error_Check= CRC16( (uint8_t *) &query, sizeof(query) - 2 );
-		char *q= (char*)&query;
-		size_t sz= sizeof(query);
-		t0= esp_timer_get_time();
-		int txBytes= uart_write_bytes(UART_NUM_1, q, sz);
-		if(txBytes != (int) sz) printf("\n[ERROR] SDM120CT_send_queryTx uart_write_bytes %2d bytes", txBytes);
+		rc->cycles ++;
+		if(r->refresh == SDM120CT_CLASS_NORMAL) SDM120CT_callback(DATA);
 	}
-	return 0;	
-} // SDM120CT_send_query
+	fflush(stdout);
+} // SDM120CT_scheduled_response
 
+// The master is idle (master task): next read, back to back
+static void SDM120CT_master_idle(void *arg)
+{
+	if(SDM120CT_TX_handle) xTaskNotifyGive(SDM120CT_TX_handle);
+} // SDM120CT_master_idle
 
-#define LOOP_DELAY_MS				1000
-#define SEC2LOOPS(x)				(x * 1000/LOOP_DELAY_MS)
-#define DATA_REFRESH_TIME			SEC2LOOPS(SDM120CT_DATA_REFRESH_SEC)	// Send the query list every x seconds
+// Release the classes that are due and send the due read with the earliest deadline
+static void SDM120CT_schedule(int64_t now)
+{
+	for(int c=0; c<SDM120CT_REFRESH_CLASSES; c++)
+	{
+		SDM120CT_refresh_class_type *rc= &SDM120CT_refresh_class[c];
+		if(now < rc->release) continue;
+		int64_t period= 1000LL * rc->period_ms;
+		// the previous release has not completed yet
+		if(rc->pending > 0) rc->deadline_misses ++;
+		else
+		{
+			for(int i=0; i<SDM120CT_reads_n; i++)
+			{
+				SDM120CT_read_type *r= &SDM120CT_reads[i];
+				if(r->refresh != c) continue;
+#if SDM120CT_PASSIVE_FIRST
+				// another master keeps it fresh
+				if(SDM120CT_sniff_covered(r, now))
+				{
+					SDM120CT_sniff_skipped ++;
+					continue;
+				}
+#endif
+				r->deadline= now + period;
+				r->state= SDM120CT_READ_DUE;
+				rc->pending ++;
+			}
+#if SDM120CT_PASSIVE_FIRST
+			// nothing to send
+			if(rc->pending == 0)
+			{
+				rc->cycles ++;
+				if(c == SDM120CT_CLASS_NORMAL) SDM120CT_callback(DATA);
+			}
+#endif
+		}
+		rc->release += period;
+		if(rc->release <= now) rc->release= now + period;
+	}
+	// one read on the bus at a time so that a read released later with an earlier deadline goes next
+	if(!modbus_master_idle(&SDM120CT_master)) return;
+	SDM120CT_read_type *next= 0;
+	for(int i=0; i<SDM120CT_reads_n; i++)
+	{
+		SDM120CT_read_type *r= &SDM120CT_reads[i];
+		if(r->state != SDM120CT_READ_DUE) continue;
+		if(!next || r->deadline < next->deadline || 
+			(r->deadline == next->deadline && SDM120CT_refresh_class[r->refresh].priority > SDM120CT_refresh_class[next->refresh].priority)) 
+			next= r;
+	}
+	if(!next) return;
+	next->state= SDM120CT_READ_BUSY;
+	modbus_transaction_type t= {
+		.slave= SDM120CT_MODBUS_ADDRESS,
+		.function= SDM120CT_FC_READINPUT,
+		.start= next->request.start,
+		.count= next->request.count,
+		.timeout_ms= 0,
+		.retries= MODBUS_MASTER_RETRIES,
+		.tag= next - SDM120CT_reads,
+		.callback= SDM120CT_scheduled_response
+	};
+	if(modbus_master_submit(&SDM120CT_master, &t) != 0) next->state= SDM120CT_READ_DUE;
+} // SDM120CT_schedule
+
+// Consistent copy of the latest measurements and of their capture times (snapshot may be 0)
+// never blocks the writers
+void SDM120CT_data_snapshot(SDM120CT_data_type *data, measurement_snapshot_type *snapshot)
+{
+	measurement_store_get(&SDM120CT_store, data, snapshot);
+} // SDM120CT_data_snapshot
+
+void SDM120CT_data_get(SDM120CT_data_type *data)
+{
+	measurement_store_get(&SDM120CT_store, data, 0);
+} // SDM120CT_data_get
+
+// Every decoded value with its capture time (us), called by the task that decodes
+void SDM120CT_data_hook(void (*sample) (void *arg, size_t offset, float value, int64_t time), void *arg)
+{
+	measurement_store_hook(&SDM120CT_store, sample, arg);
+} // SDM120CT_data_hook
+
+void SDM120CT_measurements_printf(void)
+{
+	measurement_store_printf(&SDM120CT_store);
+} // SDM120CT_measurements_printf
+
+void SDM120CT_scheduler_printf(void)
+{
+	for(int c=0; c<SDM120CT_REFRESH_CLASSES; c++)
+	{
+		SDM120CT_refresh_class_type *rc= &SDM120CT_refresh_class[c];
+		fprintf(stdout, "\n%-8s %6lu ms  cycles %6lu  deadline misses %lu", rc->name, rc->period_ms, rc->cycles, rc->deadline_misses);
+	}
+#if SDM120CT_PASSIVE_FIRST
+	fprintf(stdout, "\npassive first: %lu transactions of another master, %lu reads not sent", SDM120CT_sniffed, SDM120CT_sniff_skipped);
+	modbus_sniffer_printf(&SDM120CT_sniffer);
+#endif
+	fprintf(stdout, "\n");
+} // SDM120CT_scheduler_printf
+
+// Master statistics and response time estimate
+int SDM120CT_modbus_json(char *buffer, size_t sz)
+{
+	return modbus_master_json(&SDM120CT_master, buffer, sz);
+} // SDM120CT_modbus_json
+
+/**
+---------------------------------------------------------------------------------------------------
+		
+								   BAUD RATE
+
+---------------------------------------------------------------------------------------------------
+The meter rate is the float code in the holding register SDM120CT_REG_BAUDRATE. The meter keeps it
+across an ESP32 restart, so SDM120CT_baudrate_startup() runs before the device info:
+- finds the meter: a read of the register at SDM120CT_BAUDRATE, then at the other rates from the 
+  highest down. The rate the meter answers at is the link rate, the register may hold a new code 
+  that is not in use yet
+- with SDM120CT_BAUDRATE_NEGOTIATE tries the rates above it from SDM120CT_BAUDRATE_MAX down: FC10 
+  write of the code (answered at the old rate), UART1 switched, SDM120CT_BAUDRATE_TEST_READS reads 
+  of the voltage. An exception (rate not supported) or more than SDM120CT_BAUDRATE_TEST_ERRORS 
+  failed reads and the meter is set back to the previous rate
+While polling, SDM120CT_BAUDRATE_FALLBACK_ERRORS consecutive failed reads stop the scheduler: above
+SDM120CT_BAUDRATE the meter and UART1 go back to SDM120CT_BAUDRATE, and if the meter does not answer 
+it is looked for at every rate. Negotiation is not tried again until restart.
+Code 3 (19200) and 4 (38400) are not in every SDM120 firmware, those meters answer the write with 
+an exception and stay where they are.
+**/
+typedef struct SDM120CT_baudrate_s
+{
+	uint8_t code;					// SDM120CT_REG_BAUDRATE value
+	uint32_t baud_rate;
+} SDM120CT_baudrate_type;
+
+// Highest first
+static const SDM120CT_baudrate_type SDM120CT_baudrates[]= {
+	{4, 38400}, {3, 19200}, {2, 9600}, {1, 4800}, {0, 2400}, {5, 1200}
+};
+#define SDM120CT_BAUDRATES		(sizeof(SDM120CT_baudrates) / sizeof(SDM120CT_baudrates[0]))
+
+static uint32_t SDM120CT_baudrate= SDM120CT_BAUDRATE;		// UART1 now
+static uint32_t SDM120CT_fallbacks;
+static uint32_t SDM120CT_scans;
+
+// Synchronous transactions for the TX task, with the scheduler stopped
+static SemaphoreHandle_t SDM120CT_sync_done;
+static int SDM120CT_sync_status;
+static uint8_t SDM120CT_sync_frame[MODBUS_RTU_FRAME_MAX];
+
+static void SDM120CT_sync_response(const modbus_transaction_type *t, int status, uint8_t *data, int len)
+{
+	SDM120CT_sync_status= status;
+	if(data) memcpy(SDM120CT_sync_frame, data, len);
+	xSemaphoreGive(SDM120CT_sync_done);
+} // SDM120CT_sync_response
+
+// return	MODBUS_STATUS_xxx, the response in SDM120CT_sync_frame
+static int SDM120CT_transact(uint8_t function, uint16_t start, uint16_t count, const uint16_t *values, uint8_t retries)
+{
+	modbus_transaction_type t= {
+		.slave= SDM120CT_MODBUS_ADDRESS,
+		.function= function,
+		.start= start,
+		.count= count,
+		.timeout_ms= 0,
+		.retries= retries,
+		.tag= 0,
+		.callback= SDM120CT_sync_response
+	};
+	if(values) memcpy(t.values, values, count * sizeof(uint16_t));
+	if(modbus_master_submit(&SDM120CT_master, &t) != 0) return MODBUS_STATUS_TIMEOUT;
+	xSemaphoreTake(SDM120CT_sync_done, portMAX_DELAY);
+	return SDM120CT_sync_status;
+} // SDM120CT_transact
+
+static const SDM120CT_baudrate_type *SDM120CT_baudrate_find(uint32_t baud_rate)
+{
+	for(int i=0; i<SDM120CT_BAUDRATES; i++) if(SDM120CT_baudrates[i].baud_rate == baud_rate) return &SDM120CT_baudrates[i];
+	return 0;
+} // SDM120CT_baudrate_find
+
+static void SDM120CT_uart_baudrate(uint32_t baud_rate)
+{
+	if(baud_rate == SDM120CT_baudrate) return;
+	modbus_uart_set_baudrate(&SDM120CT_uart, baud_rate);
+	modbus_master_set_baudrate(&SDM120CT_master, baud_rate);
+	SDM120CT_baudrate= baud_rate;
+	vTaskDelay(SDM120CT_BAUDRATE_SETTLE_MS / portTICK_PERIOD_MS);
+} // SDM120CT_uart_baudrate
+
+// Register value at the current rate
+// return	the rate coded in the register, 0 no answer, -1 unknown code
+static int32_t SDM120CT_baudrate_read(void)
+{
+	if(SDM120CT_transact(SDM120CT_FC_READHOLDING, SDM120CT_REG_BAUDRATE, 2, 0, 1) != MODBUS_STATUS_OK) return 0;
+	int code= (int) (record2float(&SDM120CT_sync_frame[3]) + 0.5f);
+	for(int i=0; i<SDM120CT_BAUDRATES; i++) if(SDM120CT_baudrates[i].code == code) return SDM120CT_baudrates[i].baud_rate;
+	return -1;
+} // SDM120CT_baudrate_read
 
+static int SDM120CT_baudrate_write(const SDM120CT_baudrate_type *b)
+{
+	uint8_t data[4];
+	float2record((float) b->code, data);
+	uint16_t values[2]= { data[0] << 8 | data[1], data[2] << 8 | data[3] };
+	return SDM120CT_transact(SDM120CT_FC_WRITEHOLDING, SDM120CT_REG_BAUDRATE, 2, values, 1);
+} // SDM120CT_baudrate_write
+
+// Look for the meter, current rate first
+// return	the rate it answers at (UART1 left there), 0 not found (UART1 at SDM120CT_BAUDRATE)
+static uint32_t SDM120CT_baudrate_scan(void)
+{
+	SDM120CT_scans ++;
+	int32_t reg= SDM120CT_baudrate_read();
+	for(int i=0; reg == 0 && i<SDM120CT_BAUDRATES; i++)
+	{
+		if(SDM120CT_baudrates[i].baud_rate == SDM120CT_baudrate) continue;
+		SDM120CT_uart_baudrate(SDM120CT_baudrates[i].baud_rate);
+		reg= SDM120CT_baudrate_read();
+	}
+	if(reg == 0)
+	{
+		printf("\nERROR: SDM120CT no answer at any rate");
+		SDM120CT_uart_baudrate(SDM120CT_BAUDRATE);
+		return 0;
+	}
+	if(reg != SDM120CT_baudrate) printf("\nSDM120CT answers at %lu baud, register %ld (applied at the next meter restart)", SDM120CT_baudrate, reg);
+	return SDM120CT_baudrate;
+} // SDM120CT_baudrate_scan
+
+// Meter and UART1 back to baud_rate, written at the current rate, where the meter may not answer
+// return	0 the meter answers at baud_rate
+static int SDM120CT_baudrate_restore(uint32_t baud_rate)
+{
+	const SDM120CT_baudrate_type *b= SDM120CT_baudrate_find(baud_rate);
+	SDM120CT_baudrate_write(b);
+	SDM120CT_uart_baudrate(baud_rate);
+	int32_t reg= SDM120CT_baudrate_read();
+	if(reg == 0) return -1;
+	// the meter never left baud_rate but its register holds the rejected code
+	if(reg != baud_rate) SDM120CT_baudrate_write(b);
+	return 0;
+} // SDM120CT_baudrate_restore
+
+// return	0 link verified at b, -1 back at the previous rate
+static int SDM120CT_baudrate_switch(const SDM120CT_baudrate_type *b)
+{
+	uint32_t previous= SDM120CT_baudrate;
+	int status= SDM120CT_baudrate_write(b);
+	if(status == MODBUS_STATUS_EXCEPTION)
+	{
+		printf("\nSDM120CT %lu baud not supported", b->baud_rate);
+		return -1;
+	}
+	// a lost response does not mean the meter did not switch
+	SDM120CT_uart_baudrate(b->baud_rate);
+	int failures= 0;
+	for(int i=0; i<SDM120CT_BAUDRATE_TEST_READS; i++)
+		if(SDM120CT_transact(SDM120CT_FC_READINPUT, SDM120CT_REG_VOLTAGE, 2, 0, 0) != MODBUS_STATUS_OK) failures ++;
+	printf("\nSDM120CT %lu baud: %d of %d test reads failed", b->baud_rate, failures, SDM120CT_BAUDRATE_TEST_READS);
+	if(failures <= SDM120CT_BAUDRATE_TEST_ERRORS) return 0;
+	if(SDM120CT_baudrate_restore(previous) != 0) SDM120CT_baudrate_scan();
+	return -1;
+} // SDM120CT_baudrate_switch
+
+// Before the device info
+static void SDM120CT_baudrate_startup(void)
+{
+#if SDM120CT_PASSIVE_FIRST
+	// the meter answers another master at SDM120CT_BAUDRATE, leave it there
+	if(SDM120CT_sniff_listen()) return;
+#endif
+	if(SDM120CT_baudrate_scan() == 0) return;
+#if SDM120CT_BAUDRATE_NEGOTIATE
+	for(int i=0; i<SDM120CT_BAUDRATES; i++)
+	{
+		const SDM120CT_baudrate_type *b= &SDM120CT_baudrates[i];
+		if(b->baud_rate > SDM120CT_BAUDRATE_MAX || b->baud_rate <= SDM120CT_baudrate) continue;
+		if(SDM120CT_baudrate_switch(b) == 0) break;
+	}
+#endif
+	printf("\nSDM120CT link at %lu baud\n", SDM120CT_baudrate);
+	fflush(stdout);
+} // SDM120CT_baudrate_startup
+
+// Repeated read failures while polling, scheduler stopped and master idle
+static void SDM120CT_baudrate_fallback(void)
+{
+	SDM120CT_read_failures= 0;
+	if(SDM120CT_baudrate != SDM120CT_BAUDRATE)
+	{
+		SDM120CT_fallbacks ++;
+		printf("\nSDM120CT %lu baud: %d failed reads, back to %d", SDM120CT_baudrate, SDM120CT_BAUDRATE_FALLBACK_ERRORS, SDM120CT_BAUDRATE);
+		if(SDM120CT_baudrate_restore(SDM120CT_BAUDRATE) == 0) return;
+	}
+	SDM120CT_baudrate_scan();
+	fflush(stdout);
+} // SDM120CT_baudrate_fallback
+
+void SDM120CT_modbus_printf(void)
+{
+	modbus_master_printf(&SDM120CT_master);
+	fprintf(stdout, "   %lu baud, %lu fallbacks, %lu meter scans\n", SDM120CT_baudrate, SDM120CT_fallbacks, SDM120CT_scans);
+} // SDM120CT_modbus_printf
+
+// UART1 load and frame quality, summary for MQTT
+int SDM120CT_bus_json(char *buffer, size_t sz, int summary)
+{
+	return summary ? modbus_uart_summary_json(&SDM120CT_uart, buffer, sz) : modbus_uart_json(&SDM120CT_uart, buffer, sz);
+} // SDM120CT_bus_json
+
+void SDM120CT_bus_printf(void)
+{
+	modbus_uart_printf(&SDM120CT_uart);
+} // SDM120CT_bus_printf
+
+#define SCHEDULER_TICK_MS			100
 
 void SDM120CT_TX_task(void *arg)
 {
-	int request_time_sec= 0;
+	// line rate, then device info, SDM120CT_response() switches to DATA when done
+	SDM120CT_baudrate_startup();
+	SDM120CT_send_query_list();
 	while (1) 
 	{
-		if( -- request_time_sec <= 0 )
+		// woken up by a completion or every tick for the releases
+		ulTaskNotifyTake(pdTRUE, SCHEDULER_TICK_MS / portTICK_PERIOD_MS);
+		if(SDM120CT_sequence_phase != DATA) continue;
+		// link lost: no new reads, recover once the pending ones are done
+		if(SDM120CT_read_failures >= SDM120CT_BAUDRATE_FALLBACK_ERRORS)
 		{
-			request_time_sec= DATA_REFRESH_TIME;
-			SDM120CT_query_index= 0;
-			SDM120CT_send_query();
+			if(modbus_master_idle(&SDM120CT_master)) SDM120CT_baudrate_fallback();
+			continue;
 		}
-		// vTaskDelay() - Delays a task for a given number of ticks
-		// portTICK_PERIOD_MS - one tick period in milliseconds. The unit of portTICK_PERIOD_MS is milliseconds/ticks
-		vTaskDelay(1000 / portTICK_PERIOD_MS);	 // 1.000 ms = 1 sec 		
+		SDM120CT_schedule(esp_timer_get_time());
 	}
 } // SDM120CT_TX_task
 
+// Complete, CRC-checked frame from the frame assembler
+void SDM120CT_frame(uint8_t* data, int len)
+{
+	// responses complete the master transactions, anything else is ignored by the master
+	modbus_master_frame(&SDM120CT_master, data, len);
+#if SDM120CT_PASSIVE_FIRST
+	modbus_sniffer_frame(&SDM120CT_sniffer, data, len, esp_timer_get_time());
+#endif
+} // SDM120CT_frame
+
 void SDM120CT_RX_task(void *arg)
 {
     static const char *RX_TASK_TAG = "RX_TASK";
     esp_log_level_set(RX_TASK_TAG, ESP_LOG_INFO);
-    uint8_t* data = (uint8_t*) malloc(RX_BUF_SIZE);
     while (1) {
-        int rxBytes = uart_read_bytes(UART_NUM_1, data, RX_BUF_SIZE, 200 / portTICK_PERIOD_MS);
-        if (rxBytes > 0) 
-		{		
-			uint8_t Byte_Count= rxBytes>2? data[2] : 0;
-			if(Byte_Count+2 == rxBytes-3)
-			{
-				int64_t t1= esp_timer_get_time();
-				uint16_t ErrorCheck= data[8]<<8 | data[7];
-				uint16_t crc= CRC16( data, rxBytes - 2);
-				if(crc == ErrorCheck)
-				{
-					// SDM120CT_query_index == -1 means it is not a response to my request but traffic sniffed 
-					if(SDM120CT_query_index >= 0)
-					{
-						SDM120CT_rxdata_process(SDM120CT_query_list[SDM120CT_query_index], data);
-						if(_VERBOSE_) printf(" (elapsed %lld ms)", (t1 - t0) / 1000);	
-						SDM120CT_query_index ++;
-						if(SDM120CT_send_query() == 1) 
-						{
-							SDM120CT_query_index= 0; 
-							SDM120CT_send_query();
-						}
-					}
-				}
-				else
-					printf("\nERROR: CRC16 0x%4X  ErrorCheck 0x%4X", crc, ErrorCheck);
-			}
-			else
-				printf("\nERROR: Byte_Count %d bytes", Byte_Count);
-			fflush(stdout);
-        }
+		// wakes up on UART events, frames are delivered to SDM120CT_frame()
+		// CRC errors and truncated frames are counted in SDM120CT_uart.stats
+		modbus_uart_receive(&SDM120CT_uart);
     }
-    free(data);
 } // SDM120CT_RX_task
 
 void SDM120CT_create(void (*callback) (SDM120CT_sequence_phase_t), UBaseType_t uxPriority)
 {
 	// Init data
-	memset(&SDM120CT_data, 0, sizeof(struct SDM120CT_data_s));
+	for(int c=0; c<SDM120CT_REFRESH_CLASSES; c++)
+		for(int i=0; i<SDM120CT_refresh_class[c].map_n; i++)
+			for(int f=0; f<MODBUS_REGISTER_MAP_SIZE(SDM120CT_fields); f++)
+				if(SDM120CT_fields[f].offset == SDM120CT_refresh_class[c].map[i].offset)
+					SDM120CT_fields[f].stale_ms= SDM120CT_STALE_PERIODS * SDM120CT_refresh_class[c].period_ms;
+	measurement_store_init(&SDM120CT_store, "SDM120CT", &SDM120CT_data, sizeof(SDM120CT_data_type), SDM120CT_fields, MODBUS_REGISTER_MAP_SIZE(SDM120CT_fields));
 	memset(&SDM120CT_device_info, 0, sizeof(struct SDM120CT_device_info_s));
 
 	SDM120CT_callback= callback;
+	SDM120CT_sync_done= xSemaphoreCreateBinary();
+#if SDM120CT_PASSIVE_FIRST
+	modbus_sniffer_init(&SDM120CT_sniffer, SDM120CT_sniff_transaction, 0);
+#endif
+	SDM120CT_plan();
 	
-  	SDM120CT_query_index= -1,
 	SDM120CT_sequence_phase= INFO;
- 	SDM120CT_query_list= ( uint16_t *) &SDM120CT_deviceinfo_query_list;	
 
 	// Init serial
 	SDM120CT_uart_init();
 	// TX/RX over serial
+	modbus_master_create(&SDM120CT_master, UART_NUM_1, "SDM120CT_master", uxPriority);
+	modbus_master_on_idle(&SDM120CT_master, SDM120CT_master_idle, 0);
 	xTaskCreate(SDM120CT_RX_task, "SDM120CT_rx_task", 4*1024, NULL, uxPriority, NULL);
-	xTaskCreate(SDM120CT_TX_task, "SDM120CT_tx_task", 4*1024, NULL, uxPriority, NULL);
+	xTaskCreate(SDM120CT_TX_task, "SDM120CT_tx_task", 4*1024, NULL, uxPriority, &SDM120CT_TX_handle);
 } // SDM120CT_create
 
 // END OF FILE
\ No newline at end of file
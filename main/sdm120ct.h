@@ -1,7 +1,29 @@
 #ifndef _SDM120CT_H_
 #define _SDM120CT_H_
 
-#define SDM120CT_DATA_REFRESH_SEC	30	// Send the query list every x seconds
+// Refresh classes
+#define SDM120CT_FAST_REFRESH_MS	1000	// active power
+#define SDM120CT_DATA_REFRESH_SEC	30		// voltage, current, power, power factor, frequency (published)
+#define SDM120CT_SLOW_REFRESH_SEC	300		// energy counters
+#define SDM120CT_STALE_PERIODS		3		// a value not refreshed for this many periods of its class is stale
+#define SDM120CT_BLOCK_READ			1	// 1: measurements in two block reads (0x0000..0x001F, 0x0046..0x0047) 0: one query per register
+#define SDM120CT_PLAN_MAX_GAP		(SDM120CT_BLOCK_READ ? 16 : 0)	// unwanted registers read to merge two wanted ones
+#define SDM120CT_PLAN_MAX			8	// read requests per query list
+#define SDM120CT_TURNAROUND_US		20000	// meter response time, for the bus time estimate
+
+// Line rate (see BAUD RATE in sdm120ct.c)
+#define SDM120CT_BAUDRATE					9600	// UART1 at startup, the meter default
+#define SDM120CT_BAUDRATE_NEGOTIATE			0		// 1: at startup switch the meter and UART1 to the highest rate that passes the test reads
+#define SDM120CT_BAUDRATE_MAX				38400	// highest rate tried
+#define SDM120CT_BAUDRATE_TEST_READS		20		// link test after a switch
+#define SDM120CT_BAUDRATE_TEST_ERRORS		0		// failed test reads allowed
+#define SDM120CT_BAUDRATE_FALLBACK_ERRORS	5		// consecutive failed reads: back to SDM120CT_BAUDRATE, or look for the meter
+#define SDM120CT_BAUDRATE_SETTLE_MS			100		// after a rate change
+
+// Passive first (see PASSIVE FIRST in sdm120ct.c)
+#define SDM120CT_PASSIVE_FIRST				0		// 1: take the values from another master's traffic when it covers them
+#define SDM120CT_PASSIVE_LISTEN_SEC			10		// listen before sending anything
+#define SDM120CT_PASSIVE_GRACE_MS			500		// a sniffed value is fresh for the class period plus this
 
 /*
 samples
@@ -81,41 +103,10 @@ samples
 #define SDM120CT_REG_SOFTWAREVERSION				0xFC03		// Software version ( 2 bytes Hex ) 
 
 
-#define MODBUS_QUERY_DEFAULT(address) 		\
-    {                         				\
-        .Slave_Adress =     1, 				\
-        .Function_code =    4,  			\
-        .Start_Address =    ENDIAN(address),\
-		.Number_of_Points = ENDIAN(0x0002),	\
-        .Error_Check =      0 				\
-     }
-	 
-typedef struct modbus_master_query_s
-{ 
-	uint8_t Slave_Adress;			
-	uint8_t Function_code;	
-	uint16_t Start_Address;
-	uint16_t Number_of_Points;
-	uint16_t Error_Check;
-} modbus_master_query_type;
-
-#define MODBUS_HOLDING_PARAMETER_DEFAULT(address) 		\
-    {                         				\
-        .Slave_Adress =     1, 				\
-        .Function_code =    3,  			\
-        .Start_Address =    ENDIAN(address),\
-		.Number_of_Points = ENDIAN(0x0002),	\
-        .Error_Check =      0 				\
-     }
-
-typedef struct modbus_holding_parameter_query_s
-{ 
-	uint8_t Slave_Adress;			
-	uint8_t Function_code;
-	uint16_t Start_Address;
-	uint16_t Number_of_Points;
-	uint16_t Error_Check;
-} modbus_holding_parameter_query_type;
+#define SDM120CT_MODBUS_ADDRESS				1		// Default ID is 1
+#define SDM120CT_FC_READHOLDING				0x03	// holding parameters (device info)
+#define SDM120CT_FC_READINPUT				0x04	// input parameters (measurements)
+#define SDM120CT_FC_WRITEHOLDING			0x10	// holding parameters (baud rate)
 
 // ------------------------------------------------------------------------------------------------
 // Exposed interface
@@ -139,11 +130,22 @@ typedef struct SDM120CT_data_s
 	float ReactivePower;
 	float PowerFactor;
 	float Frecuency;
+	float ImportActiveEnergy;		// kWh
+	float ExportActiveEnergy;		// kWh
 } SDM120CT_data_type;
 
 extern SDM120CT_device_info_type SDM120CT_device_info;
-extern SDM120CT_data_type SDM120CT_data;
 
+void SDM120CT_data_get(SDM120CT_data_type *data);
+void SDM120CT_data_snapshot(SDM120CT_data_type *data, measurement_snapshot_type *snapshot);
+void SDM120CT_measurements_printf(void);
+void SDM120CT_data_hook(void (*sample) (void *arg, size_t offset, float value, int64_t time), void *arg);
+void SDM120CT_plan(void);
+void SDM120CT_scheduler_printf(void);
+int SDM120CT_modbus_json(char *buffer, size_t sz);
+void SDM120CT_modbus_printf(void);
+int SDM120CT_bus_json(char *buffer, size_t sz, int summary);
+void SDM120CT_bus_printf(void);
 void SDM120CT_create(void (*callback) (SDM120CT_sequence_phase_t SDM120CT_sequence_phase), UBaseType_t uxPriority);
 
 #endif
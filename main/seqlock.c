@@ -0,0 +1,88 @@
+/** ************************************************************************************************
+ *	Sequence lock
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - snapshots of the meter data
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+The meter data is written by the acquisition tasks (UART RX, MODBUS master) and read by the REST, 
+MQTT, Modbus slave and TCP tasks, on both cores. A reader must get the values of one update, not 
+the voltage of a frame and the current of the next one, and must never hold the writer up.
+
+	writer	seqlock_write_begin()	sequence odd
+			update the data
+			seqlock_write_end()		sequence even again
+
+	reader	do { s= seqlock_read_begin(); copy or decode the data } while(seqlock_read_retry(s));
+
+A reader that overlapped a write sees the sequence change and copies again, the writer does not 
+wait for anybody. The write runs in a critical section, it cannot be preempted on its core and it 
+is short (decode of one response, a few tens of bytes), so a reader on the other core spins at most
+for one write and a reader on the writer's core never sees a write in progress.
+More than one writer task (SDM120CT master and passive sniffer) is allowed: the writers are 
+serialized by the spinlock of the critical section, which the readers never take.
+The fences order the data accesses against the sequence on the dual core ESP32, the sequence 
+itself is a 32-bit aligned word, written and read in one access.
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>			// memcpy
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "seqlock.h"
+
+void seqlock_init(seqlock_type *lock)
+{
+	lock->sequence= 0;
+	portMUX_INITIALIZE(&lock->writer);
+	lock->retries= 0;
+} // seqlock_init
+
+void seqlock_write_begin(seqlock_type *lock)
+{
+	taskENTER_CRITICAL(&lock->writer);
+	lock->sequence ++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+} // seqlock_write_begin
+
+void seqlock_write_end(seqlock_type *lock)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	lock->sequence ++;
+	taskEXIT_CRITICAL(&lock->writer);
+} // seqlock_write_end
+
+// return	the sequence to give to seqlock_read_retry(), waits for an even one
+uint32_t seqlock_read_begin(seqlock_type *lock)
+{
+	uint32_t sequence;
+	while((sequence= lock->sequence) & 1) ;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return sequence;
+} // seqlock_read_begin
+
+// return	true the data read since seqlock_read_begin() may be torn, read again
+bool seqlock_read_retry(seqlock_type *lock, uint32_t sequence)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(lock->sequence == sequence) return false;
+	lock->retries ++;
+	return true;
+} // seqlock_read_retry
+
+// Consistent copy of size bytes at src
+void seqlock_read(seqlock_type *lock, void *dst, const void *src, size_t size)
+{
+	uint32_t sequence;
+	do
+	{
+		sequence= seqlock_read_begin(lock);
+		memcpy(dst, src, size);
+	} while(seqlock_read_retry(lock, sequence));
+} // seqlock_read
+
+// END OF FILE
\ No newline at end of file
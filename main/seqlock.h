@@ -0,0 +1,19 @@
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+typedef struct seqlock_s
+{
+	volatile uint32_t sequence;		// odd while a write is in progress
+	portMUX_TYPE writer;			// serializes the writers, readers never take it
+	uint32_t retries;				// reads repeated because of a concurrent write
+} seqlock_type;
+
+void seqlock_init(seqlock_type *lock);
+void seqlock_write_begin(seqlock_type *lock);
+void seqlock_write_end(seqlock_type *lock);
+uint32_t seqlock_read_begin(seqlock_type *lock);
+bool seqlock_read_retry(seqlock_type *lock, uint32_t sequence);
+void seqlock_read(seqlock_type *lock, void *dst, const void *src, size_t size);
+
+#endif
+// END OF FILE
\ No newline at end of file
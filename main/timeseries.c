@@ -0,0 +1,213 @@
+/** ************************************************************************************************
+ *	Time series
+ *  (c) Fernando R (iambobot.com)
+ *
+ * 	1.0.0 - fixed memory ring of scaled integer samples
+ *
+ ** ************************************************************************************************
+**/
+/** ***********************************************************************************************
+Recent history of one metric in a ring of fixed size, allocated at build time (TIMESERIES_STORAGE):
+the RAM budget of each metric is its number of records x 6 bytes, known before the firmware runs.
+
+	record		dt		uint16	ms since the previous record
+				value	int32	round(value x scale), e.g. scale 10 keeps 0.1 W
+	gap			dt TIMESERIES_GAP, value the time jump in ms; the sample that follows has dt 0
+
+A float and an int64 timestamp would take 12 bytes, the record takes 6 and keeps the resolution 
+of the meter. The oldest records are overwritten when the ring is full.
+
+Only the time of the oldest and of the newest record are kept: the time of any record is the 
+sum of the deltas. A read of the last N seconds walks back from the newest record, subtracting 
+deltas, to the first record in the range and then forward, so it costs the records read, not the
+records held.
+A mutex serializes the writer (one sampling task) and the readers (REST, MQTT).
+*********************************************************************************************** **/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>			// lroundf
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"		// esp_timer_get_time()
+
+#include "timeseries.h"
+
+void timeseries_init(timeseries_type *ts)
+{
+	ts->head= 0;
+	ts->n= 0;
+	ts->first_ms= 0;
+	ts->last_ms= 0;
+	ts->samples= 0;
+	ts->skipped= 0;
+	ts->overwritten= 0;
+	ts->mutex= xSemaphoreCreateMutex();
+} // timeseries_init
+
+// Ring index of the k-th record, 0 the oldest
+static int timeseries_index(const timeseries_type *ts, int k)
+{
+	return (ts->head - ts->n + k + ts->size) % ts->size;
+} // timeseries_index
+
+// Time from the previous record (ms)
+static int64_t timeseries_delta(const timeseries_type *ts, int i)
+{
+	return ts->dt[i] == TIMESERIES_GAP ? ts->value[i] : ts->dt[i];
+} // timeseries_delta
+
+// The oldest record is always a sample: a gap left first goes as well
+static void timeseries_drop(timeseries_type *ts)
+{
+	do
+	{
+		if(ts->dt[timeseries_index(ts, 0)] != TIMESERIES_GAP) ts->overwritten ++;
+		ts->n --;
+		if(ts->n > 0) ts->first_ms += timeseries_delta(ts, timeseries_index(ts, 0));
+	} while(ts->n > 0 && ts->dt[timeseries_index(ts, 0)] == TIMESERIES_GAP);
+} // timeseries_drop
+
+static void timeseries_push(timeseries_type *ts, uint16_t dt, int32_t value)
+{
+	if(ts->n == ts->size) timeseries_drop(ts);
+	ts->dt[ts->head]= dt;
+	ts->value[ts->head]= value;
+	ts->head= (ts->head + 1) % ts->size;
+	ts->n ++;
+} // timeseries_push
+
+// time_ms	capture time of the value
+// return	1 kept, 0 closer than interval_ms to the previous sample or older
+int timeseries_append(timeseries_type *ts, int64_t time_ms, float value)
+{
+	float scaled= value * ts->scale;
+	int32_t v= scaled >= (float) INT32_MAX ? INT32_MAX : scaled <= (float) -INT32_MAX ? -INT32_MAX : lroundf(scaled);
+	xSemaphoreTake(ts->mutex, portMAX_DELAY);
+	if(ts->n > 0 && time_ms < ts->last_ms + ts->interval_ms)
+	{
+		ts->skipped ++;
+		xSemaphoreGive(ts->mutex);
+		return 0;
+	}
+	if(ts->n == 0)
+	{
+		timeseries_push(ts, 0, v);
+		ts->first_ms= time_ms;
+	}
+	else
+	{
+		int64_t d= time_ms - ts->last_ms;
+		if(d < TIMESERIES_GAP) timeseries_push(ts, (uint16_t) d, v);
+		else
+		{
+			timeseries_push(ts, TIMESERIES_GAP, d > INT32_MAX ? INT32_MAX : (int32_t) d);
+			timeseries_push(ts, 0, v);
+		}
+	}
+	ts->last_ms= time_ms;
+	ts->samples ++;
+	xSemaphoreGive(ts->mutex);
+	return 1;
+} // timeseries_append
+
+// First record newer than from_ms, walking back from the newest one (mutex held)
+// time		time of that record
+// return	its position (0 the oldest), n if none
+static int timeseries_seek(const timeseries_type *ts, int64_t from_ms, int64_t *time)
+{
+	int64_t t= ts->last_ms;
+	int k= ts->n - 1;
+	for(; k>=0; k--)
+	{
+		if(t <= from_ms) break;
+		t -= timeseries_delta(ts, timeseries_index(ts, k));
+	}
+	// record k is at t (or none newer), the one after it at t + its delta
+	if(k + 1 < ts->n && k >= 0) t += timeseries_delta(ts, timeseries_index(ts, k + 1));
+	if(k < 0) t= ts->first_ms;
+	*time= t;
+	return k + 1;
+} // timeseries_seek
+
+// Samples newer than from_ms, oldest first
+// return	number of samples copied
+int timeseries_read(timeseries_type *ts, int64_t from_ms, timeseries_sample_type *sample, int max)
+{
+	int count= 0;
+	int64_t t;
+	xSemaphoreTake(ts->mutex, portMAX_DELAY);
+	int start= timeseries_seek(ts, from_ms, &t);
+	for(int k=start; k<ts->n && count<max; k++)
+	{
+		int i= timeseries_index(ts, k);
+		if(k > start) t += timeseries_delta(ts, i);
+		if(ts->dt[i] == TIMESERIES_GAP) continue;
+		sample[count].time= t;
+		sample[count].value= ts->value[i] / ts->scale;
+		count ++;
+	}
+	xSemaphoreGive(ts->mutex);
+	return count;
+} // timeseries_read
+
+// Samples newer than from_ms, as many as fit in the buffer
+// {"ts":"grid_ap","scale":10,"now":<ms>,"t":<ms>,"d":[[0,2345],[1000,2351],...]}
+// now is the uptime when written, t the time of the first sample, d the time since the previous 
+// sample (ms) and the scaled value
+// last_ms	time of the last sample written, unchanged if none
+// return	number of samples written
+int timeseries_json(timeseries_type *ts, int64_t from_ms, char *buffer, size_t sz, int64_t *last_ms)
+{
+	int count= 0;
+	int64_t t, previous= 0;
+	size_t len= 0;
+	if(sz < TIMESERIES_JSON_ROOM) return 0;
+	xSemaphoreTake(ts->mutex, portMAX_DELAY);
+	int start= timeseries_seek(ts, from_ms, &t);
+	for(int k=start; k<ts->n; k++)
+	{
+		int i= timeseries_index(ts, k);
+		if(k > start) t += timeseries_delta(ts, i);
+		if(ts->dt[i] == TIMESERIES_GAP) continue;
+		if(count == 0) 
+		{
+			len= snprintf(buffer, sz, "{\"ts\":\"%s\",\"scale\":%g,\"now\":%lld,\"t\":%lld,\"d\":[", 
+				ts->name, ts->scale, esp_timer_get_time() / 1000, t);
+			previous= t;
+		}
+		if(len + TIMESERIES_JSON_ROOM > sz) break;
+		len += snprintf(buffer + len, sz - len, "%s[%ld,%ld]", count ? "," : "", (long) (t - previous), (long) ts->value[i]);
+		previous= t;
+		count ++;
+	}
+	xSemaphoreGive(ts->mutex);
+	if(count == 0)
+		len= snprintf(buffer, sz, "{\"ts\":\"%s\",\"scale\":%g,\"now\":%lld,\"d\":[", ts->name, ts->scale, esp_timer_get_time() / 1000);
+	if(len < sz) snprintf(buffer + len, sz - len, "]}");
+	if(count && last_ms) *last_ms= previous;
+	return count;
+} // timeseries_json
+
+// Time of the newest sample, 0 if none
+int64_t timeseries_last_ms(timeseries_type *ts)
+{
+	xSemaphoreTake(ts->mutex, portMAX_DELAY);
+	int64_t t= ts->n ? ts->last_ms : 0;
+	xSemaphoreGive(ts->mutex);
+	return t;
+} // timeseries_last_ms
+
+void timeseries_printf(timeseries_type *ts)
+{
+	xSemaphoreTake(ts->mutex, portMAX_DELAY);
+	fprintf(stdout, "\n   %-10s %5d/%-5d records %6d bytes  span %6ld s  samples %7lu skipped %6lu overwritten %lu", 
+		ts->name, ts->n, ts->size, ts->size * (int) (sizeof(uint16_t) + sizeof(int32_t)), 
+		(long) (ts->n ? (ts->last_ms - ts->first_ms) / 1000 : 0),
+		(unsigned long) ts->samples, (unsigned long) ts->skipped, (unsigned long) ts->overwritten);
+	xSemaphoreGive(ts->mutex);
+} // timeseries_printf
+
+// END OF FILE
\ No newline at end of file
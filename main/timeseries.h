@@ -0,0 +1,46 @@
+#ifndef _TIMESERIES_H_
+#define _TIMESERIES_H_
+
+// Record: time since the previous record (ms) and the value as a scaled integer, 6 bytes
+// A gap of TIMESERIES_GAP ms or more is one extra record: dt TIMESERIES_GAP and the gap (ms) as value
+#define TIMESERIES_GAP				0xFFFF
+#define TIMESERIES_JSON_ROOM		32			// a sample and the closing brackets always fit
+
+typedef struct timeseries_sample_s
+{
+	int64_t time;				// ms
+	float value;
+} timeseries_sample_type;
+
+typedef struct timeseries_s
+{
+	const char *name;
+	float scale;				// stored value= round(value x scale)
+	uint32_t interval_ms;		// samples closer than this to the previous one are not kept
+	uint16_t *dt;				// size records (TIMESERIES_STORAGE)
+	int32_t *value;
+	int size;
+	int head;					// next record written
+	int n;						// records held
+	int64_t first_ms;			// time of the oldest record
+	int64_t last_ms;			// time of the newest record
+	uint32_t samples;			// appended
+	uint32_t skipped;			// closer than interval_ms or out of order
+	uint32_t overwritten;		// oldest dropped to make room
+	SemaphoreHandle_t mutex;
+} timeseries_type;
+
+// Fixed RAM budget: 6 bytes per record
+#define TIMESERIES_STORAGE(name, records)	static uint16_t name##_dt[records]; static int32_t name##_value[records]
+#define TIMESERIES(label, name, scale, interval_ms)	\
+	{ label, scale, interval_ms, name##_dt, name##_value, sizeof(name##_value) / sizeof(int32_t), 0, 0, 0, 0, 0, 0, 0, 0 }
+
+void timeseries_init(timeseries_type *ts);
+int timeseries_append(timeseries_type *ts, int64_t time_ms, float value);
+int timeseries_read(timeseries_type *ts, int64_t from_ms, timeseries_sample_type *sample, int max);
+int timeseries_json(timeseries_type *ts, int64_t from_ms, char *buffer, size_t sz, int64_t *last_ms);
+int64_t timeseries_last_ms(timeseries_type *ts);
+void timeseries_printf(timeseries_type *ts);
+
+#endif
+// END OF FILE
\ No newline at end of file